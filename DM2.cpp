@@ -8,6 +8,7 @@
 
 #include "DM2.h"
 #include "DOCIHamtilonian.h"
+#include "PairExcitations.h"
 #include "lapack.h"
 
 using namespace doci;
@@ -371,54 +372,54 @@ unsigned int DM2::get_n_sp() const
  * @param perm the Permutation object to use
  * @param eigv the eigenvector to build the DM2 from
  */
-void DM2::Build(Permutation &perm, std::vector<double> &eigv)
+void DM2::Build(Permutation &perm, const std::vector<double> &eigv)
 {
    auto num_t = omp_get_max_threads();
-   unsigned long long num_elems = (eigv.size()*1ul*(eigv.size()+1ul))/2;
-   unsigned long long size_part = num_elems/num_t + 1;
 
-   // every thread should process the lines between i and i+1 
-   // with i the thread number
-   std::vector<unsigned int> workload(num_t+1);
-   workload.front() = 0;
-   workload.back() = eigv.size();
+   // The cost of a row depends on the number of excitations to later rows,
+   // which varies a lot. Split the rows in many small chunks and let the threads
+   // pick them up dynamically. Chunk c contains the rows between c and c+1
+   const unsigned long long num_chunks = std::max(1ull, std::min(16ull*num_t, static_cast<unsigned long long>(eigv.size())));
+   std::vector<unsigned long long> workload(num_chunks+1);
 
-   for(int i=1;i<num_t;i++)
-   {
-      auto num_lines = workload[i-1];
-      unsigned long long num_elems = 0;
-
-      while(num_elems < size_part)
-         num_elems += eigv.size() - num_lines++;
+   for(unsigned long long i=0;i<=num_chunks;i++)
+      workload[i] = (eigv.size()*i)/num_chunks;
 
-      if(num_lines > eigv.size())
-         num_lines = eigv.size();
+   const auto L = block->getn();
 
-      workload[i] = num_lines;
-   }
-
-   std::vector< std::unique_ptr<DM2> > dm2_parts(num_t);
+   // every thread accumulates in its own tile: the block followed by the diagonal part
+   const auto tile_size = L*L + diag.size();
+   std::vector< std::vector<double> > tiles(num_t);
 
    std::cout << "Running with " << num_t << " threads." << std::endl;
 
-   perm.reset();
-
 #pragma omp parallel
    {
       auto start = std::chrono::high_resolution_clock::now();
       auto me = omp_get_thread_num();
+      const int my_num_t = omp_get_num_threads();
 
-      dm2_parts[me].reset(new DM2(block->getn(),N));
-      (*dm2_parts[me]) = 0;
+      tiles[me].assign(tile_size, 0);
 
       Permutation my_perm(perm);
 
-      for(auto idx_begin=0;idx_begin<workload[me];++idx_begin)
-         my_perm.next();
+#pragma omp for schedule(dynamic)
+      for(unsigned long long c=0;c<num_chunks;c++)
+      {
+         // jump directly to the first row of the chunk
+         my_perm.unrank(workload[c]);
 
-      auto vec_copy = eigv;
+         DISPATCH_PAIRS(N/2, build_iter, my_perm, eigv, workload[c], workload[c+1], tiles[me]);
+      }
 
-      build_iter(my_perm, vec_copy, workload[me], workload[me+1], (*dm2_parts[me]));
+      // tree reduction of the tiles: in the end, tile 0 holds the sum
+      for(int stride=1;stride<my_num_t;stride*=2)
+      {
+#pragma omp barrier
+         if(me % (2*stride) == 0 && me+stride < my_num_t)
+            for(unsigned int k=0;k<tile_size;k++)
+               tiles[me][k] += tiles[me+stride][k];
+      }
 
       auto end = std::chrono::high_resolution_clock::now();
 
@@ -426,89 +427,71 @@ void DM2::Build(Permutation &perm, std::vector<double> &eigv)
       std::cout << me << "\t" << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
    }
 
-   // add everything
-   (*this) = 0;
-   for(auto &cur_dm2: dm2_parts)
-      (*this) += (*cur_dm2);
+   for(unsigned int r=0;r<L;r++)
+      for(unsigned int s=0;s<L;s++)
+         (*block)(r,s) = tiles[0][r*L+s];
+
+   std::copy(tiles[0].begin()+L*L, tiles[0].end(), diag.begin());
 }
 
-void DM2::build_iter(Permutation& perm, std::vector<double> &eigv, unsigned int i_start, unsigned int i_end, DM2 &cur_2dm)
+/**
+ * Internal method: add the contributions of rows i_start up to i_end of the eigenvector
+ * to cur_2dm. The off-diagonal elements come from the pair excitations of every bra,
+ * PairExcitations gives the matching ket directly. This costs O(nnz) of the
+ * hamiltonian instead of a scan over all kets.
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param perm the Permutation at row i_start
+ * @param eigv the eigenvector
+ * @param i_start the first row
+ * @param i_end the end of the rows
+ * @param tile where to add the contributions: the L x L block followed by the diagonal part
+ */
+template<unsigned int NP>
+void DM2::build_iter(Permutation& perm, const std::vector<double> &eigv, unsigned long long i_start, unsigned long long i_end, std::vector<double> &tile) const
 {
    auto& perm_bra = perm;
 
-   for(unsigned int i=i_start;i<i_end;++i)
-   {
-      const auto bra = perm_bra.get();
+   const auto L = block->getn();
 
-      Permutation perm_ket(perm_bra);
+   PairExcitations<NP> exc(N/2, L);
+   const auto *occ = exc.occupied();
 
-      auto cur = bra;
+   for(auto i=i_start;i<i_end;++i)
+   {
+      exc.set(perm_bra.get());
 
-      // find occupied orbitals
-      while(cur)
-      {
-         // select rightmost up state in the ket
-         auto ksp = cur & (~cur + 1);
-         // set it to zero
-         cur ^= ksp;
+      const auto weight = eigv[i] * eigv[i];
 
-         // number of the orbital
-         auto s = DOCIHamiltonian::CountBits(ksp-1);
+      for(unsigned int a=0;a<exc.num_occupied();a++)
+      {
+         const auto s = occ[a];
 
          // in this case: s == (*sp2tp)(s,s+L)
-         (*cur_2dm.block)(s,s) += eigv[i] * eigv[i];
-
-         auto cur2 = cur; 
+         tile[s*L+s] += weight;
 
-         while(cur2)
+         for(unsigned int b=a+1;b<exc.num_occupied();b++)
          {
-            // select rightmost up state in the ket
-            auto ksp2 = cur2 & (~cur2 + 1);
-            // set it to zero
-            cur2 ^= ksp2;
-
-            // number of the orbital
-            auto r = DOCIHamiltonian::CountBits(ksp2-1);
+            const auto r = occ[b];
 
             unsigned int idx = (*sp2tp)(r,s);
             // find correct relative index
             idx -= block->getn();
             idx %= diag.size();
 
-            cur_2dm.diag[idx] += eigv[i] * eigv[i];
+            tile[L*L+idx] += weight;
          }
       }
 
-
-      for(unsigned int j=i+1;j<eigv.size();++j)
-      {
-         const auto ket = perm_ket.next();
-
-         const auto diff = bra ^ ket;
-
-         // this means 4 orbitals are different
-         if(DOCIHamiltonian::CountBits(diff) == 2)
-         {
-            auto diff_c = diff;
-
-            // select rightmost up state in the ket
-            auto ksp1 = diff_c & (~diff_c + 1);
-            // set it to zero
-            diff_c ^= ksp1;
-
-            auto ksp2 = diff_c & (~diff_c + 1);
-
-            // number of the orbital
-            auto r = DOCIHamiltonian::CountBits(ksp1-1);
-            auto s = DOCIHamiltonian::CountBits(ksp2-1);
-
+      // move a pair from occupied orbital s to empty orbital r > s: these are
+      // exactly the non-zero off-diagonal elements of the hamiltonian.
+      // The transpose gives the others.
+      exc.upper([&tile,&eigv,i,L] (unsigned int r, unsigned int s, unsigned long long j) {
             // in this case:
             // r == (*sp2tp)(r,r+L)
             // s == (*sp2tp)(s,s+L)
-            (*cur_2dm.block)(r,s) += eigv[i] * eigv[j];
-            (*cur_2dm.block)(s,r) += eigv[i] * eigv[j];
-         }
-      }
+            tile[r*L+s] += eigv[i] * eigv[j];
+            tile[s*L+r] += eigv[i] * eigv[j];
+            });
 
       perm_bra.next();
    }
@@ -624,16 +607,24 @@ double DM2::Trace() const
  * @param k the first orbital
  * @param l the second orbital
  * @param start_angle the starting point for the Newton-Raphson (defaults to zero)
- * @param T function that returns the one-particle matrix elements
- * @param V function that returns the two-particle matrix elements
+ * @param mol the molecular data, with an up to date integral cache (see Molecule::BuildIntegralCache())
  * @return pair of the angle with the lowest energy and boolean, true => minimum, false => maximum
  */
-std::pair<double,bool> DM2::find_min_angle(int k, int l, double start_angle, std::function<double(int,int)> &T, std::function<double(int,int,int,int)> &V) const
+std::pair<double,bool> DM2::find_min_angle(int k, int l, double start_angle, const Molecule &mol) const
 {
    assert(k!=l);
 
    const int L = block->getn();
 
+   // the loop over a only needs the cached J, K, P and diagonal of T
+   const auto *J = mol.getJ();
+   const auto *K = mol.getK();
+   const auto *P = mol.getP();
+   const auto *Td = mol.getTdiag();
+
+   auto T = [&mol] (int a, int b) -> double { return mol.getT(a,b); };
+   auto V = [&mol] (int a, int b, int c, int d) -> double { return mol.getV(a,b,c,d); };
+
    double theta = start_angle;
 
    const DM2 &rdm = *this;
@@ -650,9 +641,9 @@ std::pair<double,bool> DM2::find_min_angle(int k, int l, double start_angle, std
       if(a==k || a==l)
          continue;
 
-      cos2 += 2*V(k,k,a,a)*rdm(k,k+L,a,a+L)+2*V(l,l,a,a)*rdm(l,l+L,a,a+L)+2*(2*V(k,a,k,a)-V(k,a,a,k)+2.0/(N-1.0)*T(k,k))*rdm(k,a,k,a)+2*(2*V(l,a,l,a)-V(l,a,a,l)+2.0/(N-1.0)*T(l,l))*rdm(l,a,l,a);
+      cos2 += 2*P[k*L+a]*rdm(k,k+L,a,a+L)+2*P[l*L+a]*rdm(l,l+L,a,a+L)+2*(2*J[k*L+a]-K[k*L+a]+2.0/(N-1.0)*Td[k])*rdm(k,a,k,a)+2*(2*J[l*L+a]-K[l*L+a]+2.0/(N-1.0)*Td[l])*rdm(l,a,l,a);
 
-      sin2 += 2*V(l,l,a,a)*rdm(k,k+L,a,a+L)+2*V(k,k,a,a)*rdm(l,l+L,a,a+L)+2*(2*V(k,a,k,a)-V(k,a,a,k)+2.0/(N-1.0)*T(k,k))*rdm(l,a,l,a)+2*(2*V(l,a,l,a)-V(l,a,a,l)+2.0/(N-1.0)*T(l,l))*rdm(k,a,k,a);
+      sin2 += 2*P[l*L+a]*rdm(k,k+L,a,a+L)+2*P[k*L+a]*rdm(l,l+L,a,a+L)+2*(2*J[k*L+a]-K[k*L+a]+2.0/(N-1.0)*Td[k])*rdm(l,a,l,a)+2*(2*J[l*L+a]-K[l*L+a]+2.0/(N-1.0)*Td[l])*rdm(k,a,k,a);
 
       sincos += 2*V(k,l,a,a)*(rdm(l,l+L,a,a+L)-rdm(k,k+L,a,a+L))+2*(2*V(k,a,l,a)-V(k,a,a,l)+2.0/(N-1.0)*T(k,l))*(rdm(l,a,l,a)-rdm(k,a,k,a));
    }
@@ -696,7 +687,7 @@ std::pair<double,bool> DM2::find_min_angle(int k, int l, double start_angle, std
 //   for(int i=0;i<Na;i++)
 //   {
 //      double t = 2.0 * M_PI / (1.0*Na) * i;
-//      std::cout << t << "\t" << calc_rotate(k,l,t,T,V)  << "\t" << gradient(t) << "\t" << hessian(t) << std::endl;
+//      std::cout << t << "\t" << calc_rotate(k,l,t,mol)  << "\t" << gradient(t) << "\t" << hessian(t) << std::endl;
 //   }
 
    const int max_iters = 20;
@@ -734,16 +725,24 @@ std::pair<double,bool> DM2::find_min_angle(int k, int l, double start_angle, std
  * @param k the first orbital
  * @param l the second orbital
  * @param theta the angle to rotate over
- * @param T function that returns the one-particle matrix elements
- * @param V function that returns the two-particle matrix elements
+ * @param mol the molecular data, with an up to date integral cache (see Molecule::BuildIntegralCache())
  * @return the new energy
  */
-double DM2::calc_rotate(int k, int l, double theta, std::function<double(int,int)> &T, std::function<double(int,int,int,int)> &V) const
+double DM2::calc_rotate(int k, int l, double theta, const Molecule &mol) const
 {
    assert(k!=l);
 
    const int L = block->getn();
 
+   // the loops over a and b only need the cached J, K, P and diagonal of T
+   const auto *J = mol.getJ();
+   const auto *K = mol.getK();
+   const auto *P = mol.getP();
+   const auto *Td = mol.getTdiag();
+
+   auto T = [&mol] (int a, int b) -> double { return mol.getT(a,b); };
+   auto V = [&mol] (int a, int b, int c, int d) -> double { return mol.getV(a,b,c,d); };
+
    const DM2 &rdm = *this;
 
    double energy = 4/(N-1.0)*(T(k,k)+T(l,l)) * rdm(k,l,k,l);
@@ -760,23 +759,23 @@ double DM2::calc_rotate(int k, int l, double theta, std::function<double(int,int
       if(a==k || a==l)
          continue;
 
-      energy += 2.0/(N-1.0) * T(a,a) * (rdm(a,a+L,a,a+L)+2*rdm(a,k,a,k)+2*rdm(a,l,a,l));
+      energy += 2.0/(N-1.0) * Td[a] * (rdm(a,a+L,a,a+L)+2*rdm(a,k,a,k)+2*rdm(a,l,a,l));
 
       for(int b=0;b<L;b++)
       {
          if(b==k || b==l)
             continue;
 
-         energy += 2.0/(N-1.0) * (T(a,a)+T(b,b)) * rdm(a,b,a,b);
+         energy += 2.0/(N-1.0) * (Td[a]+Td[b]) * rdm(a,b,a,b);
 
-         energy += V(a,a,b,b) * rdm(a,a+L,b,b+L);
+         energy += P[a*L+b] * rdm(a,a+L,b,b+L);
 
-         energy += (2*V(a,b,a,b)-V(a,b,b,a)) * rdm(a,b,a,b);
+         energy += (2*J[a*L+b]-K[a*L+b]) * rdm(a,b,a,b);
       }
 
-      cos2 += 2*V(k,k,a,a)*rdm(k,k+L,a,a+L)+2*V(l,l,a,a)*rdm(l,l+L,a,a+L)+2*(2*V(k,a,k,a)-V(k,a,a,k)+2.0/(N-1.0)*T(k,k))*rdm(k,a,k,a)+2*(2*V(l,a,l,a)-V(l,a,a,l)+2.0/(N-1.0)*T(l,l))*rdm(l,a,l,a);
+      cos2 += 2*P[k*L+a]*rdm(k,k+L,a,a+L)+2*P[l*L+a]*rdm(l,l+L,a,a+L)+2*(2*J[k*L+a]-K[k*L+a]+2.0/(N-1.0)*Td[k])*rdm(k,a,k,a)+2*(2*J[l*L+a]-K[l*L+a]+2.0/(N-1.0)*Td[l])*rdm(l,a,l,a);
 
-      sin2 += 2*V(l,l,a,a)*rdm(k,k+L,a,a+L)+2*V(k,k,a,a)*rdm(l,l+L,a,a+L)+2*(2*V(k,a,k,a)-V(k,a,a,k)+2.0/(N-1.0)*T(k,k))*rdm(l,a,l,a)+2*(2*V(l,a,l,a)-V(l,a,a,l)+2.0/(N-1.0)*T(l,l))*rdm(k,a,k,a);
+      sin2 += 2*P[l*L+a]*rdm(k,k+L,a,a+L)+2*P[k*L+a]*rdm(l,l+L,a,a+L)+2*(2*J[k*L+a]-K[k*L+a]+2.0/(N-1.0)*Td[k])*rdm(l,a,l,a)+2*(2*J[l*L+a]-K[l*L+a]+2.0/(N-1.0)*Td[l])*rdm(k,a,k,a);
 
       sincos += 2*V(k,l,a,a)*(rdm(l,l+L,a,a+L)-rdm(k,k+L,a,a+L))+2*(2*V(k,a,l,a)-V(k,a,a,l)+2.0/(N-1.0)*T(k,l))*(rdm(l,a,l,a)-rdm(k,a,k,a));
    }
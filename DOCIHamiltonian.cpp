@@ -1,11 +1,22 @@
 #include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <numeric>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <iomanip>
 #include <chrono>
+#include <cmath>
+#include <type_traits>
+#include <atomic>
 #include <omp.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "lapack.h"
 #include "DOCIHamtilonian.h"
+#include "PairExcitations.h"
 
 using namespace doci;
 
@@ -22,8 +33,16 @@ DOCIHamiltonian::DOCIHamiltonian(const Permutation &perm, const Molecule &mol)
    if(molecule->get_n_electrons() % 2 != 0)
       throw("We need even number of electrons!");
 
-   auto dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
-   mat.reset(new helpers::SparseMatrix_CRS(dim));
+   dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
+
+   // only a stored matrix needs the column indices, see Build()
+   mat.reset(new helpers::SparseMatrix_CRS(dim <= std::numeric_limits<crs_col_t>::max() ? dim : 0));
+
+   storage = Storage::CRS;
+   ordering = Ordering::Colex;
+   pattern = Pattern::Upper;
+   solver = Solver::Arpack;
+   tolerance = 0;
 }
 
 /**
@@ -41,8 +60,16 @@ DOCIHamiltonian::DOCIHamiltonian(const Molecule &mol)
 
    permutations.reset(new Permutation(molecule->get_n_electrons()/2));
 
-   auto dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
-   mat.reset(new helpers::SparseMatrix_CRS(dim));
+   dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
+
+   // only a stored matrix needs the column indices, see Build()
+   mat.reset(new helpers::SparseMatrix_CRS(dim <= std::numeric_limits<crs_col_t>::max() ? dim : 0));
+
+   storage = Storage::CRS;
+   ordering = Ordering::Colex;
+   pattern = Pattern::Upper;
+   solver = Solver::Arpack;
+   tolerance = 0;
 }
 
 DOCIHamiltonian::DOCIHamiltonian(Molecule &&mol)
@@ -54,8 +81,16 @@ DOCIHamiltonian::DOCIHamiltonian(Molecule &&mol)
 
    permutations.reset(new Permutation(molecule->get_n_electrons()/2));
 
-   auto dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
-   mat.reset(new helpers::SparseMatrix_CRS(dim));
+   dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
+
+   // only a stored matrix needs the column indices, see Build()
+   mat.reset(new helpers::SparseMatrix_CRS(dim <= std::numeric_limits<crs_col_t>::max() ? dim : 0));
+
+   storage = Storage::CRS;
+   ordering = Ordering::Colex;
+   pattern = Pattern::Upper;
+   solver = Solver::Arpack;
+   tolerance = 0;
 }
 
 
@@ -63,14 +98,38 @@ DOCIHamiltonian::DOCIHamiltonian(const DOCIHamiltonian &orig)
 {
    permutations.reset(new Permutation(*orig.permutations));
    molecule.reset(orig.molecule->clone());
+   dim = orig.dim;
    mat.reset(new helpers::SparseMatrix_CRS(*orig.mat));
+   sell.reset(orig.sell ? new helpers::SparseMatrix_SELL(*orig.sell) : nullptr);
+   ooc.reset(orig.ooc ? new helpers::SparseMatrix_OOC(*orig.ooc) : nullptr);
+   storage = orig.storage;
+   diag = orig.diag;
+   ordering = orig.ordering;
+   pattern = orig.pattern;
+   order = orig.order;
+   position = orig.position;
+   solver = orig.solver;
+   tolerance = orig.tolerance;
+   start_vector = orig.start_vector;
 }
 
 DOCIHamiltonian& DOCIHamiltonian::operator=(const DOCIHamiltonian &orig)
 {
    permutations.reset(new Permutation(*orig.permutations));
    molecule.reset(orig.molecule->clone());
+   dim = orig.dim;
    mat.reset(new helpers::SparseMatrix_CRS(*orig.mat));
+   sell.reset(orig.sell ? new helpers::SparseMatrix_SELL(*orig.sell) : nullptr);
+   ooc.reset(orig.ooc ? new helpers::SparseMatrix_OOC(*orig.ooc) : nullptr);
+   storage = orig.storage;
+   diag = orig.diag;
+   ordering = orig.ordering;
+   pattern = orig.pattern;
+   order = orig.order;
+   position = orig.position;
+   solver = orig.solver;
+   tolerance = orig.tolerance;
+   start_vector = orig.start_vector;
 
    return *this;
 }
@@ -102,9 +161,9 @@ Permutation const & DOCIHamiltonian::getPermutation() const
 /**
  * @return the dimension of the hamiltonian matrix
  */
-unsigned int DOCIHamiltonian::getdim() const
+unsigned long long DOCIHamiltonian::getdim() const
 {
-   return mat->gn();
+   return dim;
 }
 
 /**
@@ -112,498 +171,2630 @@ unsigned int DOCIHamiltonian::getdim() const
  */
 void DOCIHamiltonian::Build()
 {
-   auto num_t = omp_get_max_threads();
-   unsigned long long num_elems = (getdim()*1ul*(getdim()+1ul))/2;
-   unsigned long long size_part = num_elems/num_t + 1;
+   molecule->BuildIntegralCache();
 
-   // every thread should process the lines between i and i+1 
-   // with i the thread number
-   std::vector<unsigned long long> workload(num_t+1);
-   workload.front() = 0;
-   workload.back() = getdim();
+   // the rows of a new matrix are in colex order until we reorder them
+   order.clear();
+   position.clear();
+   sell.reset();
+   ooc.reset();
 
-   for(int i=1;i<num_t;i++)
+   if(storage == Storage::MatrixFree)
    {
-      auto num_lines = workload[i-1];
-      unsigned long long num_elems = 0;
+      if(ordering != Ordering::Colex)
+         std::cout << "No reordering without a stored matrix" << std::endl;
+
+      Build_diagonal();
+      return;
+   }
+
+   if(getdim() > std::numeric_limits<crs_col_t>::max())
+      throw std::overflow_error("Dimension too large for the sparse matrix, compile with CRS_64BIT_COL or use MatrixFree storage");
 
-      while(num_elems < size_part)
-         num_elems += getdim() - num_lines++;
+   auto num_t = omp_get_max_threads();
 
-      if(num_lines > getdim())
-         num_lines = getdim();
+   // The cost of a row depends on the number of excitations to later rows,
+   // which varies a lot. Split the rows in many small chunks and let the threads
+   // pick them up dynamically. Chunk c contains the rows between c and c+1
+   const unsigned long long num_chunks = std::max(1ull, std::min(16ull*num_t, getdim()));
+   std::vector<unsigned long long> workload(num_chunks+1);
 
-      workload[i] = num_lines;
-   }
+   for(unsigned long long i=0;i<=num_chunks;i++)
+      workload[i] = (getdim()*i)/num_chunks;
 
-   std::vector< std::unique_ptr<helpers::SparseMatrix_CRS> > smat_parts(num_t);
+   diag.resize(getdim());
 
    std::cout << "Running with " << num_t << " threads." << std::endl;
 
-   permutations->reset();
+   const auto n_pairs = molecule->get_n_electrons()/2;
 
-#pragma omp parallel
+   if(ordering == Ordering::RCM)
    {
       auto start = std::chrono::high_resolution_clock::now();
-      auto me = omp_get_thread_num();
-
-      smat_parts[me].reset(new helpers::SparseMatrix_CRS(workload[me+1] - workload[me]));
-
-      Permutation my_perm(*permutations);
-      for(auto idx_begin=0;idx_begin<workload[me];++idx_begin)
-         my_perm.next();
 
-      // this costs some memory, make it an alias to
-      // decrease memory usage but increase runtime
-      auto my_mol = std::unique_ptr<Molecule> (molecule->clone());
-
-      Build_iter(my_perm, (*smat_parts[me]), workload[me], workload[me+1], *my_mol);
+      DISPATCH_PAIRS(n_pairs, CalcOrdering, *permutations);
 
       auto end = std::chrono::high_resolution_clock::now();
 
-#pragma omp critical
-      std::cout << me << "\t" << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
+      std::cout << "Reordering took: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
    }
 
-   mat->AddList(smat_parts);
-}
-
-/**
- * Internal method: this will iterate and build a part of the full sparse hamiltonian matrix
- * @param perm the start permutation to use
- * @param mat where to store the sparse matrix data
- * @param i_start the start point to iter
- * @param i_end the end point of the iterations
- * @param mol the molecule data to use
- */
-void DOCIHamiltonian::Build_iter(Permutation &perm, helpers::SparseMatrix_CRS &mat,unsigned long long i_start, unsigned long long i_end, Molecule &mol)
-{
-   auto &perm_bra = perm;
-
-   for(auto i=i_start;i<i_end;++i)
+   if(storage == Storage::OutOfCore)
    {
-      const auto bra = perm_bra.get();
+      Build_blocks();
+      return;
+   }
 
-      mat.NewRow();
+   bool full = (pattern == Pattern::Full);
 
-      // do all diagonal terms
-      auto cur = bra;
-      double tmp = 0;
+   if(full && storage == Storage::SELL)
+   {
+      std::cout << "SELL storage keeps only the upper diagonal part" << std::endl;
+      full = false;
+   }
 
-      // find occupied orbitals
-      while(cur)
-      {
-         // select rightmost up state in the ket
-         auto ksp = cur & (~cur + 1);
-         // set it to zero
-         cur ^= ksp;
+   // the exact number of elements of every row is known in advance: set up the
+   // whole matrix at once and let the threads fill in their rows directly
+   mat->Allocate(PlanRows(full), storage == Storage::PairCRS, full);
 
-         // number of the orbital
-         auto s = CountBits(ksp-1);
+   std::cout << "Non-zero elements in the " << (full ? "full matrix: " : "upper diagonal part: ") << mat->NumOfEl() << std::endl;
 
-         // OEI part
-         tmp += 2 * mol.getT(s, s);
+#pragma omp parallel
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      auto me = omp_get_thread_num();
 
-         // TEI: part a \bar a ; a \bar a
-         tmp += mol.getV(s, s, s, s);
+      Permutation my_perm(*permutations);
 
-         auto cur2 = cur; 
+#pragma omp for schedule(dynamic)
+      for(unsigned long long c=0;c<num_chunks;c++)
+      {
+         // jump directly to the first row of the chunk
+         my_perm.unrank(workload[c]);
 
-         while(cur2)
-         {
-            // select rightmost up state in the ket
-            auto ksp2 = cur2 & (~cur2 + 1);
-            // set it to zero
-            cur2 ^= ksp2;
-
-            // number of the orbital
-            auto r = CountBits(ksp2-1);
-
-            // s < r !! (avoid double counting)
-
-            // TEI:
-            // - a b ; a b
-            // - a \bar b ; a \bar b
-            // - \bar a \bar b ; \bar a \bar b
-            // with a < b
-            // The second term (ab|V|ba) is not possible in the second
-            // case, so only a prefactor of 2 instead of 4.
-            tmp += 4 * mol.getV(r, s, r, s);
-            tmp -= 2 * mol.getV(r, s, s, r);
-         }
+         DISPATCH_PAIRS(n_pairs, Build_iter, my_perm, *mat, workload[c], workload[c+1], *molecule);
       }
 
-      mat.PushToRowNext(i, tmp);
+      auto end = std::chrono::high_resolution_clock::now();
 
-      Permutation perm_ket(perm_bra);
+#pragma omp critical
+      std::cout << me << "\t" << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
+   }
 
-      for(auto j=i+1;j<getdim();++j)
-      {
-         const auto ket = perm_ket.next();
+   if(storage == Storage::PairCRS)
+      mat->SetPairTable(CalcPairTable(*molecule));
 
-         const auto diff = bra ^ ket;
+   if(helpers::Diagnostics())
+      std::cout << "Matrix placement: " << mat->Placement() << std::endl;
 
-         // this means 4 orbitals are different
-         if(CountBits(diff) == 2)
-         {
-            auto diff_c = diff;
+   if(helpers::Diagnostics())
+      ReportSpMV();
 
-            // select rightmost up state in the ket
-            auto ksp1 = diff_c & (~diff_c + 1);
-            // set it to zero
-            diff_c ^= ksp1;
+   if(storage == Storage::SELL)
+   {
+      const auto nnz = mat->NumOfEl() - getdim();
 
-            auto ksp2 = diff_c & (~diff_c + 1);
+      sell.reset(new helpers::SparseMatrix_SELL(*mat));
 
-            // number of the orbital
-            auto r = CountBits(ksp1-1);
-            auto s = CountBits(ksp2-1);
+      // only keep the dimension in the CRS matrix
+      mat.reset(new helpers::SparseMatrix_CRS(sell->gn()));
 
-            // TEI: a \bar a ; b \bar b
-            mat.PushToRowNext(j, mol.getV(s, s, r, r));
-         } 
-      }
+      std::cout << "SELL padding: " << 100.0 * (sell->NumOfEl() - nnz) / std::max(1ull, nnz) << "% extra elements" << std::endl;
 
-      perm_bra.next();
+      if(helpers::Diagnostics())
+         std::cout << "SELL placement: " << sell->Placement() << std::endl;
    }
 }
 
 /**
- * Calcalate the lowest eigenvalue and eigenvector using lanczos method.
- * We use arpack for this.
- * @return a pair of the lowest eigenvalue and corresponding normalized eigenvector
+ * The size of the blocks of rows in OutOfCore storage: the environment variable
+ * DOCI_OOC_BLOCK in MB (default 256). Two blocks are in memory during a product.
+ * @return the size of a block in bytes
  */
-std::pair< double,std::vector<double> > DOCIHamiltonian::Diagonalize() const
+static std::size_t OutOfCoreBlock()
 {
-   double energy;
-   std::vector<double> eigv(mat->gn());
+   unsigned long long mb = 256;
 
-   Diagonalize_arpack(energy,eigv,true);
+   const char *env = getenv("DOCI_OOC_BLOCK");
 
-   return std::make_pair(energy, std::move(eigv));
+   if(env && (!helpers::ParseCount(env, mb) || mb > (std::numeric_limits<std::size_t>::max() >> 20)))
+   {
+      std::cerr << "Invalid DOCI_OOC_BLOCK=" << env << " (a number of MB), using 256" << std::endl;
+      mb = 256;
+   }
+
+   return mb * 1024 * 1024;
 }
 
 /**
- * Calcalate the lowest eigenvalue using lanczos method.
- * We use arpack for this.
- * @return the lowest eigenvalue
+ * The start of the file names of the blocks in OutOfCore storage, in the directory
+ * DOCI_OOC_DIR, else SAVE_H5_PATH, else the current directory. The process id and a
+ * counter keep the files of different hamiltonians and runs apart.
+ * @return the prefix for the files of a new SparseMatrix_OOC
  */
-double DOCIHamiltonian::CalcEnergy() const
+static std::string OutOfCorePrefix()
 {
-   double energy;
-   std::vector<double> eigv(0);
+   static std::atomic<unsigned int> count(0);
+
+   std::string dir = ".";
 
-   Diagonalize_arpack(energy,eigv,false);
+   if(getenv("DOCI_OOC_DIR"))
+      dir = getenv("DOCI_OOC_DIR");
+   else if(getenv("SAVE_H5_PATH"))
+      dir = getenv("SAVE_H5_PATH");
 
-   return energy;
+   std::stringstream prefix;
+   prefix << dir << "/doci-ham-" << getpid() << "-" << count++;
+
+   return prefix.str();
 }
 
 /**
- * Calcalate the lowest eigenvalue and (depending on eigvec) eigenvector using lanczos method.
- * We use arpack for this.
- * @param energy on return will hold the lowest eigenvalue
- * @param eigv on return will hold the lowest eigenvector
- * @param eigvec if true, calc the eigenvector and store in eigv
+ * Internal method: build the hamiltonian in OutOfCore storage. The rows are built one
+ * block at a time (of about OutOfCoreBlock() bytes), in full and with pair indices as in
+ * PairCRS, and every block is written to disk before the next one is built. Only one
+ * block is in memory. The full matrix has twice the elements of the upper diagonal part,
+ * but every block can then be multiplied on its own (see helpers::SparseMatrix_OOC).
+ * With pair indices, it still reads fewer bytes per element than the upper diagonal
+ * part in CRS storage.
  */
-void DOCIHamiltonian::Diagonalize_arpack(double &energy, std::vector<double> &eigv, bool eigvec) const
+void DOCIHamiltonian::Build_blocks()
 {
-   // dimension of the matrix
-   int n = mat->gn();
-
-   // number of eigenvalues to calculate
-   int nev = 1;
+   if(pattern != Pattern::Full)
+      std::cout << "Out-of-core storage keeps the full matrix" << std::endl;
 
-   // reverse communication parameter, must be zero on first iteration
-   int ido = 0;
-   // standard eigenvalue problem A*x=lambda*x
-   char bmat = 'I';
-   // calculate the smallest algebraic eigenvalue
-   char which[] = {'S','A'};
-   // calculate until machine precision
-   double tol = 0;
+   const auto n = getdim();
+   const auto L = molecule->get_n_sp();
+   const auto n_pairs = molecule->get_n_electrons()/2;
+   const int num_t = omp_get_max_threads();
 
-   // the residual vector
-   std::unique_ptr<double []> resid(new double[n]);
+   // every row has the diagonal and all excitations, see PlanRows()
+   const crs_row_t row_length = 1 + n_pairs * (L - n_pairs);
+   const std::size_t row_bytes = row_length * (sizeof(crs_col_t) + sizeof(unsigned short)) + sizeof(crs_row_t) + sizeof(double);
+   const unsigned long long block_rows = std::max<std::size_t>(1, OutOfCoreBlock() / row_bytes);
 
-   // the number of columns in v: the number of lanczos vector
-   // generated at each iteration, ncv <= n
-   // We use the answer to life, the universe and everything, if possible
-   int ncv = 42;
+   const auto prefix = OutOfCorePrefix();
 
-   if( n < ncv )
-      ncv = n;
+   ooc.reset(new helpers::SparseMatrix_OOC(n, prefix));
 
-   // v containts the lanczos basis vectors
-   auto ldv = n;
-   std::unique_ptr<double []> v(new double[ldv*ncv]);
+   // only keep the dimension in the CRS matrix
+   mat.reset(new helpers::SparseMatrix_CRS(n));
 
-   std::unique_ptr<int []> iparam(new int[11]);
-   iparam[0] = 1;   // Specifies the shift strategy (1->exact)
-   iparam[2] = 3*n; // Maximum number of iterations
-   iparam[6] = 1;   /* Sets the mode of dsaupd.
-                       1 is exact shifting,
-                       2 is user-supplied shifts,
-                       3 is shift-invert mode,
-                       4 is buckling mode,
-                       5 is Cayley mode. */
+   const auto table = CalcPairTable(*molecule);
 
-   std::unique_ptr<int []> ipntr(new int[11]); /* Indicates the locations in the work array workd
-                                                  where the input and output vectors in the
-                                                  callback routine are located. */
+   auto start = std::chrono::high_resolution_clock::now();
+   double write_time = 0;
 
-   // array used for reverse communication
-   std::unique_ptr<double []> workd(new double[3*n]);
-   for(int i=0;i<3*n;i++)
-      workd[i] = 0;
+   for(unsigned long long first=0;first<n;first+=block_rows)
+   {
+      const auto rows = std::min(block_rows, n - first);
 
-   auto lworkl = ncv*(ncv+8); /* Length of the workl array */
-   std::unique_ptr<double []> workl(new double[lworkl]);
+      std::vector<crs_row_t> row_ptr(rows+1);
 
-   // info = 0: random start vector is used
-   int info = 0; /* Passes convergence information out of the iteration
-                    routine. */
+      for(unsigned long long i=0;i<=rows;i++)
+         row_ptr[i] = i * row_length;
 
-   // rvec == 0 : calculate only eigenvalue
-   // rvec > 0 : calculate eigenvalue and eigenvector
-   int rvec = 0;
-   if(eigvec)
-      rvec = 1;
+      helpers::SparseMatrix_CRS block(rows);
+      block.Allocate(std::move(row_ptr), true, true);
 
-   // how many eigenvectors to calculate: 'A' => nev eigenvectors
-   char howmny = 'A';
+      // see Build() for the chunks
+      const unsigned long long num_chunks = std::max(1ull, std::min(16ull*num_t, rows));
 
-   std::unique_ptr<int []> select;
-   // when howmny == 'A', this is used as workspace to reorder the eigenvectors
-   if( howmny == 'A' )
-      select.reset(new int[ncv]);
+#pragma omp parallel
+      {
+         Permutation my_perm(*permutations);
 
-   // This vector will return the eigenvalues from the second routine, dseupd.
-   std::unique_ptr<double []> d(new double[nev]);
+#pragma omp for schedule(dynamic)
+         for(unsigned long long c=0;c<num_chunks;c++)
+         {
+            const auto i_start = first + (rows*c)/num_chunks;
+            const auto i_end = first + (rows*(c+1))/num_chunks;
 
-   if(eigvec)
-      eigv.resize(n);
+            my_perm.unrank(i_start);
 
-   // not used if iparam[6] == 1
-   double sigma;
+            DISPATCH_PAIRS(n_pairs, Build_iter, my_perm, block, i_start, i_end, *molecule, first);
+         }
+      }
 
-   // first iteration
-   dsaupd_(&ido, &bmat, &n, &which[0], &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+      block.SetPairTable(table);
 
-   while( ido != 99 )
-   {
-      // matrix-vector multiplication
-      mat->mvprod(workd.get()+ipntr[0]-1, workd.get()+ipntr[1]-1);
+      auto begin_write = std::chrono::high_resolution_clock::now();
 
-      dsaupd_(&ido, &bmat, &n, &which[0], &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
-   }
+      ooc->AddBlock(block);
 
-   if( info < 0 )
-      std::cerr << "Error with dsaupd, info = " << info << std::endl;
-   else if ( info == 1 )
-      std::cerr << "Maximum number of Lanczos iterations reached." << std::endl;
-   else if ( info == 3 )
-      std::cerr << "No shifts could be applied during implicit Arnoldi update, try increasing NCV." << std::endl;
+      auto end_write = std::chrono::high_resolution_clock::now();
 
-   dseupd_(&rvec, &howmny, select.get(), d.get(), eigv.data(), &ldv, &sigma, &bmat, &n, which, &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+      write_time += std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end_write-begin_write).count();
+   }
 
-   if ( info != 0 )
-      std::cerr << "Error with dseupd, info = " << info << std::endl;
+   auto end = std::chrono::high_resolution_clock::now();
 
-   energy = d[0];
+   std::cout << "Non-zero elements in the full matrix: " << ooc->NumOfEl() << std::endl;
+   std::cout << "Out-of-core: " << ooc->NumOfBlocks() << " blocks of " << block_rows << " rows, " << ooc->FileSize() / 1e9 << " GB in " << prefix << "-*.bin" << std::endl;
+   std::cout << "Out-of-core: writing took " << write_time << " s of " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s, " << ooc->FileSize() / write_time / 1e9 << " GB/s" << std::endl;
 }
 
 /**
- * Convert the sparse matrix to a full matrix and use exact diagonalization
- * to find the eigenvalues and eigenvectors.
- * @return a pair of a vector with all the eigenvalues (sorted) and a matrix
- * with the corresponding orthonormal eigenvectors
+ * Internal method: place a block of vectors of length getdim() (one after the other)
+ * on the NUMA nodes and set them to zero, see PlaceVectors(T*,std::size_t,std::size_t,const std::vector<unsigned long long>&)
+ * @param vec the start of the vectors, not touched yet
+ * @param n_vec the number of vectors
  */
-std::pair< std::vector<double>,helpers::matrix > DOCIHamiltonian::DiagonalizeFull() const
+template<typename T>
+void DOCIHamiltonian::PlaceVectors(T *vec, std::size_t n_vec) const
 {
-   char jobz = 'V';
-   char uplo = 'U';
-   int n = mat->gn();
-
-   std::unique_ptr<helpers::matrix> fullmat(new helpers::matrix(n, n));
-   mat->ConvertToMatrix(*fullmat);
-
-   std::vector<double> eigs(n);
-
-   int lwork = 3*n - 1;
+   PlaceVectors(vec, getdim(), n_vec, ThreadPieces(omp_get_max_threads()));
+}
 
-   std::unique_ptr<double []> work (new double [lwork]);
+/**
+ * Internal method: place a block of vectors (one after the other) on the NUMA nodes and
+ * set them to zero. With first touch, every thread zeroes the rows it handles in the
+ * matrix-vector product so they end up in its local memory. With interleave the pages
+ * are spread over all nodes. See helpers::GetNumaPolicy().
+ * @param vec the start of the vectors, not touched yet
+ * @param n the length of a vector
+ * @param n_vec the number of vectors
+ * @param part the first row of the piece of every thread in the product, followed by n
+ */
+template<typename T>
+void DOCIHamiltonian::PlaceVectors(T *vec, std::size_t n, std::size_t n_vec, const std::vector<unsigned long long> &part)
+{
+   const auto policy = helpers::GetNumaPolicy();
 
-   int info = 0;
+   if(policy == helpers::NumaPolicy::Interleave)
+      helpers::NumaInterleave(vec, n * n_vec * sizeof(T));
 
-   dsyev_(&jobz,&uplo,&n,fullmat->getpointer(),&n,eigs.data(),work.get(),&lwork,&info);
+   if(policy == helpers::NumaPolicy::Off)
+   {
+      std::fill(vec, vec + n*n_vec, T(0));
+      return;
+   }
 
-   if(info)
-      std::cerr << "dsyev failed. info = " << info << std::endl;
+   const int num_t = part.size() - 1;
 
-   return std::make_pair(std::move(eigs), std::move(*fullmat));
+   // handed out as in SparseMatrix_CRS::mvprod()
+#pragma omp parallel for schedule(static)
+   for(int t=0;t<num_t;t++)
+      for(std::size_t v=0;v<n_vec;v++)
+         std::fill(vec + v*n + part[t], vec + v*n + part[t+1], T(0));
 }
 
 /**
- * Wrapper function for gcc buildin popcount
- * @param bits the unsigned long long to count the bits from
- * @return the number of ones in bits
+ * Internal method: the pieces of rows of the threads in the matrix-vector product
+ * (mvprod() or sigma()), see PlaceVectors()
+ * @param num_t the number of threads
+ * @return the first row of every piece, followed by getdim() (size num_t+1)
  */
-unsigned int DOCIHamiltonian::CountBits(mybitset bits)
+std::vector<unsigned long long> DOCIHamiltonian::ThreadPieces(int num_t) const
 {
-#if defined(USELONG)
-   return __builtin_popcountl(bits);
-#elif defined(USELONGLONG)
-   return __builtin_popcountll(bits);
-#endif
+   const auto n = getdim();
+
+   std::vector<unsigned long long> part(num_t+1);
+
+   if(sell)
+   {
+      const auto sell_part = sell->RowPartition(num_t);
+      std::copy(sell_part.begin(), sell_part.end(), part.begin());
+   }
+   else if(storage == Storage::MatrixFree || mat->NumOfEl() == 0)
+      for(int t=0;t<=num_t;t++)
+         part[t] = (n*t)/num_t;
+   else
+   {
+      const auto crs_part = mat->RowPartition(num_t);
+      std::copy(crs_part.begin(), crs_part.end(), part.begin());
+   }
+
+   return part;
 }
 
 /**
- * Calculate the sign by counting the number of set bits in a between position i and j
- * @param i the first position
- * @param j the second position, i < j
- * @param a the set of bits to calcalute on
- * @return the number of bits set between i and j in a
+ * Internal method: calculate a reverse Cuthill-McKee ordering of the basis. Two basis
+ * states are connected when they differ by one pair excitation. A breadth first search
+ * from the reference state (the lowest orbitals occupied) numbers the states level by
+ * level, the neighbours of a state in increasing order. All states have the same number
+ * of neighbours, so there is no sorting on the degree. Reversing this order gives RCM.
+ * This is a serial pass over all excitations, about the cost of a serial Build().
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param perm the Permutation that defines the basis
  */
-int DOCIHamiltonian::CalcSign(unsigned int i,unsigned int j, const mybitset a)
+template<unsigned int NP>
+void DOCIHamiltonian::CalcOrdering(const Permutation &perm)
 {
-    assert(i<j && "Order indices correctly!");
+   const auto dim = getdim();
+   const auto unvisited = std::numeric_limits<crs_col_t>::max();
 
-    // count the number of set bits between i and j in ket a
-    auto sign = CountBits(( ((1<<j) - 1) ^ ((1<<(i+1)) - 1) ) & a);
+   order.resize(dim);
+   position.assign(dim, unvisited);
 
-    // when uneven, we get a minus sign
-    if( sign & 0x1 )
-        return -1;
-    else
-        return +1;
+   PairExcitations<NP> exc(molecule->get_n_electrons()/2, molecule->get_n_sp());
+   std::vector<crs_col_t> neighbours;
+
+   // order doubles as the queue of the breadth first search
+   unsigned long long head = 0, tail = 0;
+
+   // the graph is connected, but be safe
+   for(unsigned long long start=0;start<dim;start++)
+   {
+      if(position[start] != unvisited)
+         continue;
+
+      order[tail] = start;
+      position[start] = tail++;
+
+      while(head < tail)
+      {
+         exc.set(perm.get(order[head++]));
+
+         neighbours.clear();
+
+         exc.all([this,&neighbours,unvisited] (unsigned int, unsigned int, unsigned long long j) {
+               if(position[j] == unvisited)
+                  neighbours.push_back(j);
+               });
+
+         std::sort(neighbours.begin(), neighbours.end());
+
+         for(auto j: neighbours)
+         {
+            order[tail] = j;
+            position[j] = tail++;
+         }
+      }
+   }
+
+   std::reverse(order.begin(), order.end());
+
+#pragma omp parallel for
+   for(unsigned long long i=0;i<dim;i++)
+      position[order[i]] = i;
 }
 
 /**
- * Save the sparse matrix to a file. Stores only the sparse matrix,
- * not number of electrons, ...
- * @param filename the name of the file
+ * Internal method: copy a vector in the order of Permutation (as used outside
+ * this class) to the order of the rows of the stored matrix, see SetOrdering()
+ * @param colex the vector in the order of Permutation
+ * @param rows on return the vector in the order of the rows (may be the same as colex)
  */
-void DOCIHamiltonian::SaveToFile(std::string filename) const
+void DOCIHamiltonian::ToRowOrder(const double *colex, double *rows) const
 {
-   mat->WriteToFile(filename.c_str(), "ham");
+   const auto n = getdim();
+
+   if(order.empty())
+   {
+      if(colex != rows)
+         std::copy(colex, colex+n, rows);
+
+      return;
+   }
+
+   std::vector<double> tmp;
+
+   if(colex == rows)
+   {
+      tmp.assign(colex, colex+n);
+      colex = tmp.data();
+   }
+
+#pragma omp parallel for
+   for(unsigned long long i=0;i<n;i++)
+      rows[i] = colex[order[i]];
 }
 
 /**
- * Read the sparse matrix from a file. Reads only the sparse matrix,
- * not number of electrons, ...
- * You still need to construct a object first with a suited Molecule object.
- * @param filename the name of the file
+ * Internal method: the inverse of ToRowOrder()
+ * @param rows the vector in the order of the rows of the stored matrix
+ * @param colex on return the vector in the order of Permutation (may be the same as rows)
  */
-void DOCIHamiltonian::ReadFromFile(std::string filename)
+void DOCIHamiltonian::FromRowOrder(const double *rows, double *colex) const
 {
-   mat->ReadFromFile(filename.c_str(), "ham");
+   const auto n = getdim();
+
+   if(order.empty())
+   {
+      if(colex != rows)
+         std::copy(rows, rows+n, colex);
+
+      return;
+   }
+
+   std::vector<double> tmp;
+
+   if(colex == rows)
+   {
+      tmp.assign(rows, rows+n);
+      rows = tmp.data();
+   }
+
+#pragma omp parallel for
+   for(unsigned long long i=0;i<n;i++)
+      colex[order[i]] = rows[i];
 }
 
 /**
- * Calculate the number lowest energy levels
- * @param number the number of energy levels to calculate
- * @return list of the energies
+ * Internal method: time a few products with the stored matrix and print the effective
+ * memory bandwidth, the mean distance of the off-diagonal elements to the diagonal and
+ * the hardware cache misses per element (when the performance counters are available,
+ * see helpers::CacheMissCounter). Use this to compare orderings (see SetOrdering()).
+ * In SELL storage this times the CRS matrix before the conversion.
+ * Build() only calls this when asked for, see helpers::Diagnostics().
  */
-std::vector<double> DOCIHamiltonian::CalcEnergy(int number) const
+void DOCIHamiltonian::ReportSpMV() const
 {
-   // dimension of the matrix
-   int n = mat->gn();
-
-   // number of eigenvalues to calculate
-   int nev = number;
+   const auto n = getdim();
+   const auto nnz = mat->NumOfEl();
+   const int n_prod = 3;
 
-   // reverse communication parameter, must be zero on first iteration
-   int ido = 0;
-   // standard eigenvalue problem A*x=lambda*x
-   char bmat = 'I';
-   // calculate the smallest algebraic eigenvalue
-   char which[] = {'S','A'};
-   // calculate until machine precision
-   double tol = 0;
+   std::vector<double, helpers::default_init_allocator<double>> x(n), y(n);
+   PlaceVectors(x.data(), 1);
+   PlaceVectors(y.data(), 1);
 
-   // the residual vector
-   std::unique_ptr<double []> resid(new double[n]);
+#pragma omp parallel for
+   for(unsigned long long i=0;i<n;i++)
+      x[i] = 1.0 / (1.0 + i);
 
-   // the number of columns in v: the number of lanczos vector
-   // generated at each iteration, ncv <= n
-   // We use the answer to life, the universe and everything, if possible
-   int ncv = 42;
+   double distance = 0;
+
+#pragma omp parallel for reduction(+:distance) schedule(dynamic,1024)
+   for(unsigned long long i=0;i<n;i++)
+      for(crs_col_t k=1;k<mat->NumOfElInRow(i);k++)
+      {
+         const double j = mat->GetElementColIndexInRow(i, k);
+         distance += std::fabs(j - i);
+      }
+
+   distance /= std::max(1ull, nnz - n);
+
+   helpers::CacheMissCounter misses;
+
+   auto start = std::chrono::high_resolution_clock::now();
+
+   for(int p=0;p<n_prod;p++)
+      mat->mvprod(x.data(), y.data());
+
+   auto end = std::chrono::high_resolution_clock::now();
+
+   const auto n_misses = misses.Stop();
+
+   const double time = std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() / n_prod;
+
+   // the minimal traffic: every element once, the row pointers once, x read and y written
+   double bytes = nnz * sizeof(crs_col_t) + 2 * n * sizeof(double);
+
+   if(storage == Storage::PairCRS)
+      bytes += (n+1) * sizeof(crs_row_t) + nnz * sizeof(unsigned short) + n * sizeof(double);
+   else
+      bytes += (n+1) * sizeof(crs_row_t) + nnz * sizeof(double);
+
+   std::cout << "SpMV: " << time << " s, " << bytes / time / 1e9 << " GB/s, mean column distance " << distance;
+
+   if(n_misses >= 0)
+      std::cout << ", " << static_cast<double>(n_misses) / (n_prod * nnz) << " cache misses per element";
+
+   std::cout << std::endl;
+}
+
+/**
+ * Internal method: count the elements of every row of the upper diagonal part
+ * (the diagonal and the pair excitations to later kets) and return the row
+ * pointers for SparseMatrix_CRS::Allocate(). A pair in orbital s can move to all
+ * empty orbitals above s: the orbitals above s minus the occupied ones.
+ * After a reordering, we have to count the excitations to later rows one by one.
+ * In the full matrix, every row has the diagonal and all n_pairs*(L-n_pairs) excitations.
+ * @param full count the elements of the full matrix instead of the upper diagonal part
+ * @return the row pointers (size getdim()+1)
+ */
+std::vector<crs_row_t> DOCIHamiltonian::PlanRows(bool full) const
+{
+   const auto L = molecule->get_n_sp();
+   const auto n_pairs = molecule->get_n_electrons()/2;
+
+   std::vector<crs_row_t> row_ptr(getdim()+1);
+   row_ptr[0] = 0;
+
+   if(full)
+   {
+      const crs_row_t row_length = 1 + n_pairs * (L - n_pairs);
+
+      for(unsigned long long i=0;i<=getdim();i++)
+         row_ptr[i] = i * row_length;
+
+      return row_ptr;
+   }
+
+#pragma omp parallel
+   {
+      const auto num_t = omp_get_num_threads();
+      const auto me = omp_get_thread_num();
+
+      const auto i_start = (getdim()*me)/num_t;
+      const auto i_end = (getdim()*(me+1))/num_t;
+
+      Permutation my_perm(*permutations);
+
+      if(!order.empty())
+      {
+         PairExcitations<0> exc(n_pairs, L);
+
+         for(auto i=i_start;i<i_end;++i)
+         {
+            exc.set(my_perm.get(order[i]));
+
+            // the diagonal
+            crs_row_t count = 1;
+
+            exc.all([this,i,&count] (unsigned int, unsigned int, unsigned long long j) {
+                  count += (position[j] > i);
+                  });
+
+            row_ptr[i+1] = count;
+         }
+      }
+      else if(i_start < i_end)
+      {
+         my_perm.unrank(i_start);
+
+         for(auto i=i_start;i<i_end;++i)
+         {
+            auto bra = my_perm.get();
+
+            // the diagonal
+            crs_row_t count = 1;
+
+            // s is the a-th occupied orbital: n_pairs-1-a occupied orbitals lie above it
+            for(unsigned int a=0;a<n_pairs;a++)
+            {
+               const auto s = ctz(bra);
+               bra &= bra - 1;
+
+               count += (L-1-s) - (n_pairs-1-a);
+            }
+
+            row_ptr[i+1] = count;
+
+            my_perm.next();
+         }
+      }
+   }
+
+   std::partial_sum(row_ptr.begin(), row_ptr.end(), row_ptr.begin());
+
+   return row_ptr;
+}
+
+/**
+ * The exact number of elements in the upper diagonal part of the hamiltonian,
+ * with the diagonal. Every pair of orbitals r > s connects the kets with s occupied
+ * and r empty to the same kets with the pair moved from s to r: the other
+ * n_pairs-1 pairs are spread over the remaining L-2 orbitals.
+ * @param L the number of orbitals
+ * @param n_pairs the number of pairs
+ * @return the number of non-zero elements that Build() stores
+ */
+unsigned long long DOCIHamiltonian::CountNonZero(unsigned int L, unsigned int n_pairs)
+{
+   const auto dim = Permutation::CalcCombinations(L, n_pairs);
+
+   if(n_pairs == 0 || n_pairs == L)
+      return dim;
+
+   const auto pairs = Permutation::CalcCombinations(L, 2);
+   const auto others = Permutation::CalcCombinations(L-2, n_pairs-1);
+
+   if(others > (std::numeric_limits<unsigned long long>::max() - dim) / pairs)
+      throw std::overflow_error("Overflow in CountNonZero");
+
+   return dim + pairs * others;
+}
+
+/**
+ * Predict the memory (in bytes) that Build() needs for a storage mode. This counts
+ * the arrays of the sparse matrix, the diagonal and the private buffers of the
+ * threads in SparseMatrix_CRS::mvprod() with the current number of OpenMP threads.
+ * @param L the number of orbitals
+ * @param n_pairs the number of pairs
+ * @param mode the storage mode
+ * @param part the stored part of the matrix (ignored for SELL, MatrixFree and OutOfCore, see Build())
+ * @return the predicted memory usage in bytes
+ */
+std::size_t DOCIHamiltonian::MemoryUsage(unsigned int L, unsigned int n_pairs, Storage mode, Pattern part)
+{
+   const std::size_t dim = Permutation::CalcCombinations(L, n_pairs);
+
+   // the diagonal is always kept
+   std::size_t bytes = dim * sizeof(double);
+
+   if(mode == Storage::MatrixFree)
+      return bytes;
+
+   if(mode == Storage::OutOfCore)
+   {
+      // two blocks of rows (see Build_blocks()), or the whole matrix when it is smaller
+      const auto on_disk = MemoryUsage(L, n_pairs, Storage::PairCRS, Pattern::Full) - bytes;
+
+      return bytes + std::min(2 * OutOfCoreBlock(), on_disk);
+   }
+
+   const bool full = (part == Pattern::Full && mode != Storage::SELL);
+
+   // every off-diagonal element appears twice in the full matrix
+   const std::size_t nnz = full ? 2 * CountNonZero(L, n_pairs) - dim : CountNonZero(L, n_pairs);
+
+   // row pointers and column indices
+   bytes += (dim+1) * sizeof(crs_row_t) + nnz * sizeof(crs_col_t);
+
+   if(mode == Storage::PairCRS)
+      // a pair index per element, data only holds the diagonal, and the pair table
+      bytes += nnz * sizeof(unsigned short) + dim * sizeof(double) + L * L * sizeof(double);
+   else
+      bytes += nnz * sizeof(double);
+
+   if(mode == Storage::SELL)
+      // the CRS matrix and its SELL copy during the conversion, without the padding
+      bytes += nnz * (sizeof(double) + sizeof(crs_col_t)) + (dim / helpers::SparseMatrix_SELL::C + 1) * sizeof(crs_row_t);
+
+   // the scatter buffers of mvprod
+   if(!full)
+      bytes += (omp_get_max_threads()-1) * dim * sizeof(double);
+
+   return bytes;
+}
+
+/**
+ * Predict the memory (in bytes) of the work space of an eigensolver, including
+ * the eigenvectors (see Diagonalize_arpack() and Diagonalize_davidson()). The
+ * Davidson solvers multiply with up to nroots vectors at once: this adds the
+ * interleaved copies in mvprod_blocks() and, for the upper diagonal part, the
+ * scatter buffers of the threads grow with the block (see MemoryUsage() for
+ * those of a single vector). This is the most it takes: BlockSize() uses smaller
+ * blocks when they do not fit.
+ * @param dim the dimension of the hamiltonian
+ * @param method the eigensolver
+ * @param nroots the number of states to calculate
+ * @param part the stored part of the matrix
+ * @return the predicted memory usage in bytes
+ */
+std::size_t DOCIHamiltonian::SolverMemory(unsigned long long dim, Solver method, unsigned int nroots, Pattern part)
+{
+   nroots = std::max(1ull, std::min(static_cast<unsigned long long>(nroots), dim));
+
+   std::size_t vectors;
+
+   if(method == Solver::Davidson)
+   {
+      const std::size_t max_space = std::min(dim, std::max(8ull*nroots, 24ull));
+      // V, HV, the Ritz vectors and H times them, the eigenvectors
+      vectors = 2*max_space + 3*nroots;
+   }
+   else if(method == Solver::MixedDavidson)
+   {
+      const std::size_t max_space = std::min(dim, std::max(8ull*nroots, 24ull));
+      const std::size_t refine_space = std::min(dim, std::max(4ull*nroots, 8ull));
+      // V and HV in float (counted as half a vector), the Ritz vectors and H times them,
+      // the block product in double (x and y), the eigenvectors. The refinement also
+      // keeps the start.
+      vectors = std::max(max_space + 5*nroots, 2*refine_space + 4*nroots);
+   }
+   else
+   {
+      const std::size_t ncv = std::min(dim, std::max(42ull, 2ull*nroots+1));
+      // the Lanczos basis, resid, workd (3) and the eigenvectors
+      vectors = ncv + 4 + nroots;
+   }
+
+   if(method != Solver::Arpack && nroots > 1)
+   {
+      const std::size_t block = std::min(nroots, helpers::SparseMatrix_CRS::max_block);
+
+      // X and Y interleaved in block_buffer
+      vectors += 2*block;
+
+      if(part == Pattern::Upper)
+         vectors += (omp_get_max_threads()-1) * (block-1);
+   }
+
+   return vectors * dim * sizeof(double);
+}
+
+/**
+ * Estimate the cost of the hamiltonian without building it: every thread handles a
+ * block of consecutive rows, evenly spread over the basis, in the same way as
+ * Build_iter() (build), a stored matrix-vector product (spmv) and sigma() (sigma).
+ * The matrix elements are not calculated, so no integrals are needed. The vector to
+ * multiply with is smaller than the basis when that is large, so the gathers
+ * only approximate the cache behaviour of the real product.
+ * @param L the number of orbitals
+ * @param n_pairs the number of pairs
+ * @param n_rows the number of rows to sample (in total)
+ * @param build on return the estimated wall time (s) of Build() with all threads
+ * @param spmv on return the estimated wall time (s) of one product with the stored matrix
+ * @param sigma on return the estimated wall time (s) of one matrix-free sigma()
+ */
+void DOCIHamiltonian::Calibrate(unsigned int L, unsigned int n_pairs, unsigned long long n_rows, double &build, double &spmv, double &sigma)
+{
+   const auto dim = Permutation::CalcCombinations(L, n_pairs);
+
+   n_rows = std::max(1ull, std::min(n_rows, dim));
+
+   // the largest power of 2 up to dim, but small enough for a planning run
+   std::size_t x_size = 1;
+   while(2*x_size <= std::min(dim, 1ull << 22))
+      x_size *= 2;
+
+   std::vector<double> x(x_size, 1.0);
+
+   double t_build = 0, t_spmv = 0, t_sigma = 0;
+
+   // the threads share the work evenly (dynamic chunks in Build(), equal
+   // elements in mvprod()), so the wall time is the average of the threads
+#pragma omp parallel reduction(+:t_build,t_spmv,t_sigma)
+   {
+      const auto num_t = omp_get_num_threads();
+      const auto me = omp_get_thread_num();
+
+      const auto block = std::max(1ull, n_rows / num_t);
+      const auto i_start = std::min(dim - block, (dim * me) / num_t);
+
+      DISPATCH_PAIRS(n_pairs, Calibrate_iter, L, n_pairs, i_start, i_start + block, x, t_build, t_spmv, t_sigma);
+
+      // from the sample to all the rows of this thread, averaged over the threads
+      const double scale = static_cast<double>(dim) / (num_t * block) / num_t;
+
+      t_build *= scale;
+      t_spmv *= scale;
+      t_sigma *= scale;
+   }
+
+   build = t_build;
+   spmv = t_spmv;
+   sigma = t_sigma;
+}
+
+/**
+ * Internal method: time the work of rows i_start up to i_end, see Calibrate().
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param L the number of orbitals
+ * @param n_pairs the number of pairs
+ * @param i_start the first row
+ * @param i_end the end of the rows
+ * @param x the vector to multiply with, a power of 2 long (ket j uses element j modulo its size)
+ * @param build on return the time (s) to generate the sorted upper diagonal rows
+ * @param spmv on return the time (s) of the product with these rows in CRS
+ * @param sigma on return the time (s) of the matrix-free product for these rows
+ */
+template<unsigned int NP>
+void DOCIHamiltonian::Calibrate_iter(unsigned int L, unsigned int n_pairs, unsigned long long i_start, unsigned long long i_end, const std::vector<double> &x, double &build, double &spmv, double &sigma)
+{
+   typedef std::chrono::duration<double,std::ratio<1>> seconds;
+
+   const auto x_mask = x.size() - 1;
+   // the scatter target of every thread, kept smaller than x
+   std::vector<double> y(std::min(x.size(), std::size_t(1) << 20), 0);
+   const auto y_mask = y.size() - 1;
+
+   Permutation perm(n_pairs);
+   perm.unrank(i_start);
+
+   PairExcitations<NP> exc(n_pairs, L);
+
+   std::vector< std::pair<unsigned long long,unsigned short> > row_elems;
+
+   // the sampled rows in CRS
+   std::vector<crs_row_t> row(1, 0);
+   std::vector<crs_col_t> col;
+   std::vector<double> data;
+   col.reserve((i_end-i_start) * (1 + n_pairs*(L-n_pairs)));
+   data.reserve(col.capacity());
+
+   auto start = std::chrono::high_resolution_clock::now();
+
+   for(auto i=i_start;i<i_end;++i)
+   {
+      exc.set(perm.get());
+
+      col.push_back(i & x_mask);
+      data.push_back(1.0);
+
+      row_elems.clear();
+
+      exc.upper([&row_elems,L] (unsigned int r, unsigned int s, unsigned long long j) {
+            row_elems.push_back(std::make_pair(j, r*L+s));
+            });
+
+      std::sort(row_elems.begin(), row_elems.end());
+
+      for(auto &elem: row_elems)
+      {
+         col.push_back(elem.first & x_mask);
+         data.push_back(1.0);
+      }
+
+      row.push_back(col.size());
+
+      perm.next();
+   }
+
+   auto end = std::chrono::high_resolution_clock::now();
+   build = std::chrono::duration_cast<seconds>(end-start).count();
+
+   start = std::chrono::high_resolution_clock::now();
+
+   // as in SparseMatrix_CRS::mvprod()
+   for(std::size_t i=0;i+1<row.size();i++)
+   {
+      const double x_i = x[col[row[i]]];
+      double tmp = 0;
+
+      for(auto k=row[i];k<row[i+1];k++)
+      {
+         tmp += data[k] * x[col[k]];
+         y[col[k] & y_mask] += data[k] * x_i;
+      }
+
+      y[i & y_mask] += tmp;
+   }
+
+   end = std::chrono::high_resolution_clock::now();
+   spmv = std::chrono::duration_cast<seconds>(end-start).count();
+
+   perm.unrank(i_start);
+
+   start = std::chrono::high_resolution_clock::now();
+
+   // as in sigma_kernel()
+   for(auto i=i_start;i<i_end;++i)
+   {
+      exc.set(perm.get());
+
+      double tmp = x[i & x_mask];
+
+      exc.all([&tmp,&x,x_mask] (unsigned int r, unsigned int s, unsigned long long j) {
+            tmp += x[j & x_mask];
+            });
+
+      y[i & y_mask] = tmp;
+
+      perm.next();
+   }
+
+   end = std::chrono::high_resolution_clock::now();
+   sigma = std::chrono::duration_cast<seconds>(end-start).count();
+
+   // keep the compiler from dropping the products
+   volatile double sink = y[0];
+   (void) sink;
+}
+
+/**
+ * Refresh the hamiltonian after the integrals changed (e.g. after an orbital rotation).
+ * The sparsity pattern only depends on the basis, not on the integrals: we keep
+ * it and only recalculate the values, in one parallel pass over the matrix.
+ * The pair excitations of every row are generated as in Build() (see
+ * UpdateValues_iter()), which gives the orbitals of every off-diagonal element.
+ * In PairCRS storage only the diagonal and the pair table are recalculated.
+ * If the hamiltonian is not build yet, or in SELL or OutOfCore storage or mapped from
+ * the cache (which can not be changed), this does a full Build().
+ * @param mol the new molecular data, with the same number of orbitals and electrons
+ */
+void DOCIHamiltonian::UpdateValues(const Molecule &mol)
+{
+   assert(mol.get_n_sp() == molecule->get_n_sp() && mol.get_n_electrons() == molecule->get_n_electrons());
+
+   // the optimizers change our own molecule in place
+   if(&mol != molecule.get())
+      molecule.reset(mol.clone());
+
+   if(diag.size() != getdim() || storage == Storage::SELL || storage == Storage::OutOfCore || mat->IsMapped())
+   {
+      Build();
+      return;
+   }
+
+   molecule->BuildIntegralCache();
+
+   if(storage == Storage::MatrixFree)
+   {
+      Build_diagonal();
+      return;
+   }
+
+   auto num_t = omp_get_max_threads();
+
+   // see Build() for the chunks
+   const unsigned long long num_chunks = std::max(1ull, std::min(16ull*num_t, getdim()));
+   const auto n_pairs = molecule->get_n_electrons()/2;
+
+#pragma omp parallel
+   {
+      Permutation my_perm(*permutations);
+
+#pragma omp for schedule(dynamic)
+      for(unsigned long long c=0;c<num_chunks;c++)
+      {
+         const auto i_start = (getdim()*c)/num_chunks;
+         const auto i_end = (getdim()*(c+1))/num_chunks;
+
+         if(i_start < i_end && order.empty())
+            my_perm.unrank(i_start);
+
+         DISPATCH_PAIRS(n_pairs, UpdateValues_iter, my_perm, i_start, i_end);
+      }
+   }
+
+   if(storage == Storage::PairCRS)
+      mat->SetPairTable(CalcPairTable(*molecule));
+}
+
+/**
+ * Internal method: the work of UpdateValues() for the rows i_start up to i_end. The
+ * pair excitations of every bra are generated again in the same order as in
+ * Build_iter(), so the k-th one belongs to the k-th element of the row and no ket
+ * has to be looked up from its column. In PairCRS storage only the diagonal changes.
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param perm the permutation at row i_start (in colex order)
+ * @param i_start the first row
+ * @param i_end the end of the rows
+ */
+template<unsigned int NP>
+void DOCIHamiltonian::UpdateValues_iter(Permutation &perm, unsigned long long i_start, unsigned long long i_end)
+{
+   const auto L = molecule->get_n_sp();
+   const auto *P = molecule->getP();
+   const bool only_diag = (storage == Storage::PairCRS);
+
+   PairExcitations<NP> exc(molecule->get_n_electrons()/2, L);
+
+   // column and pair index r*L+s of the off-diagonal elements of the current row
+   std::vector< std::pair<unsigned long long,unsigned short> > row_elems;
+
+   for(auto i=i_start;i<i_end;++i)
+   {
+      exc.set(order.empty() ? perm.get() : perm.get(order[i]));
+
+      diag[i] = CalcDiagonal(exc, *molecule);
+      mat->SetElementInRow(i, 0, diag[i]);
+
+      if(!only_diag)
+      {
+         RowElements(exc, i, mat->IsFull(), row_elems);
+
+         assert(row_elems.size()+1 == mat->NumOfElInRow(i));
+
+         crs_col_t k = 1;
+
+         for(auto &elem: row_elems)
+         {
+            assert(mat->GetElementColIndexInRow(i, k) == elem.first);
+
+            // TEI: a \bar a ; b \bar b
+            mat->SetElementInRow(i, k++, P[elem.second]);
+         }
+      }
+
+      if(order.empty())
+         perm.next();
+   }
+}
+
+/**
+ * Calculate the table with the pair hopping integrals <rr|V|ss>,
+ * stored at r*L+s
+ * @param mol the molecule data to use
+ * @return the table
+ */
+std::vector<double> DOCIHamiltonian::CalcPairTable(const Molecule &mol)
+{
+   const auto L = mol.get_n_sp();
+   const auto *P = mol.getP();
+
+   return std::vector<double>(P, P+L*L);
+}
+
+/**
+ * Set the way the hamiltonian is stored, call this before Build()
+ * @param type the new storage type
+ */
+void DOCIHamiltonian::SetStorage(Storage type)
+{
+   storage = type;
+}
+
+/**
+ * @return the way the hamiltonian is stored
+ */
+DOCIHamiltonian::Storage DOCIHamiltonian::GetStorage() const
+{
+   return storage;
+}
+
+/**
+ * Set the order of the rows of the stored hamiltonian, call this before Build().
+ * A good ordering puts the non-zero elements close to the diagonal, so the
+ * gathers in the matrix-vector product hit the cache more often. The ordering
+ * is internal: all vectors going in or out (start vector, eigenvectors) stay in
+ * the order of Permutation. It is ignored in MatrixFree storage.
+ * @param type the new ordering
+ */
+void DOCIHamiltonian::SetOrdering(Ordering type)
+{
+   ordering = type;
+}
+
+/**
+ * @return the order of the rows of the stored hamiltonian
+ */
+DOCIHamiltonian::Ordering DOCIHamiltonian::GetOrdering() const
+{
+   return ordering;
+}
+
+/**
+ * Set which part of the hamiltonian is stored, call this before Build().
+ * The full matrix needs about twice the memory of the upper diagonal part, but
+ * its matrix-vector product has no scatter and no private buffers per thread.
+ * It is ignored in SELL and MatrixFree storage.
+ * @param type the part to store
+ */
+void DOCIHamiltonian::SetPattern(Pattern type)
+{
+   pattern = type;
+}
+
+/**
+ * @return which part of the hamiltonian is stored
+ */
+DOCIHamiltonian::Pattern DOCIHamiltonian::GetPattern() const
+{
+   return pattern;
+}
+
+/**
+ * Choose the eigensolver for Diagonalize() and CalcEnergy()
+ * @param type the new eigensolver
+ */
+void DOCIHamiltonian::SetSolver(Solver type)
+{
+   solver = type;
+}
+
+/**
+ * @return the eigensolver in use
+ */
+DOCIHamiltonian::Solver DOCIHamiltonian::GetSolver() const
+{
+   return solver;
+}
+
+/**
+ * Set the convergence tolerance of the eigensolver. For ARPACK this
+ * is the relative accuracy of the eigenvalue, for Davidson the norm of
+ * the residual. Use a loose tolerance for a cheap estimate (e.g. in an
+ * optimization loop), 0 means as accurate as possible.
+ * @param tol the new tolerance
+ */
+void DOCIHamiltonian::SetTolerance(double tol)
+{
+   tolerance = tol;
+}
+
+/**
+ * @return the convergence tolerance of the eigensolver
+ */
+double DOCIHamiltonian::GetTolerance() const
+{
+   return tolerance;
+}
+
+/**
+ * Set a start vector for the eigensolver, e.g. the eigenvector of
+ * a previous (slightly different) hamiltonian. It is used by
+ * all later calls of Diagonalize() and CalcEnergy(). An empty vector
+ * means a (random) start vector chosen by the eigensolver.
+ * @param start the start vector, of size getdim() or empty
+ */
+void DOCIHamiltonian::SetStartVector(std::vector<double> start)
+{
+   if(!start.empty() && start.size() != getdim())
+   {
+      std::cerr << "Start vector has the wrong dimension, ignoring it" << std::endl;
+      start.clear();
+   }
+
+   start_vector = std::move(start);
+}
+
+/**
+ * @return the start vector of the eigensolver (empty if not set)
+ */
+const std::vector<double>& DOCIHamiltonian::GetStartVector() const
+{
+   return start_vector;
+}
+
+/**
+ * Internal method: this will iterate and build a part of the full sparse hamiltonian matrix.
+ * Instead of comparing the bra with all later kets, we generate all pair excitations
+ * of the bra directly with PairExcitations, which also gives the row of every ket.
+ * This makes the cost scale with the number of non-zero elements instead of dim^2.
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param perm the start permutation to use
+ * @param mat where to store the sparse matrix data
+ * @param i_start the start point to iter
+ * @param i_end the end point of the iterations
+ * @param mol the molecule data to use
+ * @param first the row of the hamiltonian in the first row of mat, when mat only holds
+ * a block of rows (see Build_blocks()), 0 for the whole matrix
+ */
+template<unsigned int NP>
+void DOCIHamiltonian::Build_iter(Permutation &perm, helpers::SparseMatrix_CRS &mat,unsigned long long i_start, unsigned long long i_end, const Molecule &mol, unsigned long long first)
+{
+   auto &perm_bra = perm;
+
+   const auto L = mol.get_n_sp();
+   const auto *P = mol.getP();
+
+   PairExcitations<NP> exc(mol.get_n_electrons()/2, L);
+
+   // column and pair index r*L+s of the off-diagonal elements of the current row
+   std::vector< std::pair<unsigned long long,unsigned short> > row_elems;
+
+   assert(L*L <= std::numeric_limits<unsigned short>::max()+1);
+
+   for(auto i=i_start;i<i_end;++i)
+   {
+      exc.set(order.empty() ? perm_bra.get() : perm_bra.get(order[i]));
+
+      diag[i] = CalcDiagonal(exc, mol);
+
+      mat.FillElementInRow(i-first, 0, i, diag[i]);
+
+      RowElements(exc, i, mat.IsFull(), row_elems);
+
+      assert(row_elems.size()+1 == mat.NumOfElInRow(i-first));
+
+      crs_col_t k = 1;
+
+      if(storage == Storage::PairCRS || storage == Storage::OutOfCore)
+         for(auto &elem: row_elems)
+            mat.FillPairInRow(i-first, k++, elem.first, elem.second);
+      else
+         for(auto &elem: row_elems)
+         {
+            const auto r = elem.second / L;
+            const auto s = elem.second % L;
+
+            // TEI: a \bar a ; b \bar b
+            mat.FillElementInRow(i-first, k++, elem.first, P[r*L+s]);
+         }
+
+      if(order.empty())
+         perm_bra.next();
+   }
+}
+
+/**
+ * Internal method: the off-diagonal elements of row i, in the order of the columns
+ * in the sparse matrix (see Build_iter()): the column and the pair index r*L+s
+ * of every pair excitation of the bra to a ket in the stored part of the row.
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param exc the excitation generator with the bra of row i set
+ * @param i the row
+ * @param full take the lower diagonal part too
+ * @param row_elems on return the column and pair index of the elements, sorted on column
+ */
+template<unsigned int NP>
+void DOCIHamiltonian::RowElements(const PairExcitations<NP> &exc, unsigned long long i, bool full, std::vector< std::pair<unsigned long long,unsigned short> > &row_elems) const
+{
+   const auto L = molecule->get_n_sp();
+
+   row_elems.clear();
+
+   // move a pair from occupied orbital s to empty orbital r > s: upper diagonal part
+   if(order.empty())
+      exc.upper([&row_elems,L] (unsigned int r, unsigned int s, unsigned long long j) {
+            row_elems.push_back(std::make_pair(j, r*L+s));
+            });
+   else if(!full)
+      // after a reordering, the upper diagonal part are the kets in later rows
+      exc.all([this,&row_elems,i,L] (unsigned int r, unsigned int s, unsigned long long j) {
+            if(position[j] > i)
+               row_elems.push_back(std::make_pair(position[j], r*L+s));
+            });
+
+   // the full matrix also has the lower diagonal part: the kets in earlier rows,
+   // in colex order the excitations to r < s. After a reordering, we take all kets here.
+   if(full)
+      exc.all([this,&row_elems,L] (unsigned int r, unsigned int s, unsigned long long j) {
+            if(!order.empty())
+               row_elems.push_back(std::make_pair(position[j], r*L+s));
+            else if(r < s)
+               row_elems.push_back(std::make_pair(j, r*L+s));
+            });
+
+   std::sort(row_elems.begin(), row_elems.end());
+}
+
+/**
+ * Calculate the diagonal element of the hamiltonian for a basis state
+ * @param bra the basis state
+ * @param mol the molecule data to use
+ * @return the diagonal matrix element <bra|H|bra>
+ */
+double DOCIHamiltonian::CalcDiagonal(mybitset bra, const Molecule &mol)
+{
+   PairExcitations<0> exc(CountBits(bra), mol.get_n_sp());
+
+   exc.set(bra);
+
+   return CalcDiagonal(exc, mol);
+}
+
+/**
+ * Calculate the diagonal element of the hamiltonian for the bra in exc
+ * @param exc the excitation generator with the bra set
+ * @param mol the molecule data to use
+ * @return the diagonal matrix element <bra|H|bra>
+ */
+template<unsigned int NP>
+double DOCIHamiltonian::CalcDiagonal(const PairExcitations<NP> &exc, const Molecule &mol)
+{
+   const auto L = mol.get_n_sp();
+   const auto *J = mol.getJ();
+   const auto *K = mol.getK();
+   const auto *P = mol.getP();
+   const auto *T = mol.getTdiag();
+
+   const auto n = exc.num_occupied();
+   const auto *occ = exc.occupied();
+
+   double tmp = 0;
+
+   for(unsigned int a=0;a<n;a++)
+   {
+      const auto s = occ[a];
+
+      // OEI part
+      tmp += 2 * T[s];
+
+      // TEI: part a \bar a ; a \bar a
+      tmp += P[s*L+s];
+
+      // s < r !! (avoid double counting)
+      for(unsigned int b=a+1;b<n;b++)
+      {
+         const auto r = occ[b];
+
+         // TEI:
+         // - a b ; a b
+         // - a \bar b ; a \bar b
+         // - \bar a \bar b ; \bar a \bar b
+         // with a < b
+         // The second term (ab|V|ba) is not possible in the second
+         // case, so only a prefactor of 2 instead of 4.
+         tmp += 4 * J[r*L+s];
+         tmp -= 2 * K[r*L+s];
+      }
+   }
+
+   return tmp;
+}
+
+/**
+ * Internal method: for the MatrixFree storage we only calculate the diagonal
+ * of the hamiltonian. The off-diagonal elements are regenerated from the
+ * pair hopping integrals in the integral cache of the molecule in every call to sigma().
+ */
+void DOCIHamiltonian::Build_diagonal()
+{
+   diag.resize(getdim());
+
+#pragma omp parallel
+   {
+      const auto num_t = omp_get_num_threads();
+      const auto me = omp_get_thread_num();
+
+      const auto i_start = (getdim()*me)/num_t;
+      const auto i_end = (getdim()*(me+1))/num_t;
+
+      Permutation my_perm(*permutations);
+
+      if(i_start < i_end)
+         my_perm.unrank(i_start);
+
+      for(auto i=i_start;i<i_end;++i)
+      {
+         diag[i] = CalcDiagonal(my_perm.get(), *molecule);
+         my_perm.next();
+      }
+   }
+}
+
+/**
+ * Matrix-free matrix-vector product: y = H*x. Every thread takes a block of rows,
+ * generates all pair excitations of every bra on the fly and gathers the matching
+ * elements of x. There is no write to y outside the own rows, so no reduction is
+ * needed. Only available after Build() in MatrixFree storage.
+ * @param x the vector to multiply with (size getdim())
+ * @param y on return will hold H*x (size getdim())
+ */
+void DOCIHamiltonian::sigma(const double *x, double *y) const
+{
+   sigma(x, y, 1);
+}
+
+/**
+ * Matrix-free product for nvec vectors at once: Y = H*X. The vectors are interleaved
+ * (element i of vector v at i*nvec+v), so every matrix element is calculated only
+ * once for all of them (see sigma(x,y)).
+ * @param x n x nvec matrix, the vectors to multiply with (interleaved)
+ * @param y n x nvec matrix, on return will hold H*X (interleaved)
+ * @param nvec the number of vectors, at most SparseMatrix_CRS::max_block
+ */
+void DOCIHamiltonian::sigma(const double *x, double *y, unsigned int nvec) const
+{
+   assert(storage == Storage::MatrixFree && diag.size() == getdim());
+   assert(nvec <= helpers::SparseMatrix_CRS::max_block);
+
+   DISPATCH_PAIRS(molecule->get_n_electrons()/2, sigma_kernel, x, y, nvec);
+}
+
+/**
+ * Internal method: the actual work of sigma().
+ * NP is the number of pairs if known at compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param x n x nvec matrix, the vectors to multiply with (interleaved)
+ * @param y n x nvec matrix, on return will hold H*X (interleaved)
+ * @param nvec the number of vectors
+ */
+template<unsigned int NP>
+void DOCIHamiltonian::sigma_kernel(const double *x, double *y, unsigned int nvec) const
+{
+   const auto L = molecule->get_n_sp();
+   const auto *P = molecule->getP();
+   const auto n_pairs = molecule->get_n_electrons()/2;
+
+#pragma omp parallel
+   {
+      const auto num_t = omp_get_num_threads();
+      const auto me = omp_get_thread_num();
+
+      // every row has the same number of excitations: an even split is balanced
+      const auto i_start = (getdim()*me)/num_t;
+      const auto i_end = (getdim()*(me+1))/num_t;
+
+      Permutation my_perm(*permutations);
+      PairExcitations<NP> exc(n_pairs, L);
+
+      if(i_start < i_end)
+         my_perm.unrank(i_start);
+
+      for(auto i=i_start;i<i_end;++i)
+      {
+         exc.set(my_perm.get());
+
+         double tmp[helpers::SparseMatrix_CRS::max_block];
+
+         for(unsigned int v=0;v<nvec;v++)
+            tmp[v] = diag[i] * x[i*nvec+v];
+
+         // move a pair from occupied orbital s to any empty orbital r
+         exc.all([&tmp,P,L,x,nvec] (unsigned int r, unsigned int s, unsigned long long j) {
+               // TEI: a \bar a ; b \bar b
+               const auto P_rs = P[r*L+s];
+
+               for(unsigned int v=0;v<nvec;v++)
+                  tmp[v] += P_rs * x[j*nvec+v];
+               });
+
+         for(unsigned int v=0;v<nvec;v++)
+            y[i*nvec+v] = tmp[v];
+
+         my_perm.next();
+      }
+   }
+}
+
+/**
+ * Internal method: y = H*x with the sparse matrix or matrix-free,
+ * depending on the storage
+ * @param x the vector to multiply with
+ * @param y on return will hold H*x
+ */
+void DOCIHamiltonian::mvprod(const double *x, double *y) const
+{
+   mvprod(x, y, 1);
+}
+
+/**
+ * Internal method: Y = H*X for nvec vectors, one after the other (as in the subspace
+ * of Davidson_kernel()). The vectors are interleaved in blocks of at most
+ * SparseMatrix_CRS::max_block for the block product (SpMM) of the stored matrix
+ * or sigma(), which use every matrix element for all vectors in the block.
+ * The SELL storage has no block product and does the vectors one by one.
+ * In OutOfCore storage, this prints the I/O of the product.
+ * @param x the nvec vectors to multiply with
+ * @param y on return will hold H times every vector
+ * @param nvec the number of vectors
+ */
+void DOCIHamiltonian::mvprod(const double *x, double *y, unsigned int nvec) const
+{
+   const std::size_t n = getdim();
+
+   if(storage == Storage::SELL)
+   {
+      for(unsigned int v=0;v<nvec;v++)
+         sell->mvprod(x+v*n, y+v*n);
+
+      return;
+   }
+
+   if(storage == Storage::OutOfCore)
+   {
+      std::size_t bytes_start, bytes_end;
+      double read_start, read_end, wait_start, wait_end;
+
+      ooc->GetIOStats(bytes_start, read_start, wait_start);
+
+      auto start = std::chrono::high_resolution_clock::now();
+
+      if(nvec == 1)
+         ooc->mvprod(x, y);
+      else
+         mvprod_blocks(x, y, nvec);
+
+      auto end = std::chrono::high_resolution_clock::now();
+
+      ooc->GetIOStats(bytes_end, read_end, wait_end);
+
+      const double bytes = bytes_end - bytes_start;
+      const double read = read_end - read_start;
+
+      std::cout << "Out-of-core product: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s, read " << bytes / 1e9 << " GB in " << read << " s (" << bytes / read / 1e9 << " GB/s), waited " << wait_end - wait_start << " s for the disk" << std::endl;
+
+      return;
+   }
+
+   if(nvec == 1)
+   {
+      if(storage == Storage::MatrixFree)
+         sigma(x, y);
+      else
+         mat->mvprod(x, y);
+
+      return;
+   }
+
+   mvprod_blocks(x, y, nvec);
+}
+
+/**
+ * Internal method: the block products of mvprod(x,y,nvec) for the storages that have
+ * one (not SELL). The vectors are interleaved in block_buffer in blocks of at most
+ * SparseMatrix_CRS::max_block.
+ * @param x the nvec vectors to multiply with, one after the other
+ * @param y on return will hold H times every vector
+ * @param nvec the number of vectors
+ */
+void DOCIHamiltonian::mvprod_blocks(const double *x, double *y, unsigned int nvec) const
+{
+   const std::size_t n = getdim();
+
+   const auto max_block = BlockSize(nvec);
+
+   if(block_buffer.size() < 2*n*max_block)
+      block_buffer.resize(2*n*max_block);
+
+   for(unsigned int start=0;start<nvec;start+=max_block)
+   {
+      const auto nb = std::min(max_block, nvec-start);
+
+      double *xb = block_buffer.data();
+      double *yb = block_buffer.data() + n*nb;
+
+#pragma omp parallel for
+      for(std::size_t i=0;i<n;i++)
+         for(unsigned int v=0;v<nb;v++)
+            xb[i*nb+v] = x[(start+v)*n+i];
+
+      if(storage == Storage::MatrixFree)
+         sigma(xb, yb, nb);
+      else if(storage == Storage::OutOfCore)
+         ooc->mvprod_block(xb, yb, nb);
+      else
+         mat->mvprod_block(xb, yb, nb);
+
+#pragma omp parallel for
+      for(std::size_t i=0;i<n;i++)
+         for(unsigned int v=0;v<nb;v++)
+            y[(start+v)*n+i] = yb[i*nb+v];
+   }
+}
+
+/**
+ * Internal method: the number of vectors in one block of mvprod_blocks(), at most
+ * SparseMatrix_CRS::max_block. In the upper diagonal part of the sparse matrix, every
+ * vector in a block adds a scatter buffer of (almost) the whole dimension for every
+ * thread (see SparseMatrix_CRS::mvprod_block()) and two interleaved copies in
+ * block_buffer. A larger block than the buffers hold already is then only used
+ * when the extra buffers take at most a quarter of the available memory (see
+ * helpers::AvailableMemory()), down to one vector at a time.
+ * @param nvec the number of vectors to multiply with
+ * @return the largest block to use
+ */
+unsigned int DOCIHamiltonian::BlockSize(unsigned int nvec) const
+{
+   const std::size_t n = getdim();
+
+   auto block = std::min(nvec, helpers::SparseMatrix_CRS::max_block);
+
+   // the number of vectors the buffers already hold
+   const std::size_t allocated = block_buffer.size() / (2*n);
+
+   if(block <= allocated || storage == Storage::MatrixFree || storage == Storage::OutOfCore || mat->IsFull())
+      return block;
+
+   const std::size_t per_vector = (omp_get_max_threads() + 1) * n * sizeof(double);
+   const auto available = helpers::AvailableMemory();
+
+   if(available > 0)
+      block = std::max(std::max<std::size_t>(allocated, 1), std::min<std::size_t>(block, allocated + available / 4 / per_vector));
+
+   return block;
+}
+
+/**
+ * Internal method: release the buffers of the products after a diagonalization:
+ * the interleaved vectors of the block product and the scatter buffers of the sparse
+ * matrix. They can be larger than the matrix for several vectors on many threads.
+ */
+void DOCIHamiltonian::FreeBuffers() const
+{
+   decltype(block_buffer)().swap(block_buffer);
+
+   if(storage == Storage::CRS || storage == Storage::PairCRS)
+      mat->FreeBuffers();
+}
+
+/**
+ * Calcalate the lowest eigenvalue and eigenvector using lanczos method.
+ * We use arpack for this.
+ * @return a pair of the lowest eigenvalue and corresponding normalized eigenvector
+ */
+std::pair< double,std::vector<double> > DOCIHamiltonian::Diagonalize() const
+{
+   std::vector<double> eigv(getdim());
+
+   if(solver != Solver::Arpack)
+   {
+      std::vector<double> energies;
+
+      Diagonalize_davidson(1,energies,eigv,true);
+
+      FromRowOrder(eigv.data(), eigv.data());
+
+      return std::make_pair(energies[0], std::move(eigv));
+   }
+
+   std::vector<double> energies;
+
+   Diagonalize_arpack(1,energies,eigv,true);
+
+   FromRowOrder(eigv.data(), eigv.data());
+
+   return std::make_pair(energies[0], std::move(eigv));
+}
+
+/**
+ * Calculate the number lowest eigenvalues and eigenvectors with the eigensolver
+ * (see SetSolver()). The Davidson solvers iterate all states together and use
+ * block matrix-vector products, which is a lot cheaper than a solve per state.
+ * @param number the number of states to calculate
+ * @return a pair of the eigenvalues (lowest first) and the corresponding
+ * normalized eigenvectors, one after the other
+ */
+std::pair< std::vector<double>,std::vector<double> > DOCIHamiltonian::Diagonalize(int number) const
+{
+   std::vector<double> energies, eigv;
+
+   if(solver != Solver::Arpack)
+      Diagonalize_davidson(number,energies,eigv,true);
+   else
+      Diagonalize_arpack(number,energies,eigv,true);
+
+   for(size_t k=0;k<energies.size();k++)
+      FromRowOrder(eigv.data()+k*getdim(), eigv.data()+k*getdim());
+
+   return std::make_pair(std::move(energies), std::move(eigv));
+}
+
+/**
+ * Calcalate the lowest eigenvalue using lanczos method.
+ * We use arpack for this.
+ * @return the lowest eigenvalue
+ */
+double DOCIHamiltonian::CalcEnergy() const
+{
+   std::vector<double> energies, eigv;
+
+   if(solver != Solver::Arpack)
+      Diagonalize_davidson(1,energies,eigv,false);
+   else
+      Diagonalize_arpack(1,energies,eigv,false);
+
+   return energies[0];
+}
+
+/**
+ * Calcalate the nev lowest eigenvalues and (depending on eigvec) eigenvectors using lanczos method.
+ * We use arpack for this.
+ * @param nev the number of eigenvalues to calculate
+ * @param energies on return will hold the nev lowest eigenvalues
+ * @param eigv on return will hold the corresponding eigenvectors, one after the other
+ * @param eigvec if true, calc the eigenvectors and store in eigv
+ * @throw std::overflow_error when the dimension does not fit in an int
+ */
+void DOCIHamiltonian::Diagonalize_arpack(int nev, std::vector<double> &energies, std::vector<double> &eigv, bool eigvec) const
+{
+   // ARPACK only takes an int as dimension
+   if(getdim() > static_cast<unsigned long long>(std::numeric_limits<int>::max()))
+      throw std::overflow_error("Dimension too large for ARPACK, use the Davidson solver (-d or -x)");
+
+   // dimension of the matrix
+   int n = getdim();
+
+   // reverse communication parameter, must be zero on first iteration
+   int ido = 0;
+   // standard eigenvalue problem A*x=lambda*x
+   char bmat = 'I';
+   // calculate the smallest algebraic eigenvalue
+   char which[] = {'S','A'};
+   // relative accuracy of the eigenvalues, 0 is machine precision
+   double tol = tolerance;
+
+   // the residual vector
+   std::unique_ptr<double []> resid(new double[n]);
+
+   // the number of columns in v: the number of lanczos vector
+   // generated at each iteration, ncv <= n
+   // We use the answer to life, the universe and everything, if possible
+   int ncv = 42;
+
+   // ARPACK wants at least twice as many as eigenvalues
+   if( ncv < 2*nev + 1 )
+      ncv = 2*nev + 1;
 
    if( n < ncv )
       ncv = n;
 
-   // v containts the lanczos basis vectors
-   auto ldv = n;
-   std::unique_ptr<double []> v(new double[ldv*ncv]);
+   // v containts the lanczos basis vectors
+   auto ldv = n;
+   std::unique_ptr<double []> v(new double[ldv*ncv]);
+
+   PlaceVectors(v.get(), ncv);
+   PlaceVectors(resid.get(), 1);
+
+   if(helpers::Diagnostics())
+      std::cout << "Lanczos vectors placement: " << helpers::NumaPlacement(v.get(), ldv*ncv*sizeof(double)) << std::endl;
+
+   std::unique_ptr<int []> iparam(new int[11]);
+   iparam[0] = 1;   // Specifies the shift strategy (1->exact)
+   iparam[2] = 3*n; // Maximum number of iterations
+   iparam[6] = 1;   /* Sets the mode of dsaupd.
+                       1 is exact shifting,
+                       2 is user-supplied shifts,
+                       3 is shift-invert mode,
+                       4 is buckling mode,
+                       5 is Cayley mode. */
+
+   std::unique_ptr<int []> ipntr(new int[11]); /* Indicates the locations in the work array workd
+                                                  where the input and output vectors in the
+                                                  callback routine are located. */
+
+   // array used for reverse communication
+   std::unique_ptr<double []> workd(new double[3*n]);
+   PlaceVectors(workd.get(), 3);
+
+   auto lworkl = ncv*(ncv+8); /* Length of the workl array */
+   std::unique_ptr<double []> workl(new double[lworkl]);
+
+   // info = 0: random start vector is used
+   int info = 0; /* Passes convergence information out of the iteration
+                    routine. */
+
+   // info = 1: resid contains the start vector
+   if(start_vector.size() == static_cast<size_t>(n))
+   {
+      ToRowOrder(start_vector.data(), resid.get());
+      info = 1;
+   }
+
+   // rvec == 0 : calculate only eigenvalue
+   // rvec > 0 : calculate eigenvalue and eigenvector
+   int rvec = 0;
+   if(eigvec)
+      rvec = 1;
+
+   // how many eigenvectors to calculate: 'A' => nev eigenvectors
+   char howmny = 'A';
+
+   std::unique_ptr<int []> select;
+   // when howmny == 'A', this is used as workspace to reorder the eigenvectors
+   if( howmny == 'A' )
+      select.reset(new int[ncv]);
+
+   // This vector will return the eigenvalues from the second routine, dseupd.
+   energies.resize(nev);
+
+   if(eigvec)
+      eigv.resize(static_cast<size_t>(n)*nev);
+
+   // not used if iparam[6] == 1
+   double sigma;
+
+   // first iteration
+   dsaupd_(&ido, &bmat, &n, &which[0], &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+
+   while( ido != 99 )
+   {
+      // matrix-vector multiplication
+      mvprod(workd.get()+ipntr[0]-1, workd.get()+ipntr[1]-1);
+
+      dsaupd_(&ido, &bmat, &n, &which[0], &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+   }
+
+   if( info < 0 )
+      std::cerr << "Error with dsaupd, info = " << info << std::endl;
+   else if ( info == 1 )
+      std::cerr << "Maximum number of Lanczos iterations reached." << std::endl;
+   else if ( info == 3 )
+      std::cerr << "No shifts could be applied during implicit Arnoldi update, try increasing NCV." << std::endl;
+
+   dseupd_(&rvec, &howmny, select.get(), energies.data(), eigv.data(), &ldv, &sigma, &bmat, &n, which, &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+
+   if ( info != 0 )
+      std::cerr << "Error with dseupd, info = " << info << std::endl;
+
+   FreeBuffers();
+}
+
+/**
+ * Calculate the nroots lowest eigenvalues and (depending on eigvec) eigenvectors
+ * with the Davidson-Liu method, see Davidson()
+ * @param nroots the number of eigenvalues to calculate
+ * @param energies on return will hold the nroots lowest eigenvalues
+ * @param eigv on return will hold the corresponding eigenvectors, one after the other
+ * @param eigvec if true, calc the eigenvectors and store in eigv
+ */
+void DOCIHamiltonian::Diagonalize_davidson(int nroots, std::vector<double> &energies, std::vector<double> &eigv, bool eigvec) const
+{
+   assert(diag.size() == getdim() && "Build the hamiltonian first!");
+
+   std::vector<double> start, ritz;
+
+   if(start_vector.size() == getdim())
+   {
+      start.resize(getdim());
+      ToRowOrder(start_vector.data(), start.data());
+   }
+
+   // the whole hamiltonian in this process
+   DavidsonOperator op;
+
+   op.dim = getdim();
+   op.n = getdim();
+   op.diag = diag.data();
+   op.part = ThreadPieces(omp_get_max_threads());
+   op.mvprod = [this] (const double *x, double *y, unsigned int nvec) { mvprod(x, y, nvec); };
+   op.reduce = [] (double *, int) {};
+   op.lowest = [this] (std::size_t count) { return LowestElements(diag, count); };
+   op.verbose = true;
+
+   Davidson(op, solver == Solver::MixedDavidson, tolerance, nroots, std::move(start), energies, ritz);
+
+   FreeBuffers();
+
+   if(eigvec)
+      eigv = std::move(ritz);
+}
+
+/**
+ * Internal method: the Davidson-Liu method for the nroots lowest eigenvalues and
+ * eigenvectors (see Davidson_kernel()), for a hamiltonian in this process or spread
+ * over MPI ranks (see DavidsonOperator). In mixed precision, the subspace is first
+ * kept in single precision until the residuals are about as small as float allows,
+ * and the Ritz vectors are then refined with a small double precision subspace.
+ * This halves the memory of the subspace, the bulk of the work space of the eigensolver.
+ * @param op the hamiltonian
+ * @param mixed if true, use single precision for the subspace first
+ * @param tolerance the convergence threshold on the norm of the residuals, 0 means as accurate as possible
+ * @param nroots the number of eigenvalues to calculate
+ * @param start the start vectors, one after the other (can be empty)
+ * @param energies on return will hold the nroots lowest eigenvalues
+ * @param ritz on return will hold the corresponding eigenvectors, one after the other
+ */
+void DOCIHamiltonian::Davidson(const DavidsonOperator &op, bool mixed, double tolerance, int nroots, std::vector<double> start, std::vector<double> &energies, std::vector<double> &ritz)
+{
+   nroots = std::min(static_cast<unsigned long long>(nroots), op.dim);
+
+   // maximum size of the subspace before a restart
+   const int max_space = std::min(op.dim, static_cast<unsigned long long>(std::max(8*nroots, 24)));
+
+   // the convergence threshold on the norm of the residuals
+   const double tol = (tolerance > 0) ? tolerance : 1e-10;
+
+   if(mixed)
+   {
+      // the lowest element of the whole diagonal
+      const auto low = op.lowest(1);
+      double diag_min = (low[0] >= 0) ? op.diag[low[0]] : 0;
+      op.reduce(&diag_min, 1);
+
+      // the residual of a Ritz vector in float can not get much below
+      // the rounding error of H times it
+      const double tol_float = std::max(tol, 1e-5 * std::max(1.0, std::fabs(diag_min)));
+
+      Davidson_kernel<float>(op, nroots, tol_float, max_space, start, energies, ritz);
+
+      if(op.verbose)
+         std::cout << "Davidson: refine in double precision" << std::endl;
+
+      start = std::move(ritz);
+
+      const int refine_space = std::min(op.dim, static_cast<unsigned long long>(std::max(4*nroots, 8)));
+
+      Davidson_kernel<double>(op, nroots, tol, refine_space, start, energies, ritz);
+   }
+   else
+      Davidson_kernel<double>(op, nroots, tol, max_space, start, energies, ritz);
+}
+
+/**
+ * Internal method: the indices of the lowest elements of a diagonal, for the unit
+ * start vectors of the Davidson method
+ * @param diag the diagonal
+ * @param count the number of elements to find, at most diag.size() are returned
+ * @return the indices of the count lowest elements, lowest first
+ */
+std::vector<long long> DOCIHamiltonian::LowestElements(const std::vector<double> &diag, std::size_t count)
+{
+   count = std::min(count, diag.size());
+
+   std::vector<long long> idx(diag.size());
+   std::iota(idx.begin(), idx.end(), 0);
+
+   std::partial_sort(idx.begin(), idx.begin()+count, idx.end(), [&diag](long long a, long long b) { return diag[a] < diag[b]; });
+
+   idx.resize(count);
+
+   return idx;
+}
+
+/**
+ * The subspace vectors v as doubles for the matrix-vector product
+ * @param v the vectors in double precision: used as is
+ * @return v
+ */
+static const double* AsDouble(const double *v, double *, std::size_t)
+{
+   return v;
+}
+
+/**
+ * The subspace vectors v as doubles for the matrix-vector product
+ * @param v the vectors in single precision
+ * @param buf the space for the copy in double precision
+ * @param n the total length of the vectors in v
+ * @return buf, filled with v
+ */
+static const double* AsDouble(const float *v, double *buf, std::size_t n)
+{
+#pragma omp parallel for
+   for(std::size_t i=0;i<n;i++)
+      buf[i] = v[i];
+
+   return buf;
+}
+
+/**
+ * Where to put the matrix-vector product for hv
+ * @param hv the products in double precision: directly in place
+ * @return hv
+ */
+static double* ProductTarget(double *hv, double *)
+{
+   return hv;
+}
+
+/**
+ * Where to put the matrix-vector product for hv
+ * @param buf the space for the product in double precision
+ * @return buf (see StoreProduct())
+ */
+static double* ProductTarget(float *, double *buf)
+{
+   return buf;
+}
+
+/**
+ * Store the product y, calculated in ProductTarget(), in hv: nothing to do in double precision
+ */
+static void StoreProduct(const double *, double *, std::size_t)
+{
+}
+
+/**
+ * Store the product y, calculated in ProductTarget(), in hv
+ * @param y the product in double precision
+ * @param hv the single precision vectors to round y to
+ * @param n the total length of the vectors in y
+ */
+static void StoreProduct(const double *y, float *hv, std::size_t n)
+{
+#pragma omp parallel for
+   for(std::size_t i=0;i<n;i++)
+      hv[i] = y[i];
+}
+
+/**
+ * Internal method: the Davidson-Liu iterations with the subspace vectors of type T.
+ * The DOCI hamiltonian is strongly diagonally dominant, so the diagonal is a good
+ * preconditioner and this needs a lot less matrix-vector products than Lanczos.
+ * The subspace is restarted with the current Ritz vectors when it gets too large.
+ * The matrix-vector product itself, all dot products, the subspace hamiltonian and
+ * the Ritz vectors are always in double precision: only the storage of the
+ * subspace (V and HV) follows T. All vectors are in the row order of the matrix.
+ * Spread over MPI ranks, every rank keeps the own block of all vectors: the dot
+ * products and norms are summed over the ranks, and the small subspace problem is
+ * solved on every rank with the same result.
+ * @param op the hamiltonian (see DavidsonOperator)
+ * @param nroots the number of eigenvalues to calculate
+ * @param tol the convergence threshold on the norm of the residuals
+ * @param max_space the maximum size of the subspace, at least nroots + 1
+ * @param start the start vectors, one after the other (can be empty, the same number in every process)
+ * @param energies on return will hold the nroots lowest eigenvalues
+ * @param ritz on return will hold the corresponding Ritz vectors, one after the other
+ */
+template<typename T>
+void DOCIHamiltonian::Davidson_kernel(const DavidsonOperator &op, int nroots, double tol, int max_space, const std::vector<double> &start, std::vector<double> &energies, std::vector<double> &ritz)
+{
+   const size_t n = op.n;
+   const double *diag = op.diag;
+
+   const int max_iter = 1000;
+
+   // threshold to drop a (normalized) correction vector after orthogonalization
+   const double lindep = std::max(1e-8, 100.0 * std::numeric_limits<T>::epsilon());
+
+   // the subspace vectors and the hamiltonian times the subspace vectors
+   std::vector<T, helpers::default_init_allocator<T>> V(n*max_space);
+   std::vector<T, helpers::default_init_allocator<T>> HV(n*max_space);
+
+   PlaceVectors(V.data(), n, max_space, op.part);
+   PlaceVectors(HV.data(), n, max_space, op.part);
+
+   if(helpers::Diagnostics() && op.verbose)
+      std::cout << "Davidson vectors placement: " << helpers::NumaPlacement(V.data(), V.size()*sizeof(T)) << std::endl;
+
+   const size_t num_start = n ? start.size() / n : 0;
+
+   // the most vectors in one block product: the start, later the corrections
+   const size_t max_block = std::max(static_cast<size_t>(nroots), std::min(num_start, static_cast<size_t>(max_space)));
+
+   // the block product in double precision (only used when T is not double)
+   const auto n_buf = std::is_same<T, double>::value ? 0 : max_block;
+   std::vector<double, helpers::default_init_allocator<double>> x_buf(n*n_buf), y_buf(n*n_buf);
+
+   if(n_buf)
+   {
+      PlaceVectors(x_buf.data(), n, n_buf, op.part);
+      PlaceVectors(y_buf.data(), n, n_buf, op.part);
+   }
+
+   // the subspace hamiltonian, column major with leading dimension max_space
+   std::vector<double> G(max_space*max_space);
+
+   std::vector<double> hritz(n*nroots);
+   std::vector<double> res_norm(nroots);
+   std::vector<double> overlap(max_space);
+
+   ritz.resize(n*nroots);
+
+   auto normalize = [&op,n](T *t) -> double
+   {
+      double norm = 0;
+
+#pragma omp parallel for reduction(+:norm)
+      for(size_t i=0;i<n;i++)
+         norm += static_cast<double>(t[i]) * t[i];
+
+      op.reduce(&norm, 1);
+
+      norm = std::sqrt(norm);
+
+      if(norm > 0)
+      {
+#pragma omp parallel for
+         for(size_t i=0;i<n;i++)
+            t[i] /= norm;
+      }
+
+      return norm;
+   };
+
+   // Gram-Schmidt: orthogonalize the normalized t against the first m subspace
+   // vectors, done twice for stability. Returns the norm that is left of t.
+   auto orthonormalize = [&](T *t, int m) -> double
+   {
+      for(int pass=0;pass<2;pass++)
+      {
+         for(int j=0;j<m;j++)
+         {
+            double dot = 0;
+
+#pragma omp parallel for reduction(+:dot)
+            for(size_t i=0;i<n;i++)
+               dot += static_cast<double>(V[j*n+i]) * t[i];
+
+            overlap[j] = dot;
+         }
+
+         op.reduce(overlap.data(), m);
+
+#pragma omp parallel for
+         for(size_t i=0;i<n;i++)
+         {
+            double tmp = t[i];
+
+            for(int j=0;j<m;j++)
+               tmp -= overlap[j] * V[j*n+i];
+
+            t[i] = tmp;
+         }
+      }
+
+      return normalize(t);
+   };
+
+   // number of vectors in the subspace and the number that already have HV
+   int m = 0;
+   int m_done = 0;
+
+   // start with the start vectors (if any) and fill up with unit vectors
+   // on the lowest diagonal elements
+   for(size_t k=0;k<num_start && m<max_space;k++)
+   {
+      T *t = V.data() + m*n;
+
+      std::copy(start.begin()+k*n, start.begin()+(k+1)*n, t);
+
+      if(normalize(t) > 0 && orthonormalize(t, m) > lindep)
+         m++;
+   }
+
+   {
+      // every start vector can make at most one unit vector linear dependent
+      const size_t num_unit = std::min(op.dim, static_cast<unsigned long long>(nroots)+num_start);
+
+      const auto idx = op.lowest(num_unit);
+
+      for(size_t k=0;k<num_unit && m<nroots;k++)
+      {
+         T *t = V.data() + m*n;
+
+         std::fill(t, t+n, T(0));
+
+         if(idx[k] >= 0)
+            t[idx[k]] = 1;
+
+         if(orthonormalize(t, m) > lindep)
+            m++;
+      }
+   }
+
+   std::vector<double> theta(max_space), s(max_space*max_space);
+   int lwork = 3*max_space - 1;
+   std::vector<double> work(lwork);
+
+   int iter = 0;
+   bool converged = false;
+
+   for(;iter<max_iter;iter++)
+   {
+      // all new vectors in one block product: every matrix element is used for all of them
+      double *y = ProductTarget(HV.data()+m_done*n, y_buf.data());
+
+      op.mvprod(AsDouble(V.data()+m_done*n, x_buf.data(), (m-m_done)*n), y, m-m_done);
+
+      // the subspace hamiltonian from the product before it is rounded to T
+      for(int j=m_done;j<m;j++)
+      {
+         for(int k=0;k<=j;k++)
+         {
+            double dot = 0;
+
+#pragma omp parallel for reduction(+:dot)
+            for(size_t i=0;i<n;i++)
+               dot += V[k*n+i] * y[(j-m_done)*n+i];
+
+            overlap[k] = dot;
+         }
+
+         op.reduce(overlap.data(), j+1);
+
+         for(int k=0;k<=j;k++)
+            G[k+j*max_space] = G[j+k*max_space] = overlap[k];
+      }
+
+      StoreProduct(y, HV.data()+m_done*n, (m-m_done)*n);
 
-   std::unique_ptr<int []> iparam(new int[11]);
-   iparam[0] = 1;   // Specifies the shift strategy (1->exact)
-   iparam[2] = 3*n; // Maximum number of iterations
-   iparam[6] = 1;   /* Sets the mode of dsaupd.
-                       1 is exact shifting,
-                       2 is user-supplied shifts,
-                       3 is shift-invert mode,
-                       4 is buckling mode,
-                       5 is Cayley mode. */
+      m_done = m;
 
-   std::unique_ptr<int []> ipntr(new int[11]); /* Indicates the locations in the work array workd
-                                                  where the input and output vectors in the
-                                                  callback routine are located. */
+      // diagonalize the subspace hamiltonian
+      for(int j=0;j<m;j++)
+         for(int k=0;k<m;k++)
+            s[k+j*m] = G[k+j*max_space];
 
-   // array used for reverse communication
-   std::unique_ptr<double []> workd(new double[3*n]);
-   for(int i=0;i<3*n;i++)
-      workd[i] = 0;
+      char jobz = 'V';
+      char uplo = 'U';
+      int info = 0;
 
-   auto lworkl = ncv*(ncv+8); /* Length of the workl array */
-   std::unique_ptr<double []> workl(new double[lworkl]);
+      dsyev_(&jobz,&uplo,&m,s.data(),&m,theta.data(),work.data(),&lwork,&info);
 
-   // info = 0: random start vector is used
-   int info = 0; /* Passes convergence information out of the iteration
-                    routine. */
+      if(info && op.verbose)
+         std::cerr << "dsyev failed. info = " << info << std::endl;
 
-   // rvec == 0 : calculate only eigenvalue
-   // rvec > 0 : calculate eigenvalue and eigenvector
-   int rvec = 0;
+      // the Ritz vectors and the residuals
+#pragma omp parallel for
+      for(size_t i=0;i<n;i++)
+         for(int l=0;l<nroots;l++)
+         {
+            double x = 0, hx = 0;
 
-   // how many eigenvectors to calculate: 'A' => nev eigenvectors
-   char howmny = 'A';
+            for(int j=0;j<m;j++)
+            {
+               x += V[j*n+i] * s[j+l*m];
+               hx += HV[j*n+i] * s[j+l*m];
+            }
 
-   std::unique_ptr<int []> select;
-   // when howmny == 'A', this is used as workspace to reorder the eigenvectors
-   if( howmny == 'A' )
-      select.reset(new int[ncv]);
+            ritz[l*n+i] = x;
+            hritz[l*n+i] = hx - theta[l] * x;
+         }
 
-   // This vector will return the eigenvalues from the second routine, dseupd.
-   std::vector<double> d(nev);
+      for(int l=0;l<nroots;l++)
+      {
+         double norm = 0;
 
-   // not used if iparam[6] == 1
-   double sigma;
+#pragma omp parallel for reduction(+:norm)
+         for(size_t i=0;i<n;i++)
+            norm += hritz[l*n+i] * hritz[l*n+i];
 
-   // first iteration
-   dsaupd_(&ido, &bmat, &n, &which[0], &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+         res_norm[l] = norm;
+      }
 
-   while( ido != 99 )
+      op.reduce(res_norm.data(), nroots);
+
+      converged = true;
+
+      for(int l=0;l<nroots;l++)
+      {
+         res_norm[l] = std::sqrt(res_norm[l]);
+
+         if(res_norm[l] > tol)
+            converged = false;
+      }
+
+      if(converged)
+         break;
+
+      // restart with the Ritz vectors when there is no room for the corrections
+      if(m + nroots > max_space)
+      {
+         // H times the Ritz vector is the residual plus theta times the Ritz vector
+#pragma omp parallel for
+         for(size_t i=0;i<n;i++)
+            for(int l=0;l<nroots;l++)
+            {
+               V[l*n+i] = ritz[l*n+i];
+               HV[l*n+i] = hritz[l*n+i] + theta[l] * ritz[l*n+i];
+            }
+
+         for(int l=0;l<nroots;l++)
+            for(int k=0;k<nroots;k++)
+               G[k+l*max_space] = (k == l) ? theta[l] : 0;
+
+         m = m_done = nroots;
+      }
+
+      const auto m_old = m;
+
+      // the Davidson correction vectors: (D - theta)^-1 r
+      for(int l=0;l<nroots;l++)
+      {
+         if(res_norm[l] <= tol || m == max_space)
+            continue;
+
+         T *t = V.data() + m*n;
+
+         // the residual is orthogonal to the subspace, but not after rounding HV
+         // to single precision: remove what is left, the preconditioner blows it
+         // up where theta is close to the diagonal (e.g. for a unit start vector)
+         const int m_proj = std::is_same<T, double>::value ? 0 : m;
+
+         for(int j=0;j<m_proj;j++)
+         {
+            double dot = 0;
+
+#pragma omp parallel for reduction(+:dot)
+            for(size_t i=0;i<n;i++)
+               dot += V[j*n+i] * hritz[l*n+i];
+
+            overlap[j] = dot;
+         }
+
+         op.reduce(overlap.data(), m_proj);
+
+#pragma omp parallel for
+         for(size_t i=0;i<n;i++)
+         {
+            auto denom = theta[l] - diag[i];
+
+            if(std::fabs(denom) < 1e-8)
+               denom = std::copysign(1e-8, denom);
+
+            double r = hritz[l*n+i];
+
+            for(int j=0;j<m_proj;j++)
+               r -= overlap[j] * V[j*n+i];
+
+            t[i] = r / denom;
+         }
+
+         if(normalize(t) > 0 && orthonormalize(t, m) > lindep)
+            m++;
+      }
+
+      if(m == m_old)
+      {
+         if(op.verbose)
+            std::cerr << "Davidson: no new directions left in the subspace." << std::endl;
+         break;
+      }
+   }
+
+   if(!converged && op.verbose)
+      std::cerr << "Davidson did not converge in " << iter << " iterations, residual = " << *std::max_element(res_norm.begin(), res_norm.end()) << std::endl;
+
+   energies.assign(theta.begin(), theta.begin()+nroots);
+}
+
+/**
+ * Convert the sparse matrix to a full matrix and use exact diagonalization
+ * to find the eigenvalues and eigenvectors.
+ * @return a pair of a vector with all the eigenvalues (sorted) and a matrix
+ * with the corresponding orthonormal eigenvectors
+ * @throw std::overflow_error when the dimension does not fit in an int
+ */
+std::pair< std::vector<double>,helpers::matrix > DOCIHamiltonian::DiagonalizeFull() const
+{
+   // LAPACK only takes an int as dimension
+   if(getdim() > static_cast<unsigned long long>(std::numeric_limits<int>::max()))
+      throw std::overflow_error("Dimension too large for exact diagonalization, use the Davidson solver (-d or -x)");
+
+   char jobz = 'V';
+   char uplo = 'U';
+   int n = getdim();
+
+   std::unique_ptr<helpers::matrix> fullmat(new helpers::matrix(n, n));
+
+   if(storage == Storage::MatrixFree || storage == Storage::SELL || storage == Storage::OutOfCore)
    {
-      // matrix-vector multiplication
-      mat->mvprod(workd.get()+ipntr[0]-1, workd.get()+ipntr[1]-1);
+      // every column is H times a unit vector
+      std::vector<double> unit(n, 0);
 
-      dsaupd_(&ido, &bmat, &n, &which[0], &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+      for(int j=0;j<n;j++)
+      {
+         unit[j] = 1;
+         mvprod(unit.data(), fullmat->getpointer()+static_cast<size_t>(j)*n);
+         unit[j] = 0;
+      }
+   } else
+      mat->ConvertToMatrix(*fullmat);
+
+   std::vector<double> eigs(n);
+
+   int lwork = 3*n - 1;
+
+   std::unique_ptr<double []> work (new double [lwork]);
+
+   int info = 0;
+
+   dsyev_(&jobz,&uplo,&n,fullmat->getpointer(),&n,eigs.data(),work.get(),&lwork,&info);
+
+   if(info)
+      std::cerr << "dsyev failed. info = " << info << std::endl;
+
+   // the eigenvectors are the columns
+   for(int j=0;j<n;j++)
+      FromRowOrder(fullmat->getpointer()+static_cast<size_t>(j)*n, fullmat->getpointer()+static_cast<size_t>(j)*n);
+
+   return std::make_pair(std::move(eigs), std::move(*fullmat));
+}
+
+/**
+ * Wrapper function for gcc buildin popcount
+ * @param bits the bitset to count the bits from
+ * @return the number of ones in bits
+ */
+unsigned int DOCIHamiltonian::CountBits(mybitset bits)
+{
+   return popcount(bits);
+}
+
+/**
+ * Calculate the sign by counting the number of set bits in a between position i and j
+ * @param i the first position
+ * @param j the second position, i < j
+ * @param a the set of bits to calcalute on
+ * @return the number of bits set between i and j in a
+ */
+int DOCIHamiltonian::CalcSign(unsigned int i,unsigned int j, const mybitset a)
+{
+    assert(i<j && "Order indices correctly!");
+
+    // count the number of set bits between i and j in ket a
+    auto sign = CountBits(( ((mybitset(1)<<j) - 1) ^ ((mybitset(1)<<(i+1)) - 1) ) & a);
+
+    // when uneven, we get a minus sign
+    if( sign & 0x1 )
+        return -1;
+    else
+        return +1;
+}
+
+/**
+ * Save the sparse matrix to a file. Stores only the sparse matrix,
+ * not number of electrons, ...
+ * @param filename the name of the file
+ */
+void DOCIHamiltonian::SaveToFile(std::string filename) const
+{
+   if(storage == Storage::MatrixFree)
+   {
+      std::cerr << "There is no sparse matrix to save in MatrixFree storage" << std::endl;
+      return;
    }
 
-   if( info < 0 )
-      std::cerr << "Error with dsaupd, info = " << info << std::endl;
-   else if ( info == 1 )
-      std::cerr << "Maximum number of Lanczos iterations reached." << std::endl;
-   else if ( info == 3 )
-      std::cerr << "No shifts could be applied during implicit Arnoldi update, try increasing NCV." << std::endl;
+   if(storage == Storage::SELL || storage == Storage::OutOfCore)
+   {
+      std::cerr << "Cannot save a matrix in SELL or OutOfCore storage, use CRS or PairCRS" << std::endl;
+      return;
+   }
+
+   if(!order.empty())
+   {
+      std::cerr << "Cannot save a reordered sparse matrix, build it with the Colex ordering" << std::endl;
+      return;
+   }
 
-   dseupd_(&rvec, &howmny, select.get(), d.data(), 0, &ldv, &sigma, &bmat, &n, which, &nev, &tol, resid.get(), &ncv, v.get(), &ldv, iparam.get(), ipntr.get(), workd.get(), workl.get(), &lworkl, &info);
+   mat->WriteToFile(filename.c_str(), "ham");
+}
 
-   if ( info != 0 )
-      std::cerr << "Error with dseupd, info = " << info << std::endl;
+/**
+ * Read the sparse matrix from a file. Reads only the sparse matrix,
+ * not number of electrons, ...
+ * You still need to construct a object first with a suited Molecule object.
+ * @param filename the name of the file
+ */
+void DOCIHamiltonian::ReadFromFile(std::string filename)
+{
+   mat->ReadFromFile(filename.c_str(), "ham");
+   sell.reset();
+   ooc.reset();
+
+   if(mat->gn() != getdim())
+      throw std::runtime_error("The matrix in " + filename + " does not match the molecule");
+
+   storage = mat->HasPairStorage() ? Storage::PairCRS : Storage::CRS;
+   pattern = mat->IsFull() ? Pattern::Full : Pattern::Upper;
+
+   // we only save matrices in colex order
+   ordering = Ordering::Colex;
+   order.clear();
+   position.clear();
+
+   diag.resize(getdim());
+
+   // the diagonal is the first element of every row
+#pragma omp parallel for
+   for(unsigned long long i=0;i<getdim();i++)
+      diag[i] = (*mat)(i,i);
+}
+
+/**
+ * Internal method: the name of the cache file of the hamiltonian (see ReadFromCache()).
+ * The name holds a hash of everything the stored matrix depends on: the integrals in
+ * the integral cache of the molecule (J, K, P and the diagonal of T), the number of
+ * orbitals and electrons, and the storage, pattern and ordering.
+ * @param dir the directory of the cache
+ * @return the name of the file
+ */
+std::string DOCIHamiltonian::CacheFile(std::string dir) const
+{
+   const auto L = molecule->get_n_sp();
+
+   const unsigned long long key[] = {L, molecule->get_n_electrons(), static_cast<unsigned long long>(storage),
+      static_cast<unsigned long long>(pattern), static_cast<unsigned long long>(ordering), sizeof(crs_col_t)};
+
+   auto hash = helpers::HashBytes(key, sizeof(key));
+   hash = helpers::HashBytes(molecule->getJ(), L*L*sizeof(double), hash);
+   hash = helpers::HashBytes(molecule->getK(), L*L*sizeof(double), hash);
+   hash = helpers::HashBytes(molecule->getP(), L*L*sizeof(double), hash);
+   hash = helpers::HashBytes(molecule->getTdiag(), L*sizeof(double), hash);
+
+   std::stringstream name;
+   name << dir << "/doci-ham-" << std::hex << std::setw(16) << std::setfill('0') << hash << ".crs";
+
+   return name.str();
+}
+
+/**
+ * Use the hamiltonian from the cache in dir instead of building it, if it is there (see
+ * SaveToCache()). The file is found by a hash of the integrals and the settings (see
+ * CacheFile()), so a file can only be used for exactly the same hamiltonian. It is mapped
+ * in memory, not read (see helpers::SparseMatrix_CRS::MapBinaryFile()): this takes no
+ * time, the pages are read on first use or are already in the page cache from the
+ * previous run. Only CRS and PairCRS storage can be cached. The mapped matrix is read
+ * only, UpdateValues() does a full Build(). Before it is used, the file has to have the
+ * expected number of elements, every row its diagonal and the ordering has to be a
+ * permutation: a damaged or foreign file is ignored.
+ * @param dir the directory of the cache
+ * @return true if the hamiltonian was found in the cache, false if it still has to be built
+ */
+bool DOCIHamiltonian::ReadFromCache(std::string dir)
+{
+   if(storage != Storage::CRS && storage != Storage::PairCRS)
+   {
+      std::cerr << "Only CRS and PairCRS storage can be cached" << std::endl;
+      return false;
+   }
+
+   molecule->BuildIntegralCache();
+
+   const auto filename = CacheFile(dir);
+
+   // no file is not an error: the hamiltonian is not in the cache yet
+   if(access(filename.c_str(), R_OK) != 0)
+      return false;
+
+   std::vector<crs_col_t> new_order;
+
+   if(ordering == Ordering::RCM)
+   {
+      std::ifstream file(filename + ".order", std::ios::binary);
+
+      new_order.resize(getdim());
+
+      if(!file.read(reinterpret_cast<char *>(new_order.data()), getdim() * sizeof(crs_col_t)))
+      {
+         std::cerr << "Could not read the ordering of " << filename << ", building the hamiltonian" << std::endl;
+         return false;
+      }
+   }
+
+   std::unique_ptr<helpers::SparseMatrix_CRS> mapped(new helpers::SparseMatrix_CRS(getdim()));
+
+   if(mapped->MapBinaryFile(filename.c_str()))
+      return false;
+
+   const auto L = molecule->get_n_sp();
+   const auto n_pairs = molecule->get_n_electrons()/2;
+   const auto nnz = (pattern == Pattern::Full) ? 2 * CountNonZero(L, n_pairs) - getdim() : CountNonZero(L, n_pairs);
+
+   // every row starts with its diagonal (one column index per row)
+   unsigned long long bad_rows = 0;
+
+#pragma omp parallel for reduction(+:bad_rows)
+   for(unsigned long long i=0;i<mapped->gn();i++)
+      bad_rows += (mapped->NumOfElInRow(i) == 0 || mapped->GetElementColIndexInRow(i, 0) != i);
+
+   if(mapped->gn() != getdim() || mapped->IsFull() != (pattern == Pattern::Full) || mapped->HasPairStorage() != (storage == Storage::PairCRS) || mapped->NumOfEl() != nnz || bad_rows > 0)
+   {
+      std::cerr << filename << " does not match the hamiltonian, building it" << std::endl;
+      return false;
+   }
+
+   // the ordering has to be a permutation of the rows
+   std::vector<crs_col_t> new_position(new_order.size(), getdim());
+
+   for(unsigned long long i=0;i<new_order.size();i++)
+   {
+      if(new_order[i] >= getdim() || new_position[new_order[i]] != getdim())
+      {
+         std::cerr << "The ordering of " << filename << " is not a permutation, building the hamiltonian" << std::endl;
+         return false;
+      }
+
+      new_position[new_order[i]] = i;
+   }
+
+   mat = std::move(mapped);
+   sell.reset();
+   ooc.reset();
+
+   order = std::move(new_order);
+   position = std::move(new_position);
+
+   diag.resize(getdim());
+
+   // the diagonal is the first element of every row
+#pragma omp parallel for
+   for(unsigned long long i=0;i<getdim();i++)
+      diag[i] = mat->GetElementInRow(i, 0);
+
+   std::cout << "Mapped the hamiltonian from " << filename << std::endl;
+
+   return true;
+}
+
+/**
+ * Store the hamiltonian in the cache in dir, for ReadFromCache() in a later run
+ * with the same integrals. The sparse matrix is written as a flat binary file (see
+ * helpers::SparseMatrix_CRS::WriteToBinaryFile()) and, after a reordering, the order
+ * of the rows in a second file. The files are first written under a temporary name
+ * and then renamed, so other runs never see a half written file. Does nothing for
+ * other storage than CRS and PairCRS or a hamiltonian that comes from the cache.
+ * @param dir the directory of the cache
+ */
+void DOCIHamiltonian::SaveToCache(std::string dir) const
+{
+   if((storage != Storage::CRS && storage != Storage::PairCRS) || mat->IsMapped())
+      return;
+
+   const auto filename = CacheFile(dir);
+
+   std::stringstream tmp;
+   tmp << filename << ".tmp-" << getpid();
+
+   bool ok = true;
+
+   // the ordering first: if the matrix is there, so is its ordering
+   if(!order.empty())
+   {
+      std::ofstream file(tmp.str(), std::ios::binary);
+
+      ok = ok && file.write(reinterpret_cast<const char *>(order.data()), order.size() * sizeof(crs_col_t));
+      file.close();
+
+      ok = ok && std::rename(tmp.str().c_str(), (filename + ".order").c_str()) == 0;
+   }
+
+   ok = ok && mat->WriteToBinaryFile(tmp.str().c_str()) == 0;
+   ok = ok && std::rename(tmp.str().c_str(), filename.c_str()) == 0;
+
+   if(!ok)
+   {
+      std::cerr << "Could not save the hamiltonian in " << filename << std::endl;
+      std::remove(tmp.str().c_str());
+      return;
+   }
+
+   std::cout << "Saved the hamiltonian in " << filename << std::endl;
+}
+
+/**
+ * Calculate the number lowest energy levels
+ * @param number the number of energy levels to calculate
+ * @return list of the energies
+ */
+std::vector<double> DOCIHamiltonian::CalcEnergy(int number) const
+{
+   std::vector<double> energies, eigv;
+
+   if(solver != Solver::Arpack)
+      Diagonalize_davidson(number,energies,eigv,false);
+   else
+      Diagonalize_arpack(number,energies,eigv,false);
 
-   return d;
+   return energies;
 }
 
 /* vim: set ts=3 sw=3 expandtab :*/
@@ -0,0 +1,520 @@
+#ifdef MPI
+
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <omp.h>
+#include <assert.h>
+
+#include "DistributedHamiltonian.h"
+#include "DOCIHamtilonian.h"
+#include "PairExcitations.h"
+
+using namespace doci;
+
+/**
+ * Constructor: split the basis in equal blocks of rows over the ranks in comm.
+ * Every row has the same number of elements, so this is balanced. All ranks
+ * in comm have to call this (and all other public methods) together.
+ * @param mol the Molecule to use
+ * @param comm the communicator to spread the hamiltonian over
+ */
+DistributedHamiltonian::DistributedHamiltonian(const Molecule &mol, MPI_Comm comm)
+{
+   this->comm = comm;
+
+   MPI_Comm_rank(comm, &rank);
+   MPI_Comm_size(comm, &size);
+
+   molecule.reset(mol.clone());
+
+   if(molecule->get_n_electrons() % 2 != 0)
+      throw("We need even number of electrons!");
+
+   dim = Permutation::CalcCombinations(molecule->get_n_sp(), molecule->get_n_electrons()/2);
+
+   part.resize(size+1);
+
+   for(int r=0;r<=size;r++)
+      part[r] = (dim*r)/size;
+
+   if(RowEnd() - RowStart() > std::numeric_limits<crs_col_t>::max())
+      throw std::overflow_error("Block of rows too large for the sparse matrix, use more ranks or compile with CRS_64BIT_COL");
+
+   mat.reset(new helpers::SparseMatrix_CRS(RowEnd() - RowStart()));
+
+   tolerance = 0;
+   solver = DOCIHamiltonian::Solver::Davidson;
+}
+
+/**
+ * @return the dimension of the whole hamiltonian
+ */
+unsigned long long DistributedHamiltonian::getdim() const
+{
+   return dim;
+}
+
+/**
+ * @return the first row of this rank
+ */
+unsigned long long DistributedHamiltonian::RowStart() const
+{
+   return part[rank];
+}
+
+/**
+ * @return one past the last row of this rank
+ */
+unsigned long long DistributedHamiltonian::RowEnd() const
+{
+   return part[rank+1];
+}
+
+/**
+ * Build the own rows of the hamiltonian. This takes two passes over the rows:
+ * the first one collects the halo (see SetupHalo()), the second one fills in
+ * the matrix with the local column numbers.
+ */
+void DistributedHamiltonian::Build()
+{
+   molecule->BuildIntegralCache();
+
+   const auto L = molecule->get_n_sp();
+   const auto n_pairs = molecule->get_n_electrons()/2;
+   const crs_col_t n = RowEnd() - RowStart();
+
+   // every row has the diagonal and a pair excitation from every occupied to every empty orbital
+   const crs_row_t row_len = 1 + n_pairs*(L-n_pairs);
+
+   std::vector<crs_row_t> row_ptr(n+1);
+
+   for(crs_col_t i=0;i<=n;i++)
+      row_ptr[i] = i * row_len;
+
+   mat->Allocate(std::move(row_ptr), true, true);
+   diag.resize(n);
+
+   std::vector<unsigned long long> remote;
+
+   DISPATCH_PAIRS(n_pairs, Build_iter, remote, false);
+
+   SetupHalo(std::move(remote));
+
+   DISPATCH_PAIRS(n_pairs, Build_iter, remote, true);
+
+   mat->SetPairTable(DOCIHamiltonian::CalcPairTable(*molecule));
+
+   unsigned long long halo_max = halo.size();
+   MPI_Allreduce(MPI_IN_PLACE, &halo_max, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+
+   unsigned long long mem_max = MemoryUsage();
+   MPI_Allreduce(MPI_IN_PLACE, &mem_max, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+
+   if(rank == 0)
+   {
+      std::cout << "Distributed over " << size << " ranks with " << omp_get_max_threads() << " threads each, " << n << " rows on rank 0" << std::endl;
+      std::cout << "Largest halo: " << halo_max << " elements (" << 100.0 * halo_max / dim << "% of the vector)" << std::endl;
+      std::cout << "Largest memory of a rank: " << mem_max / (1024.0*1024.0*1024.0) << " GB" << std::endl;
+   }
+}
+
+/**
+ * Internal method: go over the own rows. NP is the number of pairs if known at
+ * compile time, 0 otherwise (see DISPATCH_PAIRS).
+ * @param remote if fill is false: on return holds the sorted global indices of all
+ * columns on other ranks
+ * @param fill if true, fill in the rows of the matrix (SetupHalo() must be done)
+ */
+template<unsigned int NP>
+void DistributedHamiltonian::Build_iter(std::vector<unsigned long long> &remote, bool fill)
+{
+   const auto L = molecule->get_n_sp();
+   const auto n_pairs = molecule->get_n_electrons()/2;
+   const auto start = RowStart();
+   const auto end = RowEnd();
+   const crs_col_t n = end - start;
+
+   remote.clear();
+
+   // sort the list of remote columns and drop the doubles
+   auto compact = [] (std::vector<unsigned long long> &list) {
+      std::sort(list.begin(), list.end());
+      list.erase(std::unique(list.begin(), list.end()), list.end());
+   };
+
+#pragma omp parallel
+   {
+      const auto num_t = omp_get_num_threads();
+      const auto me = omp_get_thread_num();
+
+      const crs_col_t i_start = (static_cast<unsigned long long>(n)*me)/num_t;
+      const crs_col_t i_end = (static_cast<unsigned long long>(n)*(me+1))/num_t;
+
+      Permutation my_perm(n_pairs);
+      PairExcitations<NP> exc(n_pairs, L);
+
+      if(i_start < i_end)
+         my_perm.unrank(start + i_start);
+
+      std::vector<unsigned long long> my_remote;
+      std::size_t compacted = 0;
+
+      // (local column, pair index) of the off-diagonal elements of a row
+      std::vector< std::pair<crs_col_t, unsigned short> > row_elems;
+
+      for(crs_col_t i=i_start;i<i_end;i++)
+      {
+         const auto bra = my_perm.get();
+
+         exc.set(bra);
+
+         if(!fill)
+         {
+            exc.all([&my_remote,start,end] (unsigned int, unsigned int, unsigned long long j) {
+                  if(j < start || j >= end)
+                     my_remote.push_back(j);
+                  });
+
+            // keep the list from growing much larger than the halo
+            if(my_remote.size() > 2*compacted + (1<<20))
+            {
+               compact(my_remote);
+               compacted = my_remote.size();
+            }
+         }
+         else
+         {
+            diag[i] = DOCIHamiltonian::CalcDiagonal(bra, *molecule);
+
+            mat->FillElementInRow(i, 0, i, diag[i]);
+
+            row_elems.clear();
+
+            exc.all([this,&row_elems,start,end,n,L] (unsigned int r, unsigned int s, unsigned long long j) {
+                  crs_col_t k;
+
+                  if(j >= start && j < end)
+                     k = j - start;
+                  else
+                     k = n + (std::lower_bound(halo.begin(), halo.end(), j) - halo.begin());
+
+                  row_elems.push_back(std::make_pair(k, r*L+s));
+                  });
+
+            std::sort(row_elems.begin(), row_elems.end());
+
+            for(std::size_t k=0;k<row_elems.size();k++)
+               mat->FillPairInRow(i, k+1, row_elems[k].first, row_elems[k].second);
+         }
+
+         my_perm.next();
+      }
+
+      if(!fill)
+      {
+         compact(my_remote);
+
+#pragma omp critical
+         {
+            remote.insert(remote.end(), my_remote.begin(), my_remote.end());
+            compact(remote);
+         }
+      }
+   }
+}
+
+/**
+ * Internal method: set up the exchange of the halo. Every rank tells the others
+ * which of their entries it needs, so in mvprod() every rank knows what to send.
+ * @param remote the sorted global indices of the columns on other ranks
+ */
+void DistributedHamiltonian::SetupHalo(std::vector<unsigned long long> remote)
+{
+   halo = std::move(remote);
+
+   if(halo.size() > static_cast<std::size_t>(std::numeric_limits<int>::max()) || RowEnd() - RowStart() + halo.size() > std::numeric_limits<crs_col_t>::max())
+      throw std::overflow_error("Halo too large, use more ranks");
+
+   recv_count.assign(size, 0);
+   recv_displ.assign(size, 0);
+
+   for(int r=0;r<size;r++)
+   {
+      const auto begin = std::lower_bound(halo.begin(), halo.end(), part[r]);
+      const auto end = std::lower_bound(halo.begin(), halo.end(), part[r+1]);
+
+      recv_count[r] = end - begin;
+      recv_displ[r] = begin - halo.begin();
+   }
+
+   send_count.assign(size, 0);
+   send_displ.assign(size, 0);
+
+   MPI_Alltoall(recv_count.data(), 1, MPI_INT, send_count.data(), 1, MPI_INT, comm);
+
+   for(int r=1;r<size;r++)
+      send_displ[r] = send_displ[r-1] + send_count[r-1];
+
+   std::vector<unsigned long long> wanted(send_displ.back() + send_count.back());
+
+   MPI_Alltoallv(halo.data(), recv_count.data(), recv_displ.data(), MPI_UNSIGNED_LONG_LONG, wanted.data(), send_count.data(), send_displ.data(), MPI_UNSIGNED_LONG_LONG, comm);
+
+   send_index.resize(wanted.size());
+
+   for(std::size_t k=0;k<wanted.size();k++)
+   {
+      assert(wanted[k] >= RowStart() && wanted[k] < RowEnd());
+      send_index[k] = wanted[k] - RowStart();
+   }
+
+   send_buffer.resize(send_index.size());
+   x_ext.resize(RowEnd() - RowStart() + halo.size());
+}
+
+/**
+ * Internal method: y = H*x for the own blocks of nvec vectors: exchange the halo and
+ * multiply with the own rows. The vectors go in blocks of at most
+ * SparseMatrix_CRS::max_block, interleaved (see SparseMatrix_CRS::mvprod_block()),
+ * so a block takes one exchange and one pass over the matrix.
+ * @param x the own blocks of the vectors to multiply with, one after the other
+ * @param y on return will hold the own blocks of H times every vector
+ * @param nvec the number of vectors
+ */
+void DistributedHamiltonian::mvprod(const double *x, double *y, unsigned int nvec) const
+{
+   const std::size_t n = RowEnd() - RowStart();
+
+   const auto max_block = helpers::SparseMatrix_CRS::max_block;
+   const auto block = std::min(nvec, max_block);
+
+   if(x_ext.size() < (n + halo.size())*block)
+      x_ext.resize((n + halo.size())*block);
+
+   if(send_buffer.size() < send_index.size()*block)
+      send_buffer.resize(send_index.size()*block);
+
+   if(block > 1 && block_buffer.size() < n*block)
+      block_buffer.resize(n*block);
+
+   for(unsigned int start=0;start<nvec;start+=max_block)
+   {
+      const auto nb = std::min(max_block, nvec-start);
+
+#pragma omp parallel for
+      for(std::size_t k=0;k<send_index.size();k++)
+         for(unsigned int v=0;v<nb;v++)
+            send_buffer[k*nb+v] = x[(start+v)*n+send_index[k]];
+
+      // an entry of the halo is nb consecutive doubles
+      MPI_Datatype entry;
+      MPI_Type_contiguous(nb, MPI_DOUBLE, &entry);
+      MPI_Type_commit(&entry);
+
+      MPI_Alltoallv(send_buffer.data(), send_count.data(), send_displ.data(), entry, x_ext.data()+n*nb, recv_count.data(), recv_displ.data(), entry, comm);
+
+      MPI_Type_free(&entry);
+
+      if(nb == 1)
+      {
+         std::copy(x+start*n, x+(start+1)*n, x_ext.begin());
+         mat->mvprod(x_ext.data(), y+start*n);
+         continue;
+      }
+
+#pragma omp parallel for
+      for(std::size_t i=0;i<n;i++)
+         for(unsigned int v=0;v<nb;v++)
+            x_ext[i*nb+v] = x[(start+v)*n+i];
+
+      mat->mvprod_block(x_ext.data(), block_buffer.data(), nb);
+
+#pragma omp parallel for
+      for(std::size_t i=0;i<n;i++)
+         for(unsigned int v=0;v<nb;v++)
+            y[(start+v)*n+i] = block_buffer[i*nb+v];
+   }
+}
+
+/**
+ * Internal method: sum an array over all ranks
+ * @param v the array, on return holds the sum over all ranks
+ * @param count the number of elements in v
+ */
+void DistributedHamiltonian::Allreduce(double *v, int count) const
+{
+   MPI_Allreduce(MPI_IN_PLACE, v, count, MPI_DOUBLE, MPI_SUM, comm);
+}
+
+/**
+ * Internal method: find the lowest elements of the whole diagonal, for the unit start
+ * vectors of the Davidson method. Every rank shares its own lowest elements, so all
+ * ranks pick the same ones (on a tie, the one of the lowest rank).
+ * @param count the number of elements to find, at most getdim()
+ * @return for the count lowest elements (lowest first), the index in the own rows,
+ * or -1 if it is on another rank
+ */
+std::vector<long long> DistributedHamiltonian::LowestDiagonal(std::size_t count) const
+{
+   const auto own = DOCIHamiltonian::LowestElements(diag, count);
+
+   // a rank with fewer rows fills up with elements that are never picked
+   std::vector<double> values(count, std::numeric_limits<double>::max());
+
+   for(std::size_t k=0;k<own.size();k++)
+      values[k] = diag[own[k]];
+
+   std::vector<double> all(count*size);
+
+   MPI_Allgather(values.data(), count, MPI_DOUBLE, all.data(), count, MPI_DOUBLE, comm);
+
+   // the element k of rank r is r*count+k
+   std::vector<std::size_t> order(all.size());
+   std::iota(order.begin(), order.end(), 0);
+
+   std::partial_sort(order.begin(), order.begin()+count, order.end(), [&all](std::size_t a, std::size_t b) { return all[a] < all[b] || (all[a] == all[b] && a < b); });
+
+   std::vector<long long> lowest(count, -1);
+
+   for(std::size_t k=0;k<count;k++)
+      if(order[k] / count == static_cast<std::size_t>(rank))
+         lowest[k] = own[order[k] % count];
+
+   return lowest;
+}
+
+/**
+ * Set the convergence tolerance of the eigensolver: the norm of the residual.
+ * 0 means as accurate as possible.
+ * @param tol the new tolerance
+ */
+void DistributedHamiltonian::SetTolerance(double tol)
+{
+   tolerance = tol;
+}
+
+/**
+ * Set the eigensolver: Davidson or MixedDavidson (see DOCIHamiltonian::SetSolver()).
+ * ARPACK does not work on a distributed vector, Davidson is used instead.
+ * @param type the eigensolver to use
+ */
+void DistributedHamiltonian::SetSolver(DOCIHamiltonian::Solver type)
+{
+   solver = (type == DOCIHamiltonian::Solver::MixedDavidson) ? type : DOCIHamiltonian::Solver::Davidson;
+}
+
+/**
+ * @return the eigensolver that is used
+ */
+DOCIHamiltonian::Solver DistributedHamiltonian::GetSolver() const
+{
+   return solver;
+}
+
+/**
+ * Calculate the lowest eigenvalue and eigenvector with a distributed Davidson-Liu
+ * @return a pair of the lowest eigenvalue and the own block (RowStart() to RowEnd())
+ * of the normalized eigenvector
+ */
+std::pair< double,std::vector<double> > DistributedHamiltonian::Diagonalize() const
+{
+   std::vector<double> energies, eigv;
+
+   Diagonalize_davidson(1, energies, eigv, true);
+
+   return std::make_pair(energies[0], std::move(eigv));
+}
+
+/**
+ * Calculate the number lowest eigenvalues and eigenvectors with a distributed Davidson-Liu
+ * @param number the number of states to calculate
+ * @return a pair of the eigenvalues (lowest first) and the own blocks (RowStart()
+ * to RowEnd()) of the corresponding normalized eigenvectors, one after the other
+ */
+std::pair< std::vector<double>,std::vector<double> > DistributedHamiltonian::Diagonalize(int number) const
+{
+   std::vector<double> energies, eigv;
+
+   Diagonalize_davidson(number, energies, eigv, true);
+
+   return std::make_pair(std::move(energies), std::move(eigv));
+}
+
+/**
+ * Calculate the lowest eigenvalue with a distributed Davidson-Liu
+ * @return the lowest eigenvalue
+ */
+double DistributedHamiltonian::CalcEnergy() const
+{
+   return CalcEnergy(1)[0];
+}
+
+/**
+ * Calculate the number lowest eigenvalues with a distributed Davidson-Liu
+ * @param number the number of energy levels to calculate
+ * @return list of the energies
+ */
+std::vector<double> DistributedHamiltonian::CalcEnergy(int number) const
+{
+   std::vector<double> energies, eigv;
+
+   Diagonalize_davidson(number, energies, eigv, false);
+
+   return energies;
+}
+
+/**
+ * @return the memory (in bytes) of the hamiltonian and the halo on this rank
+ */
+std::size_t DistributedHamiltonian::MemoryUsage() const
+{
+   const std::size_t n = RowEnd() - RowStart();
+
+   std::size_t bytes = mat->NumOfEl() * (sizeof(crs_col_t) + sizeof(unsigned short));
+   bytes += (n + 1) * sizeof(crs_row_t) + 2 * n * sizeof(double);
+   bytes += halo.size() * (sizeof(unsigned long long) + sizeof(double));
+   bytes += send_index.size() * (sizeof(crs_col_t) + sizeof(double)) + n * sizeof(double);
+
+   return bytes;
+}
+
+/**
+ * Internal method: the nroots lowest eigenvalues and (depending on eigvec) eigenvectors
+ * with the Davidson method of DOCIHamiltonian (see DOCIHamiltonian::Davidson()) on the
+ * own blocks of the vectors. The dot products and norms are summed over all ranks.
+ * Only rank 0 prints.
+ * @param nroots the number of eigenvalues to calculate
+ * @param energies on return will hold the nroots lowest eigenvalues
+ * @param eigv on return will hold the own blocks of the eigenvectors, one after the other
+ * @param eigvec if true, store the eigenvectors in eigv
+ */
+void DistributedHamiltonian::Diagonalize_davidson(int nroots, std::vector<double> &energies, std::vector<double> &eigv, bool eigvec) const
+{
+   assert(diag.size() == RowEnd() - RowStart() && "Build the hamiltonian first!");
+
+   // the pieces of the threads in the product, see SparseMatrix_CRS::mvprod()
+   const auto part = mat->RowPartition(omp_get_max_threads());
+
+   DOCIHamiltonian::DavidsonOperator op;
+
+   op.dim = dim;
+   op.n = RowEnd() - RowStart();
+   op.diag = diag.data();
+   op.part.assign(part.begin(), part.end());
+   op.mvprod = [this] (const double *x, double *y, unsigned int nvec) { mvprod(x, y, nvec); };
+   op.reduce = [this] (double *v, int count) { Allreduce(v, count); };
+   op.lowest = [this] (std::size_t count) { return LowestDiagonal(count); };
+   op.verbose = (rank == 0);
+
+   std::vector<double> ritz;
+
+   DOCIHamiltonian::Davidson(op, solver == DOCIHamiltonian::Solver::MixedDavidson, tolerance, nroots, std::vector<double>(), energies, ritz);
+
+   if(eigvec)
+      eigv = std::move(ritz);
+}
+
+#endif /* MPI */
+
+/* vim: set ts=3 sw=3 expandtab :*/
@@ -127,6 +127,9 @@ void doci::LocalMinimizer::calc_energy()
    end = std::chrono::high_resolution_clock::now();
 
    std::cout << "Building 2DM took: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
+
+   // a rotation barely changes the ground state: use it as start for the next solve
+   method->SetStartVector(std::move(eig.second));
 }
 
 /**
@@ -141,10 +144,10 @@ double doci::LocalMinimizer::calc_new_energy()
    orbtrans->fillHamCI(mol->getHamObject());
 
    auto start = std::chrono::high_resolution_clock::now();
-   method->Build();
+   method->UpdateValues(*mol);
    auto end = std::chrono::high_resolution_clock::now();
 
-   std::cout << "Building took: " << std::fixed << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
+   std::cout << "Updating took: " << std::fixed << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
 
    start = std::chrono::high_resolution_clock::now();
    auto eig = method->Diagonalize();
@@ -160,6 +163,9 @@ double doci::LocalMinimizer::calc_new_energy()
 
    std::cout << "Building 2DM took: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
 
+   // a rotation barely changes the ground state: use it as start for the next solve
+   method->SetStartVector(std::move(eig.second));
+
    return eig.first;
 }
 
@@ -171,10 +177,10 @@ double doci::LocalMinimizer::calc_new_energy(const doci::Sym_Molecule &new_ham)
    mol->getHamObject() = new_ham.getHamObject();
 
    auto start = std::chrono::high_resolution_clock::now();
-   method->Build();
+   method->UpdateValues(*mol);
    auto end = std::chrono::high_resolution_clock::now();
 
-   std::cout << "Building took: " << std::fixed << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
+   std::cout << "Updating took: " << std::fixed << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
 
    start = std::chrono::high_resolution_clock::now();
    auto eig = method->Diagonalize();
@@ -190,6 +196,9 @@ double doci::LocalMinimizer::calc_new_energy(const doci::Sym_Molecule &new_ham)
 
    std::cout << "Building 2DM took: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << std::endl;
 
+   // a rotation barely changes the ground state: use it as start for the next solve
+   method->SetStartVector(std::move(eig.second));
+
    return eig.first;
 }
 
@@ -219,8 +228,9 @@ std::vector< std::tuple<int,int,double,double> > doci::LocalMinimizer::scan_orbi
    assert(mol && "Shit, NULL pointer");
 
    const auto& ham2 = mol->getHamObject();
-   std::function<double(int,int)> getT = [&ham2] (int a, int b) -> double { return ham2.getTmat(a,b); };
-   std::function<double(int,int,int,int)> getV = [&ham2]  (int a, int b, int c, int d) -> double { return ham2.getVmat(a,b,c,d); };
+
+   // the integrals could have changed since the last build
+   mol->BuildIntegralCache();
 
    std::vector< std::tuple<int,int,double,double> > pos_rotations;
    // worst case: c1 symmetry
@@ -233,11 +243,11 @@ std::vector< std::tuple<int,int,double,double> > doci::LocalMinimizer::scan_orbi
             if(!allow_irreps.empty() && std::find(allow_irreps.begin(), allow_irreps.end(), ham2.getOrbitalIrrep(k_in)) == allow_irreps.end() )
                continue;
 
-            auto found = rdm->find_min_angle(k_in,l_in,0.3,getT,getV);
+            auto found = rdm->find_min_angle(k_in,l_in,0.3,*mol);
 
             if(!found.second)
                // we hit a maximum
-               found = rdm->find_min_angle(k_in,l_in,0.01,getT,getV);
+               found = rdm->find_min_angle(k_in,l_in,0.01,*mol);
 
             if(!found.second)
                // we're still stuck in a maximum, skip this!
@@ -247,7 +257,7 @@ std::vector< std::tuple<int,int,double,double> > doci::LocalMinimizer::scan_orbi
             if(fabs(found.first)>M_PI/2.0)
                continue;
 
-            double new_en = rdm->calc_rotate(k_in,l_in,found.first,getT,getV);
+            double new_en = rdm->calc_rotate(k_in,l_in,found.first,*mol);
 
             assert(found.second && "Shit, maximum!");
 
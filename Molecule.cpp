@@ -34,6 +34,88 @@ unsigned int Molecule::get_n_electrons() const
    return n_electrons;
 }
 
+/**
+ * Fill the cache with the integrals that DOCI needs: the L x L matrices
+ * J(r,s) = <rs|V|rs>, K(r,s) = <rs|V|sr> and P(r,s) = <rr|V|ss> and the
+ * diagonal of T. Every block starts on a cache line, the hot loops read
+ * them directly instead of calling getV() for every element.
+ * Call this again when the integrals change (e.g. after an orbital rotation).
+ */
+void Molecule::BuildIntegralCache()
+{
+   const auto L = get_n_sp();
+   const auto stride = CacheStride(L);
+
+   int_cache.assign(3*stride + L, 0);
+
+   auto *J = int_cache.data();
+   auto *K = J + stride;
+   auto *P = K + stride;
+   auto *T = P + stride;
+
+   for(unsigned int r=0;r<L;r++)
+   {
+      for(unsigned int s=0;s<L;s++)
+      {
+         J[r*L+s] = getV(r, s, r, s);
+         K[r*L+s] = getV(r, s, s, r);
+         P[r*L+s] = getV(r, r, s, s);
+      }
+
+      T[r] = getT(r, r);
+   }
+}
+
+/**
+ * @return the L x L matrix J(r,s) = <rs|V|rs> at r*L+s, see BuildIntegralCache()
+ */
+const double* Molecule::getJ() const
+{
+   assert(!int_cache.empty() && "Call BuildIntegralCache() first");
+
+   return int_cache.data();
+}
+
+/**
+ * @return the L x L matrix K(r,s) = <rs|V|sr> at r*L+s, see BuildIntegralCache()
+ */
+const double* Molecule::getK() const
+{
+   assert(!int_cache.empty() && "Call BuildIntegralCache() first");
+
+   return int_cache.data() + CacheStride(get_n_sp());
+}
+
+/**
+ * @return the L x L matrix P(r,s) = <rr|V|ss> at r*L+s, see BuildIntegralCache()
+ */
+const double* Molecule::getP() const
+{
+   assert(!int_cache.empty() && "Call BuildIntegralCache() first");
+
+   return int_cache.data() + 2*CacheStride(get_n_sp());
+}
+
+/**
+ * @return the diagonal of T, see BuildIntegralCache()
+ */
+const double* Molecule::getTdiag() const
+{
+   assert(!int_cache.empty() && "Call BuildIntegralCache() first");
+
+   return int_cache.data() + 3*CacheStride(get_n_sp());
+}
+
+/**
+ * @param L the number of orbitals
+ * @return the size of a L x L block in the integral cache, rounded up to a full cache line
+ */
+std::size_t Molecule::CacheStride(unsigned int L)
+{
+   // 8 doubles in a cache line
+   return (static_cast<std::size_t>(L)*L + 7) & ~static_cast<std::size_t>(7);
+}
+
 
 
 /**
@@ -121,7 +203,7 @@ PSI_C1_Molecule::PSI_C1_Molecule(std::string filename)
 /**
  * Copy constructor
  */
-PSI_C1_Molecule::PSI_C1_Molecule(const PSI_C1_Molecule &orig)
+PSI_C1_Molecule::PSI_C1_Molecule(const PSI_C1_Molecule &orig) : Molecule(orig)
 {
    OEI.reset(new helpers::matrix(*orig.OEI));
    TEI.reset(new helpers::matrix(*orig.TEI));
@@ -134,7 +216,7 @@ PSI_C1_Molecule::PSI_C1_Molecule(const PSI_C1_Molecule &orig)
 /**
  * Move constructor
  */
-PSI_C1_Molecule::PSI_C1_Molecule(PSI_C1_Molecule &&orig)
+PSI_C1_Molecule::PSI_C1_Molecule(PSI_C1_Molecule &&orig) : Molecule(std::move(orig))
 {
    OEI = std::move(orig.OEI);
    TEI = std::move(orig.TEI);
@@ -146,6 +228,8 @@ PSI_C1_Molecule::PSI_C1_Molecule(PSI_C1_Molecule &&orig)
 
 PSI_C1_Molecule& PSI_C1_Molecule::operator=(const PSI_C1_Molecule &orig)
 {
+   Molecule::operator=(orig);
+
    OEI.reset(new helpers::matrix(*orig.OEI));
    TEI.reset(new helpers::matrix(*orig.TEI));
 
@@ -158,6 +242,8 @@ PSI_C1_Molecule& PSI_C1_Molecule::operator=(const PSI_C1_Molecule &orig)
 
 PSI_C1_Molecule& PSI_C1_Molecule::operator=(PSI_C1_Molecule &&orig)
 {
+   Molecule::operator=(std::move(orig));
+
    OEI = std::move(orig.OEI);
    TEI = std::move(orig.TEI);
 
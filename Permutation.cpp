@@ -1,6 +1,7 @@
 #include <iostream>
 #include <limits>
 #include <stdexcept>
+#include <vector>
 #include <assert.h>
 
 #include "Permutation.h"
@@ -18,6 +19,8 @@ Permutation::Permutation(unsigned int n)
 
    this->n = n;
 
+   binomials = getBinomials();
+
    // set n lowest bits to 1
    reset();
 }
@@ -29,12 +32,6 @@ Permutation::Permutation(unsigned int n)
  */
 mybitset Permutation::next()
 {
-#if defined(USELONG)
-#define MY_CTZ(x) __builtin_ctzl(x)
-#elif defined(USELONGLONG)
-#define MY_CTZ(x) __builtin_ctzll(x)
-#endif
- 
    // current permutation of bits 
    auto &v = current; // current permutation of bits 
 
@@ -42,7 +39,7 @@ mybitset Permutation::next()
    auto t = v | (v - 1); // t gets v's least significant 0 bits set to 1
    // Next set to 1 the most significant bit to change, 
    // set to 0 the least significant ones, and add the necessary 1 bits.
-   auto w = (t + 1) | (((~t & -~t) - 1) >> (MY_CTZ(v) + 1));
+   auto w = (t + 1) | (((~t & -~t) - 1) >> (ctz(v) + 1));
 
    // new/next permutation of bits
    current = w;
@@ -65,7 +62,110 @@ mybitset Permutation::get() const
  */
 void Permutation::reset()
 {
-   current = (1L<<n)-1L;
+   current = (n == getMax()) ? ~mybitset(0) : (mybitset(1) << n) - 1;
+}
+
+/**
+ * Calculate the index of a bitset in the sequence generated by next(),
+ * starting from 0 for the lowest n bits set. This is the combinatorial
+ * number system: the i-th set bit (counting from 1) at position p adds
+ * C(p,i) to the index. Costs one table lookup per set bit.
+ * @param bits the bitset to rank, should have n bits set
+ * @return the index of bits
+ */
+unsigned long long Permutation::rank(mybitset bits) const
+{
+   assert(popcount(bits) == n);
+
+   unsigned long long result = 0;
+
+   for(unsigned int i=1;bits;++i)
+   {
+      result += binomials[i*(getMax()+1) + ctz(bits)];
+
+      // remove the rightmost set bit
+      bits &= bits - 1;
+   }
+
+   return result;
+}
+
+/**
+ * The inverse of rank(): calculate the permutation with a given index
+ * in the sequence generated by next(), without changing the current one.
+ * The positions of the set bits are found from the highest to the lowest,
+ * so this costs O(getMax()) table lookups.
+ * @param index the index of the permutation
+ * @return the permutation with this index
+ */
+mybitset Permutation::get(unsigned long long index) const
+{
+   const auto dim = getMax()+1;
+
+   mybitset result = 0;
+   int p = getMax() - 1;
+
+   for(unsigned int i=n;i>0;--i)
+   {
+      // find the highest position p with C(p,i) <= index
+      while(binomials[i*dim + p] > index)
+         --p;
+
+      result |= mybitset(1) << p;
+      index -= binomials[i*dim + p];
+      --p;
+   }
+
+   assert(index == 0 && "Index out of range");
+
+   return result;
+}
+
+/**
+ * Jump directly to the permutation with a given index
+ * in the sequence generated by next(), see get(unsigned long long)
+ * @param index the index of the permutation to jump to
+ * @return the new current permutation
+ */
+mybitset Permutation::unrank(unsigned long long index)
+{
+   current = get(index);
+
+   return current;
+}
+
+/**
+ * Build the table with the binomial coefficients C(p,i) for 0 <= p,i <= getMax()
+ * The table is build only once and shared by all Permutation objects.
+ * C(p,i) is stored at index i*(getMax()+1) + p. Coefficients that do not fit
+ * are clamped, they can never be part of the rank of a valid bitset.
+ * @return pointer to the start of the table
+ */
+const unsigned long long* Permutation::getBinomials()
+{
+   // thread safe initialization (C++11)
+   static const std::vector<unsigned long long> table = [] () {
+      const auto dim = getMax()+1;
+      std::vector<unsigned long long> table(dim*dim, 0);
+
+      for(unsigned int p=0;p<dim;++p)
+      {
+         table[p] = 1;
+
+         for(unsigned int i=1;i<=p;++i)
+         {
+            // Pascal: C(p,i) = C(p-1,i-1) + C(p-1,i)
+            auto a = table[(i-1)*dim + p-1];
+            auto b = table[i*dim + p-1];
+
+            table[i*dim + p] = (a > std::numeric_limits<unsigned long long>::max() - b) ? std::numeric_limits<unsigned long long>::max() : a + b;
+         }
+      }
+
+      return table;
+   } ();
+
+   return table.data();
 }
 
 /**
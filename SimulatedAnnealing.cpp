@@ -113,7 +113,11 @@ void doci::SimulatedAnnealing::calc_energy()
 {
    ham->Build();
 
-   energy = ham->CalcEnergy();
+   auto eig = ham->Diagonalize();
+   energy = eig.first;
+
+   // a rotation barely changes the ground state: use it as start for the next solve
+   ham->SetStartVector(std::move(eig.second));
 }
 
 /**
@@ -128,9 +132,13 @@ double doci::SimulatedAnnealing::calc_new_energy()
 
    orbtrans->fillHamCI(mol->getHamObject());
 
-   ham->Build();
+   ham->UpdateValues(*mol);
+
+   auto eig = ham->Diagonalize();
+
+   ham->SetStartVector(std::move(eig.second));
 
-   return ham->CalcEnergy();
+   return eig.first;
 }
 
 /**
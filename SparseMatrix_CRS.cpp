@@ -1,24 +1,125 @@
 #include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstdio>
+#include <omp.h>
 #include <hdf5.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "SparseMatrix_CRS.h"
 
-#ifdef __INTEL_COMPILER
-#include <mkl.h>
-#endif
-
 // this helps to check the return codes of HDF5 calls
 #define HDF5_STATUS_CHECK(status) if(status < 0) std::cerr << __FILE__ << ":" << __LINE__ << ": Problem with writing to file. Status code=" << status << std::endl;
 
+// the HDF5 types that match crs_col_t. The row pointers always use 64 bit.
+// HDF5 converts on reading, so files with either layout can be read.
+#if defined(CRS_64BIT_COL)
+#define H5T_NATIVE_CRS_COL H5T_NATIVE_ULLONG
+#define H5T_STD_CRS_COL H5T_STD_U64LE
+#else
+#define H5T_NATIVE_CRS_COL H5T_NATIVE_UINT
+#define H5T_STD_CRS_COL H5T_STD_U32LE
+#endif
+
 using namespace helpers;
 
+const unsigned int SparseMatrix_CRS::max_block;
+
+//! the sections of a binary file start at a multiple of this (see WriteToBinaryFile())
+static const std::size_t binary_align = 64;
+
+//! the first bytes of a binary file
+static const char binary_magic[8] = {'D','O','C','I','C','R','S','1'};
+
+/**
+ * Round an offset in a binary file up to the start of the next section
+ * @param offset the offset in bytes
+ * @return the first multiple of binary_align from offset
+ */
+static std::size_t BinaryAlign(std::size_t offset)
+{
+   return (offset + binary_align - 1) / binary_align * binary_align;
+}
+
+/**
+ * Find the start of the arrays of a binary file and check that they fit in the file.
+ * The counts in the header are compared with the bytes left in the file before
+ * they are multiplied, so a damaged header can not wrap the offsets around.
+ * @param header the header of the file: n, the number of elements and the array sizes
+ * @param file_size the size of the file in bytes
+ * @param offset on return the start of the row pointers, column indices, data, pair indices and pair table
+ * @return true if all arrays are in the file
+ */
+static bool BinarySections(const unsigned long long *header, std::size_t file_size, std::size_t *offset)
+{
+   if(header[1] >= file_size)
+      return false;
+
+   const unsigned long long count[5] = {header[1]+1, header[2], header[3], header[4], header[5]};
+   const std::size_t size[5] = {sizeof(crs_row_t), sizeof(crs_col_t), sizeof(double), sizeof(unsigned short), sizeof(double)};
+
+   std::size_t end = sizeof(binary_magic) + 8 * sizeof(unsigned long long);
+
+   for(int a=0;a<5;a++)
+   {
+      offset[a] = BinaryAlign(end);
+
+      if(offset[a] > file_size || count[a] > (file_size - offset[a]) / size[a])
+         return false;
+
+      end = offset[a] + count[a] * size[a];
+   }
+
+   return true;
+}
+
+/**
+ * Check that the arrays of a binary file fit together before the product trusts them:
+ * with a pair table, data holds the diagonal and pair an index for every element,
+ * else data holds every element (see HasPairStorage()). The row pointers start at 0,
+ * never decrease and end at the number of elements. The column and pair indices
+ * are not checked: that would read the whole file.
+ * @param header the header of the file: n, the number of elements and the array sizes
+ * @param row_ptr the n+1 row pointers
+ * @return true if the arrays are consistent
+ */
+static bool BinaryArraysValid(const unsigned long long *header, const crs_row_t *row_ptr)
+{
+   const auto n = header[1];
+   const auto nnz = header[2];
+
+   if(header[5] > 0 ? (header[3] != n || header[4] != nnz) : (header[3] != nnz || header[4] != 0))
+      return false;
+
+   if(row_ptr[0] != 0 || row_ptr[n] != nnz)
+      return false;
+
+   for(unsigned long long i=0;i<n;i++)
+      if(row_ptr[i+1] < row_ptr[i])
+         return false;
+
+   return true;
+}
+
 /**
  * Construct SparseMatrix_CRS object for n x n matrix
  * @param n the number of rows/columns
  */
-SparseMatrix_CRS::SparseMatrix_CRS(unsigned int n)
+SparseMatrix_CRS::SparseMatrix_CRS(crs_col_t n)
 {
     this->n = n;
+    this->full = false;
     row.reserve(n+1);
+
+    map_row = nullptr;
+    map_col = nullptr;
+    map_data = nullptr;
+    map_pair = nullptr;
+    map_nnz = 0;
+    map_data_size = 0;
+    map_pair_size = 0;
 }
 
 /**
@@ -27,13 +128,16 @@ SparseMatrix_CRS::SparseMatrix_CRS(unsigned int n)
  * @param j the column number
  * @return the matrix element
  */
-double SparseMatrix_CRS::operator()(unsigned int i,unsigned int j) const
+double SparseMatrix_CRS::operator()(crs_col_t i,crs_col_t j) const
 {
    assert(i<n && j<n);
 
-    for(unsigned int k=row[i];k<row[i+1];k++)
-       if( col[k] == j )
-          return data[k];
+    const auto *row_ptr = RowPtr();
+    const auto *col_ptr = ColPtr();
+
+    for(crs_row_t k=row_ptr[i];k<row_ptr[i+1];k++)
+       if( col_ptr[k] == j )
+          return value(i,k);
 
     return 0;
 }
@@ -41,19 +145,21 @@ double SparseMatrix_CRS::operator()(unsigned int i,unsigned int j) const
 /**
  * @return the number of rows
  */
-unsigned int SparseMatrix_CRS::gn() const
+crs_col_t SparseMatrix_CRS::gn() const
 {
     return n;
 }
 
 /**
- * Convert a dense matrix to CRS format
+ * Convert a dense matrix to CRS format, both triangles are stored
  * @param dense the matrix to convert
  */
 void SparseMatrix_CRS::ConvertFromMatrix(const helpers::matrix &dense)
 {
    assert(dense.getm() == dense.getn());
    this->n = dense.getn();
+   this->full = true;
+   mapping.reset();
    row.resize(n+1);
 
    data.clear();
@@ -61,9 +167,9 @@ void SparseMatrix_CRS::ConvertFromMatrix(const helpers::matrix &dense)
 
    row[0] = 0;
 
-   for(unsigned int i=0;i<n;i++)
+   for(crs_col_t i=0;i<n;i++)
    {
-      for(unsigned int j=0;j<n;j++)
+      for(crs_col_t j=0;j<n;j++)
          if( fabs(dense(i,j)) > 1e-14 )
          {
             data.push_back(dense(i,j));
@@ -85,9 +191,12 @@ void SparseMatrix_CRS::ConvertToMatrix(helpers::matrix &dense) const
    assert(dense.getm() == dense.getn() && dense.getn() == n);
    dense = 0;
 
-   for(unsigned int i=0;i<row.size()-1;i++)
-      for(unsigned int k=row[i];k<row[i+1];k++)
-         dense(i,col[k]) = dense(col[k],i) = data[k];
+   const auto *row_ptr = RowPtr();
+   const auto *col_ptr = ColPtr();
+
+   for(crs_col_t i=0;i<n;i++)
+      for(crs_row_t k=row_ptr[i];k<row_ptr[i+1];k++)
+         dense(i,col_ptr[k]) = dense(col_ptr[k],i) = value(i,k);
 }
 
 /**
@@ -95,20 +204,33 @@ void SparseMatrix_CRS::ConvertToMatrix(helpers::matrix &dense) const
  */
 void SparseMatrix_CRS::PrintRaw() const
 {
-    std::cout << "Data(" << data.size() << "):" << std::endl;
-    for(unsigned int i=0;i<data.size();i++)
-        std::cout << data[i] << " ";
+    std::cout << "Data(" << DataSize() << "):" << std::endl;
+    for(crs_row_t i=0;i<DataSize();i++)
+        std::cout << DataPtr()[i] << " ";
     std::cout << std::endl;
 
     std::cout << "Col indices:" << std::endl;
-    for(unsigned int i=0;i<col.size();i++)
-        std::cout << col[i] << " ";
+    for(crs_row_t i=0;i<NumOfEl();i++)
+        std::cout << ColPtr()[i] << " ";
     std::cout << std::endl;
 
     std::cout << "Row indices:" << std::endl;
-    for(unsigned int i=0;i<row.size();i++)
-        std::cout << row[i] << " ";
+    for(crs_col_t i=0;i<(mapping ? n+1 : row.size());i++)
+        std::cout << RowPtr()[i] << " ";
     std::cout << std::endl;
+
+    if(HasPairStorage())
+    {
+       std::cout << "Pair indices:" << std::endl;
+       for(crs_row_t i=0;i<PairSize();i++)
+          std::cout << PairPtr()[i] << " ";
+       std::cout << std::endl;
+
+       std::cout << "Pair table(" << pair_table.size() << "):" << std::endl;
+       for(auto elem: pair_table)
+          std::cout << elem << " ";
+       std::cout << std::endl;
+    }
 }
 
 /**
@@ -119,9 +241,12 @@ void SparseMatrix_CRS::PrintRaw() const
  */
 std::ostream &operator<<(std::ostream &output,helpers::SparseMatrix_CRS &matrix_p)
 {
-   for(unsigned int i=0;i<matrix_p.row.size()-1;i++)
-      for(unsigned int k=matrix_p.row[i];k<matrix_p.row[i+1];k++)
-         output << i << "\t" << matrix_p.col[k] << "\t" << matrix_p.data[k] << std::endl;
+   const auto *row_ptr = matrix_p.RowPtr();
+   const auto *col_ptr = matrix_p.ColPtr();
+
+   for(crs_col_t i=0;i<matrix_p.n;i++)
+      for(crs_row_t k=row_ptr[i];k<row_ptr[i+1];k++)
+         output << i << "\t" << col_ptr[k] << "\t" << matrix_p.value(i,k) << std::endl;
 
    return output;
 }
@@ -134,8 +259,10 @@ std::ostream &operator<<(std::ostream &output,helpers::SparseMatrix_CRS &matrix_
  * @param j column
  * @param value the matrix element value
  */
-void SparseMatrix_CRS::PushToRow(unsigned int j, double value)
+void SparseMatrix_CRS::PushToRow(crs_col_t j, double value)
 {
+   assert(!HasPairStorage());
+
    if(col.empty() || row.back() == col.size() || col.back() < j)
    {
       data.push_back(value);
@@ -143,8 +270,8 @@ void SparseMatrix_CRS::PushToRow(unsigned int j, double value)
    }
    else
    {
-      unsigned int begin = row.back();
-      for(unsigned int i=begin;i<col.size();i++)
+      crs_row_t begin = row.back();
+      for(crs_row_t i=begin;i<col.size();i++)
       {
          if( col[i] > j )
          {
@@ -179,7 +306,7 @@ void SparseMatrix_CRS::PushToRow(unsigned int j, double value)
  * @param j column
  * @param value the matrix element value
  */
-void SparseMatrix_CRS::PushToRowNext(unsigned int j, double value)
+void SparseMatrix_CRS::PushToRowNext(crs_col_t j, double value)
 {
    assert(col.empty() || row.back() == col.size() || col.back() < j);
 
@@ -187,6 +314,26 @@ void SparseMatrix_CRS::PushToRowNext(unsigned int j, double value)
    col.push_back(j);
 }
 
+/**
+ * Adds a new column element to the current row, for the pair storage mode.
+ * Works like PushToRowNext(), but stores the index of the value in the pair
+ * table instead of the value. Use PushToRowNext() for the diagonal element,
+ * which should be the first element of each row.
+ * @param j column
+ * @param idx the index of the value in the pair table (see SetPairTable())
+ */
+void SparseMatrix_CRS::PushPairToRowNext(crs_col_t j, unsigned short idx)
+{
+   assert(row.back() < col.size() && "Start every row with the diagonal");
+   assert(col.back() < j);
+
+   // the diagonal elements have no pair index
+   pair.resize(col.size(), 0);
+
+   col.push_back(j);
+   pair.push_back(idx);
+}
+
 /**
  * Adds the next row to the sparsematrix
  */
@@ -195,7 +342,7 @@ void SparseMatrix_CRS::NewRow()
    if(row.size() == (n+1))
       return;
 
-   row.push_back(data.size());
+   row.push_back(col.size());
 
    // fill the lower part with data
    // from the upper part
@@ -218,67 +365,229 @@ void SparseMatrix_CRS::NewRow()
  */
 void SparseMatrix_CRS::mvprod(const double *x, double *y) const
 {
-#ifdef __INTEL_COMPILER
-   char uplo = 'U';
+   mvprod(x, y, 0.0);
+}
 
-   mkl_cspblas_dcsrsymv(&uplo, (const int *) &n, data.data(), (const int *) row.data(), (const int *) col.data(), x, y);
-#else
+/**
+ * Do the matrix vector product y = A * x + beta * y
+ * We only store the upper diagonal part, so every element is used twice:
+ * once for y[i] += A_ij x[j] (gather) and once for y[j] += A_ij x[i] (scatter).
+ * The rows are split over the threads with an equal number of elements. The
+ * scatter of thread t can only touch y[j] with j >= the first row of thread t, so
+ * every thread (except the first, which works in y directly) accumulates in a
+ * private buffer covering that range. The buffers are added to y at the end.
+ * This costs at most (threads-1)*n extra doubles, which are kept between calls.
+ * If the full matrix is stored (see IsFull()), every thread only gathers for its own rows.
+ * @warning not thread safe: the buffers are shared by all calls on this object
+ * @param x a m component vector
+ * @param y a n component vector
+ * @param beta the multiply factor for y
+ */
+void SparseMatrix_CRS::mvprod(const double *x, double *y, double beta) const
+{
+   mvprod_nv<1>(x, y, beta);
+}
 
-//#pragma omp parallel
-   for(unsigned int i=0;i<n;i++)
+/**
+ * Do the matrix matrix product Y = A * X for nvec vectors at once (SpMM), see
+ * mvprod(x,y,beta). The vectors are interleaved: element i of vector v is at
+ * i*nvec+v. Every element of the matrix is loaded once for all vectors and the
+ * nvec elements of X in a column share a cache line, so this is a lot cheaper
+ * than nvec calls of mvprod(). The thread buffers grow to nvec*n per thread.
+ * @warning not thread safe: the buffers are shared by all calls on this object
+ * @param x n x nvec matrix, the vectors to multiply with (interleaved)
+ * @param y n x nvec matrix, on return will hold A * X (interleaved)
+ * @param nvec the number of vectors, at most max_block
+ */
+void SparseMatrix_CRS::mvprod_block(const double *x, double *y, unsigned int nvec) const
+{
+   assert(nvec <= max_block);
+
+   switch(nvec)
    {
-      y[i] = 0;
+      case 1: mvprod_nv<1>(x, y, 0.0); break;
+      case 2: mvprod_nv<2>(x, y, 0.0); break;
+      case 3: mvprod_nv<3>(x, y, 0.0); break;
+      case 4: mvprod_nv<4>(x, y, 0.0); break;
+      case 5: mvprod_nv<5>(x, y, 0.0); break;
+      case 6: mvprod_nv<6>(x, y, 0.0); break;
+      case 7: mvprod_nv<7>(x, y, 0.0); break;
+      case 8: mvprod_nv<8>(x, y, 0.0); break;
+   }
+}
 
-      // upper diagonal
-      for(unsigned int k=row[i];k<row[i+1];k++)
-      {
-         y[i] += data[k] * x[col[k]];
-      }
+/**
+ * Y = A * X + beta * Y for NV interleaved vectors: select the kernel for the storage
+ * @param x n x NV matrix, the vectors to multiply with (interleaved)
+ * @param y n x NV matrix (interleaved)
+ * @param beta the multiply factor for y
+ */
+template<unsigned int NV>
+void SparseMatrix_CRS::mvprod_nv(const double *x, double *y, double beta) const
+{
+   const auto *row_ptr = RowPtr();
+   const auto *data_ptr = DataPtr();
+   const auto *pair_ptr = PairPtr();
+   const auto *table = pair_table.data();
+
+   if(HasPairStorage())
+      // the first element of a row is the diagonal
+      mvprod_kernel<NV>(x, y, beta, [row_ptr,data_ptr,pair_ptr,table] (crs_col_t i, crs_row_t k) -> double { return (k == row_ptr[i]) ? data_ptr[i] : table[pair_ptr[k]]; });
+   else
+      mvprod_kernel<NV>(x, y, beta, [data_ptr] (crs_col_t i, crs_row_t k) -> double { return data_ptr[k]; });
+}
+
+/**
+ * The actual kernel of mvprod(x,y,beta) and mvprod_block(), see there.
+ * NV is the number of interleaved vectors in x and y.
+ * @param x n x NV matrix, the vectors to multiply with
+ * @param y n x NV matrix
+ * @param beta the multiply factor for y
+ * @param elem functor that returns the value of element k in row i
+ */
+template<unsigned int NV, typename F>
+void SparseMatrix_CRS::mvprod_kernel(const double *x, double *y, double beta, F elem) const
+{
+   // the rows are split in pieces of about the same work, one per thread. The pieces
+   // are handed out with a static schedule: in a full team thread t gets piece t (which
+   // it first touched in Allocate()), a smaller team does several pieces per thread.
+   const int num_t = omp_get_max_threads();
 
-      // lower diagonal
-      for(unsigned int j=0;j<i;j++)
-         for(unsigned int k=row[j]+1;k<row[j+1];k++)
+   // part[t] is the first row of piece t, offset[t] the start of its buffer
+   const auto part = RowPartition(num_t);
+
+   const auto *row_ptr = RowPtr();
+   const auto *col_ptr = ColPtr();
+
+   if(full)
+   {
+#pragma omp parallel for schedule(static)
+      for(int t=0;t<num_t;t++)
+         for(crs_col_t i=part[t];i<part[t+1];i++)
          {
-            if(col[k] == i)
+            double tmp[NV] = {};
+
+            for(crs_row_t k=row_ptr[i];k<row_ptr[i+1];k++)
             {
-               y[i] += data[k] * x[j];
-               break;
+               const double a_ij = elem(i,k);
+               const double *x_j = x + static_cast<std::size_t>(col_ptr[k])*NV;
+
+               for(unsigned int v=0;v<NV;v++)
+                  tmp[v] += a_ij * x_j[v];
             }
+
+            double *y_i = y + static_cast<std::size_t>(i)*NV;
+
+            for(unsigned int v=0;v<NV;v++)
+               y_i[v] = (beta == 0.0) ? tmp[v] : beta * y_i[v] + tmp[v];
          }
+
+      return;
    }
-#endif
-}
 
-/**
- * Do the matrix vector product y = A * x + beta * y
- * @param x a m component vector
- * @param y a n component vector
- * @param beta the multiply factor for y
- */
-void SparseMatrix_CRS::mvprod(const double *x, double *y, double beta) const
-{
+   std::vector<std::size_t> offset(num_t+1, 0);
+
+   for(int t=1;t<num_t;t++)
+      offset[t+1] = offset[t] + (n - part[t])*NV;
+
+   if(mvprod_buffer.size() < offset.back())
+      mvprod_buffer.resize(offset.back());
+
+   // piece t scatters in acc(t), piece 0 directly in y. Use global row indices in the buffers.
+   auto acc = [&] (int t) -> double * {
+      return (t == 0) ? y : mvprod_buffer.data() + offset[t] - static_cast<std::size_t>(part[t])*NV;
+   };
+
 #pragma omp parallel
-   for(unsigned int i=0;i<n;i++)
    {
-      y[i] *= beta;
+#pragma omp for schedule(static)
+      for(int t=1;t<num_t;t++)
+         std::fill(acc(t) + static_cast<std::size_t>(part[t])*NV, acc(t) + static_cast<std::size_t>(n)*NV, 0.0);
+
+#pragma omp for schedule(static)
+      for(std::size_t i=0;i<static_cast<std::size_t>(n)*NV;i++)
+         y[i] = (beta == 0.0) ? 0.0 : beta * y[i];
 
-      // upper diagonal
-      for(unsigned int k=row[i];k<row[i+1];k++)
+#pragma omp for schedule(static)
+      for(int t=0;t<num_t;t++)
       {
-         y[i] += data[k] * x[col[k]];
-      }
+         double *acc_t = acc(t);
 
-      // lower diagonal
-      for(unsigned int j=0;j<i;j++)
-         for(unsigned int k=row[j]+1;k<row[j+1];k++)
+         for(crs_col_t i=part[t];i<part[t+1];i++)
          {
-            if(col[k] == i)
+            const double *x_i = x + static_cast<std::size_t>(i)*NV;
+            double tmp[NV] = {};
+
+            for(crs_row_t k=row_ptr[i];k<row_ptr[i+1];k++)
             {
-               y[i] += data[k] * x[j];
-               break;
+               const auto j = col_ptr[k];
+               assert(j >= i && "Only the upper diagonal part should be stored");
+
+               const double a_ij = elem(i,k);
+               const double *x_j = x + static_cast<std::size_t>(j)*NV;
+
+               // upper diagonal
+               for(unsigned int v=0;v<NV;v++)
+                  tmp[v] += a_ij * x_j[v];
+
+               // lower diagonal
+               if(j != i)
+               {
+                  double *acc_j = acc_t + static_cast<std::size_t>(j)*NV;
+
+                  for(unsigned int v=0;v<NV;v++)
+                     acc_j[v] += a_ij * x_i[v];
+               }
             }
+
+            double *acc_i = acc_t + static_cast<std::size_t>(i)*NV;
+
+            for(unsigned int v=0;v<NV;v++)
+               acc_i[v] += tmp[v];
          }
+      }
+
+      // add the buffers of the pieces to y
+#pragma omp for schedule(static)
+      for(crs_col_t i=0;i<n;i++)
+         for(int t=1;t<num_t && part[t]<=i;t++)
+            for(unsigned int v=0;v<NV;v++)
+               y[static_cast<std::size_t>(i)*NV+v] += mvprod_buffer[offset[t] + static_cast<std::size_t>(i-part[t])*NV + v];
+   }
+}
+
+/**
+ * Split the rows over a number of threads so that every thread gets
+ * (about) the same number of non-zero elements
+ * @param num_t the number of threads
+ * @return the first row of every thread, followed by n (size num_t+1)
+ */
+std::vector<crs_col_t> SparseMatrix_CRS::RowPartition(int num_t) const
+{
+   std::vector<crs_col_t> part(num_t+1);
+
+   part.front() = 0;
+   part.back() = n;
+
+   const auto *row_ptr = RowPtr();
+
+   for(int t=1;t<num_t;t++)
+   {
+      const crs_row_t target = (row_ptr[n]*t)/num_t;
+      part[t] = std::lower_bound(row_ptr, row_ptr+n, target) - row_ptr;
    }
+
+   return part;
+}
+
+/**
+ * Release the accumulation buffers of the threads in the product of the upper diagonal
+ * part (about one vector per thread and per vector in a block). The next product
+ * allocates them again.
+ */
+void SparseMatrix_CRS::FreeBuffers() const
+{
+   decltype(mvprod_buffer)().swap(mvprod_buffer);
 }
 
 /**
@@ -299,7 +608,7 @@ int SparseMatrix_CRS::WriteToFile(const char *filename, const char *name, bool a
 
    group_id = H5Gcreate(file_id, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 
-   hsize_t dimblock = data.size();
+   hsize_t dimblock = DataSize();
 
    scalar_id = H5Screate(H5S_SCALAR);
 
@@ -307,13 +616,13 @@ int SparseMatrix_CRS::WriteToFile(const char *filename, const char *name, bool a
 
    dataset_id = H5Dcreate(group_id, "data", H5T_IEEE_F64LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 
-   status = H5Dwrite(dataset_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, data.data() );
+   status = H5Dwrite(dataset_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, DataPtr() );
    HDF5_STATUS_CHECK(status);
 
-   unsigned int size = data.size();
+   unsigned long long size = DataSize();
    attribute_id = H5Acreate (dataset_id, "size", H5T_STD_U64LE, scalar_id, H5P_DEFAULT, H5P_DEFAULT);
    HDF5_STATUS_CHECK(attribute_id);
-   status = H5Awrite (attribute_id, H5T_NATIVE_UINT, &size );
+   status = H5Awrite (attribute_id, H5T_NATIVE_ULLONG, &size );
    HDF5_STATUS_CHECK(status);
 
    status = H5Aclose(attribute_id);
@@ -322,14 +631,22 @@ int SparseMatrix_CRS::WriteToFile(const char *filename, const char *name, bool a
    status = H5Dclose(dataset_id);
    HDF5_STATUS_CHECK(status);
 
-   dataset_id = H5Dcreate(group_id, "col", H5T_STD_U64LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+   status = H5Sclose(dataspace_id);
+   HDF5_STATUS_CHECK(status);
 
-   status = H5Dwrite(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, col.data() );
+   // in pair storage, col is longer than data
+   dimblock = NumOfEl();
+
+   dataspace_id = H5Screate_simple(1, &dimblock, NULL);
+
+   dataset_id = H5Dcreate(group_id, "col", H5T_STD_CRS_COL, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+   status = H5Dwrite(dataset_id, H5T_NATIVE_CRS_COL, H5S_ALL, H5S_ALL, H5P_DEFAULT, ColPtr() );
    HDF5_STATUS_CHECK(status);
 
-   size = col.size();
+   size = NumOfEl();
    attribute_id = H5Acreate (dataset_id, "size", H5T_STD_U64LE, scalar_id, H5P_DEFAULT, H5P_DEFAULT);
-   status = H5Awrite (attribute_id, H5T_NATIVE_UINT, &size );
+   status = H5Awrite (attribute_id, H5T_NATIVE_ULLONG, &size );
    HDF5_STATUS_CHECK(status);
 
    status = H5Aclose(attribute_id);
@@ -338,16 +655,42 @@ int SparseMatrix_CRS::WriteToFile(const char *filename, const char *name, bool a
    status = H5Dclose(dataset_id);
    HDF5_STATUS_CHECK(status);
 
+   if(HasPairStorage())
+   {
+      dataset_id = H5Dcreate(group_id, "pair", H5T_STD_U16LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+      status = H5Dwrite(dataset_id, H5T_NATIVE_USHORT, H5S_ALL, H5S_ALL, H5P_DEFAULT, PairPtr() );
+      HDF5_STATUS_CHECK(status);
+
+      status = H5Dclose(dataset_id);
+      HDF5_STATUS_CHECK(status);
+
+      status = H5Sclose(dataspace_id);
+      HDF5_STATUS_CHECK(status);
+
+      dimblock = pair_table.size();
+
+      dataspace_id = H5Screate_simple(1, &dimblock, NULL);
+
+      dataset_id = H5Dcreate(group_id, "pair_table", H5T_IEEE_F64LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+      status = H5Dwrite(dataset_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, pair_table.data() );
+      HDF5_STATUS_CHECK(status);
+
+      status = H5Dclose(dataset_id);
+      HDF5_STATUS_CHECK(status);
+   }
+
    status = H5Sclose(dataspace_id);
    HDF5_STATUS_CHECK(status);
 
-   dimblock = row.size();
+   dimblock = n+1;
 
    dataspace_id = H5Screate_simple(1, &dimblock, NULL);
 
    dataset_id = H5Dcreate(group_id, "row", H5T_STD_U64LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 
-   status = H5Dwrite(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, row.data() );
+   status = H5Dwrite(dataset_id, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, RowPtr() );
    HDF5_STATUS_CHECK(status);
 
    status = H5Dclose(dataset_id);
@@ -358,12 +701,26 @@ int SparseMatrix_CRS::WriteToFile(const char *filename, const char *name, bool a
 
    dataset_id = H5Dcreate(group_id, "n", H5T_STD_U64LE, scalar_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 
-   status = H5Dwrite(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &n );
+   status = H5Dwrite(dataset_id, H5T_NATIVE_CRS_COL, H5S_ALL, H5S_ALL, H5P_DEFAULT, &n );
    HDF5_STATUS_CHECK(status);
 
    status = H5Dclose(dataset_id);
    HDF5_STATUS_CHECK(status);
 
+   // only present when both triangles are stored
+   if(full)
+   {
+      const unsigned char flag = 1;
+
+      dataset_id = H5Dcreate(group_id, "full", H5T_STD_U8LE, scalar_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+      status = H5Dwrite(dataset_id, H5T_NATIVE_UCHAR, H5S_ALL, H5S_ALL, H5P_DEFAULT, &flag );
+      HDF5_STATUS_CHECK(status);
+
+      status = H5Dclose(dataset_id);
+      HDF5_STATUS_CHECK(status);
+   }
+
    status = H5Sclose(scalar_id);
    HDF5_STATUS_CHECK(status);
 
@@ -395,15 +752,29 @@ int SparseMatrix_CRS::ReadFromFile(const char *filename, const char *name)
    dataset_id = H5Dopen(group_id, "n", H5P_DEFAULT);
    HDF5_STATUS_CHECK(dataset_id);
 
-   status = H5Dread(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &n);
+   unsigned long long dim;
+   status = H5Dread(dataset_id, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, &dim);
    HDF5_STATUS_CHECK(status);
 
    status = H5Dclose(dataset_id);
    HDF5_STATUS_CHECK(status);
 
+   if(dim > std::numeric_limits<crs_col_t>::max())
+   {
+      std::cerr << "Matrix in " << filename << " is too large for the column index type, compile with CRS_64BIT_COL" << std::endl;
+
+      H5Gclose(group_id);
+      H5Fclose(file_id);
+
+      return -1;
+   }
+
+   n = dim;
+   mapping.reset();
+
    row.resize(n+1);
 
-   unsigned int size;
+   unsigned long long size;
 
    dataset_id = H5Dopen(group_id, "data", H5P_DEFAULT);
    HDF5_STATUS_CHECK(dataset_id);
@@ -411,7 +782,7 @@ int SparseMatrix_CRS::ReadFromFile(const char *filename, const char *name)
    attribute_id = H5Aopen(dataset_id, "size", H5P_DEFAULT);
    HDF5_STATUS_CHECK(attribute_id);
 
-   status = H5Aread(attribute_id, H5T_NATIVE_UINT, &size);
+   status = H5Aread(attribute_id, H5T_NATIVE_ULLONG, &size);
    HDF5_STATUS_CHECK(status);
 
 
@@ -433,7 +804,7 @@ int SparseMatrix_CRS::ReadFromFile(const char *filename, const char *name)
    attribute_id = H5Aopen(dataset_id, "size", H5P_DEFAULT);
    HDF5_STATUS_CHECK(attribute_id);
 
-   status = H5Aread(attribute_id, H5T_NATIVE_UINT, &size);
+   status = H5Aread(attribute_id, H5T_NATIVE_ULLONG, &size);
    HDF5_STATUS_CHECK(status);
 
    status = H5Aclose(attribute_id);
@@ -441,7 +812,7 @@ int SparseMatrix_CRS::ReadFromFile(const char *filename, const char *name)
 
    col.resize(size);
 
-   status = H5Dread(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, col.data());
+   status = H5Dread(dataset_id, H5T_NATIVE_CRS_COL, H5S_ALL, H5S_ALL, H5P_DEFAULT, col.data());
    HDF5_STATUS_CHECK(status);
 
    status = H5Dclose(dataset_id);
@@ -451,12 +822,52 @@ int SparseMatrix_CRS::ReadFromFile(const char *filename, const char *name)
    dataset_id = H5Dopen(group_id, "row", H5P_DEFAULT);
    HDF5_STATUS_CHECK(dataset_id);
 
-   status = H5Dread(dataset_id, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, row.data());
+   status = H5Dread(dataset_id, H5T_NATIVE_ULLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, row.data());
    HDF5_STATUS_CHECK(status);
 
    status = H5Dclose(dataset_id);
    HDF5_STATUS_CHECK(status);
 
+   full = (H5Lexists(group_id, "full", H5P_DEFAULT) > 0);
+
+   pair.clear();
+   pair_table.clear();
+
+   // only present for pair storage
+   if(H5Lexists(group_id, "pair_table", H5P_DEFAULT) > 0)
+   {
+      pair.resize(col.size());
+
+      dataset_id = H5Dopen(group_id, "pair", H5P_DEFAULT);
+      HDF5_STATUS_CHECK(dataset_id);
+
+      status = H5Dread(dataset_id, H5T_NATIVE_USHORT, H5S_ALL, H5S_ALL, H5P_DEFAULT, pair.data());
+      HDF5_STATUS_CHECK(status);
+
+      status = H5Dclose(dataset_id);
+      HDF5_STATUS_CHECK(status);
+
+      dataset_id = H5Dopen(group_id, "pair_table", H5P_DEFAULT);
+      HDF5_STATUS_CHECK(dataset_id);
+
+      hid_t dataspace_id = H5Dget_space(dataset_id);
+      HDF5_STATUS_CHECK(dataspace_id);
+
+      hsize_t table_size;
+      H5Sget_simple_extent_dims(dataspace_id, &table_size, NULL);
+
+      status = H5Sclose(dataspace_id);
+      HDF5_STATUS_CHECK(status);
+
+      pair_table.resize(table_size);
+
+      status = H5Dread(dataset_id, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, pair_table.data());
+      HDF5_STATUS_CHECK(status);
+
+      status = H5Dclose(dataset_id);
+      HDF5_STATUS_CHECK(status);
+   }
+
    status = H5Gclose(group_id);
    HDF5_STATUS_CHECK(status);
 
@@ -466,14 +877,288 @@ int SparseMatrix_CRS::ReadFromFile(const char *filename, const char *name)
    return 0;
 }
 
+/**
+ * Save a SparseMatrix_CRS to a raw binary file: a flat copy of the arrays, which is
+ * much faster to write and read back than HDF5 (see SparseMatrix_OOC). The file starts
+ * with binary_magic and a header of 8 unsigned long longs: the size of crs_col_t, n,
+ * the sizes of col, data, pair and the pair table, full and a reserved 0. Then follow
+ * row, col, data, pair and the pair table, every one at a multiple of binary_align bytes.
+ * Everything is in the native byte order, so the file is not portable between machines.
+ * @param filename the name of the file to write to
+ * @return 0 on success, -1 if the file could not be written
+ */
+int SparseMatrix_CRS::WriteToBinaryFile(const char *filename) const
+{
+   std::FILE *file = std::fopen(filename, "wb");
+
+   if(!file)
+   {
+      std::cerr << "Could not open " << filename << " for writing" << std::endl;
+      return -1;
+   }
+
+   const unsigned long long header[8] = {sizeof(crs_col_t), n, NumOfEl(), DataSize(), PairSize(), pair_table.size(), full, 0};
+
+   bool ok = (std::fwrite(binary_magic, sizeof(binary_magic), 1, file) == 1) && (std::fwrite(header, sizeof(header), 1, file) == 1);
+
+   std::size_t offset = sizeof(binary_magic) + sizeof(header);
+
+   // write an array at the next aligned offset
+   auto section = [&ok,&offset,file] (const void *ptr, std::size_t bytes) {
+      static const char zeros[binary_align] = {};
+      const auto start = BinaryAlign(offset);
+
+      ok = ok && std::fwrite(zeros, 1, start - offset, file) == start - offset;
+      ok = ok && std::fwrite(ptr, 1, bytes, file) == bytes;
+      offset = start + bytes;
+   };
+
+   section(RowPtr(), (n+1) * sizeof(crs_row_t));
+   section(ColPtr(), NumOfEl() * sizeof(crs_col_t));
+   section(DataPtr(), DataSize() * sizeof(double));
+   section(PairPtr(), PairSize() * sizeof(unsigned short));
+   section(pair_table.data(), pair_table.size() * sizeof(double));
+
+   ok = (std::fclose(file) == 0) && ok;
+
+   if(!ok)
+   {
+      std::cerr << "Problem with writing to " << filename << std::endl;
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Read a SparseMatrix_CRS from a raw binary file written by WriteToBinaryFile().
+ * The arrays keep their memory when they are large enough, so reading matrices
+ * of about the same size over and over again does not allocate.
+ * @param filename the name of the file to read from
+ * @return 0 on success, -1 if the file could not be read (the matrix is then undefined)
+ */
+int SparseMatrix_CRS::ReadFromBinaryFile(const char *filename)
+{
+   std::FILE *file = std::fopen(filename, "rb");
+
+   if(!file)
+   {
+      std::cerr << "Could not open " << filename << " for reading" << std::endl;
+      return -1;
+   }
+
+   char magic[sizeof(binary_magic)];
+   unsigned long long header[8];
+
+   bool ok = (std::fread(magic, sizeof(magic), 1, file) == 1) && (std::fread(header, sizeof(header), 1, file) == 1);
+
+   ok = ok && std::equal(magic, magic+sizeof(magic), binary_magic);
+   ok = ok && header[0] == sizeof(crs_col_t) && header[1] <= std::numeric_limits<crs_col_t>::max();
+
+   // check the sizes in the header against the file before allocating the arrays
+   struct stat info;
+   std::size_t offset[5];
+
+   ok = ok && fstat(fileno(file), &info) == 0 && BinarySections(header, info.st_size, offset);
+
+   if(ok)
+   {
+      n = header[1];
+      full = header[6];
+      mapping.reset();
+
+      row.resize(n+1);
+      col.resize(header[2]);
+      data.resize(header[3]);
+      pair.resize(header[4]);
+      pair_table.resize(header[5]);
+
+      // read an array from its offset
+      auto section = [&ok,file] (void *ptr, std::size_t start, std::size_t bytes) {
+         ok = ok && std::fseek(file, start, SEEK_SET) == 0;
+         ok = ok && std::fread(ptr, 1, bytes, file) == bytes;
+      };
+
+      section(row.data(), offset[0], row.size() * sizeof(crs_row_t));
+      section(col.data(), offset[1], col.size() * sizeof(crs_col_t));
+      section(data.data(), offset[2], data.size() * sizeof(double));
+      section(pair.data(), offset[3], pair.size() * sizeof(unsigned short));
+      section(pair_table.data(), offset[4], pair_table.size() * sizeof(double));
+
+      ok = ok && BinaryArraysValid(header, row.data());
+   }
+
+   std::fclose(file);
+
+   if(!ok)
+   {
+      std::cerr << "Could not read a sparse matrix from " << filename << std::endl;
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Use a raw binary file written by WriteToBinaryFile() as the matrix, without reading
+ * it: the file is mapped in memory (read only, shared) and the product works directly
+ * on the mapped arrays. The pages come from the page cache, so a file that was used
+ * recently costs no I/O at all and several processes share the same pages. Only the
+ * pair table is copied. The matrix can not be changed afterwards (except for the pair
+ * table), until it is set up again with Allocate() or read from a file. Copies share
+ * the mapping, which is released with the last of them. The sizes of the arrays and
+ * the row pointers are checked first, which reads the row pointers once.
+ * @param filename the name of the file to map
+ * @return 0 on success, -1 if the file could not be mapped (the matrix is then unchanged)
+ */
+int SparseMatrix_CRS::MapBinaryFile(const char *filename)
+{
+   const int fd = open(filename, O_RDONLY);
+
+   if(fd < 0)
+   {
+      std::cerr << "Could not open " << filename << " for reading" << std::endl;
+      return -1;
+   }
+
+   struct stat info;
+   void *ptr = MAP_FAILED;
+
+   if(fstat(fd, &info) == 0 && info.st_size > 0)
+      ptr = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+   // the mapping keeps the file open
+   close(fd);
+
+   if(ptr == MAP_FAILED)
+   {
+      std::cerr << "Could not map " << filename << std::endl;
+      return -1;
+   }
+
+   const std::size_t file_size = info.st_size;
+   std::shared_ptr<const char> map(static_cast<const char *>(ptr), [file_size] (const char *p) { munmap(const_cast<char *>(p), file_size); });
+
+   unsigned long long header[8];
+
+   bool ok = file_size >= sizeof(binary_magic) + sizeof(header) && std::equal(map.get(), map.get()+sizeof(binary_magic), binary_magic);
+
+   if(ok)
+   {
+      std::copy(map.get()+sizeof(binary_magic), map.get()+sizeof(binary_magic)+sizeof(header), reinterpret_cast<char *>(header));
+      ok = header[0] == sizeof(crs_col_t) && header[1] <= std::numeric_limits<crs_col_t>::max();
+   }
+
+   // the start of every array, as in ReadFromBinaryFile()
+   std::size_t offset[5];
+
+   ok = ok && BinarySections(header, file_size, offset) && BinaryArraysValid(header, reinterpret_cast<const crs_row_t *>(map.get() + offset[0]));
+
+   if(!ok)
+   {
+      std::cerr << "Could not read a sparse matrix from " << filename << std::endl;
+      return -1;
+   }
+
+   // free the arrays in memory
+   decltype(data)().swap(data);
+   decltype(col)().swap(col);
+   decltype(pair)().swap(pair);
+   decltype(row)().swap(row);
+
+   n = header[1];
+   full = header[6];
+
+   map_row = reinterpret_cast<const crs_row_t *>(map.get() + offset[0]);
+   map_col = reinterpret_cast<const crs_col_t *>(map.get() + offset[1]);
+   map_data = reinterpret_cast<const double *>(map.get() + offset[2]);
+   map_pair = reinterpret_cast<const unsigned short *>(map.get() + offset[3]);
+   map_nnz = header[2];
+   map_data_size = header[3];
+   map_pair_size = header[4];
+
+   const auto *table = reinterpret_cast<const double *>(map.get() + offset[4]);
+   pair_table.assign(table, table + header[5]);
+
+   mapping = std::move(map);
+
+   return 0;
+}
+
+/**
+ * @return true if the arrays are in a mapped file, see MapBinaryFile()
+ */
+bool SparseMatrix_CRS::IsMapped() const
+{
+   return static_cast<bool>(mapping);
+}
+
+/**
+ * @return the row pointers, in memory or in the mapped file
+ */
+const crs_row_t* SparseMatrix_CRS::RowPtr() const
+{
+   return mapping ? map_row : row.data();
+}
+
+/**
+ * @return the column indices, in memory or in the mapped file
+ */
+const crs_col_t* SparseMatrix_CRS::ColPtr() const
+{
+   return mapping ? map_col : col.data();
+}
+
+/**
+ * @return the values (only the diagonal in pair storage), in memory or in the mapped file
+ */
+const double* SparseMatrix_CRS::DataPtr() const
+{
+   return mapping ? map_data : data.data();
+}
+
+/**
+ * @return the pair indices, in memory or in the mapped file
+ */
+const unsigned short* SparseMatrix_CRS::PairPtr() const
+{
+   return mapping ? map_pair : pair.data();
+}
+
+/**
+ * @return the number of values in DataPtr()
+ */
+std::size_t SparseMatrix_CRS::DataSize() const
+{
+   return mapping ? map_data_size : data.size();
+}
+
+/**
+ * @return the number of pair indices in PairPtr()
+ */
+std::size_t SparseMatrix_CRS::PairSize() const
+{
+   return mapping ? map_pair_size : pair.size();
+}
+
+/**
+ * @return the number of stored non-zero elements
+ */
+crs_row_t SparseMatrix_CRS::NumOfEl() const
+{
+   return mapping ? map_nnz : col.size();
+}
+
 /**
  * Get the number of elements in a row
  * @param idx the row to consider
  * @return the number of non-zero elements in row idx
  */
-unsigned int SparseMatrix_CRS::NumOfElInRow(unsigned int idx) const
+crs_col_t SparseMatrix_CRS::NumOfElInRow(crs_col_t idx) const
 {
-   return (row[idx+1]-row[idx]);
+   const auto *row_ptr = RowPtr();
+
+   return (row_ptr[idx+1]-row_ptr[idx]);
 }
 
 /**
@@ -482,9 +1167,9 @@ unsigned int SparseMatrix_CRS::NumOfElInRow(unsigned int idx) const
  * @param element_index the index of the element (index of the non-zero elements, not the column index)
  * @return the value of the element
  */
-double SparseMatrix_CRS::GetElementInRow(unsigned int row_index, unsigned int element_index) const
+double SparseMatrix_CRS::GetElementInRow(crs_col_t row_index, crs_col_t element_index) const
 {
-   return data[row[row_index]+element_index];
+   return value(row_index, RowPtr()[row_index]+element_index);
 }
 
 /**
@@ -493,9 +1178,30 @@ double SparseMatrix_CRS::GetElementInRow(unsigned int row_index, unsigned int el
  * @param element_index the index of the element in the row (index of the non-zero elements, not the column index)
  * @return the column number of the element
  */
-unsigned int SparseMatrix_CRS::GetElementColIndexInRow(unsigned int row_index, unsigned int element_index) const
+crs_col_t SparseMatrix_CRS::GetElementColIndexInRow(crs_col_t row_index, crs_col_t element_index) const
+{
+   return ColPtr()[RowPtr()[row_index]+element_index];
+}
+
+/**
+ * Change the value of an element in a row, the structure stays the same.
+ * In pair storage, only the diagonal (element_index 0) can be changed this way,
+ * the others are in the pair table (see SetPairTable()). A mapped matrix (see
+ * MapBinaryFile()) can not be changed.
+ * @param row_index the number of the row
+ * @param element_index the index of the element (index of the non-zero elements, not the column index)
+ * @param value the new value of the element
+ */
+void SparseMatrix_CRS::SetElementInRow(crs_col_t row_index, crs_col_t element_index, double value)
 {
-   return col[row[row_index]+element_index];
+   assert(!mapping && "A mapped matrix is read only");
+
+   if(HasPairStorage())
+   {
+      assert(element_index == 0 && "Change the pair table instead");
+      data[row_index] = value;
+   } else
+      data[row[row_index]+element_index] = value;
 }
 
 
@@ -505,56 +1211,170 @@ unsigned int SparseMatrix_CRS::GetElementColIndexInRow(unsigned int row_index, u
  * at least count elements
  * @param count the number of guessed non-zero elements
  */
-void SparseMatrix_CRS::SetGuess(unsigned int count)
+void SparseMatrix_CRS::SetGuess(crs_row_t count)
 {
    data.reserve(count);
    col.reserve(count);
 }
 
 /**
- * Add a bunch of non-overlapping, in order, Sparse Matrices together to the current object (overwriting any
- * previous data). This is used if threads each builded a part of the matrix into seperate 
- * SparseMatrix_CRS objects. After the parallel part, this method builds the final Sparse Matrix.
- * We also assume that the matrices in the list are in order: the first rows first, etc
- * This method is tuned for the DOCIHamiltonian::Build_iter(), it's not general!
- * @warning this means you will have 2 copies of the entire Sparse Matrix in memory during this
- * method.
- * @param list the list of pointer to the Sparse Matrices
+ * Set up the complete structure of the matrix for the given row pointers, so that
+ * the rows can be filled in any order with FillElementInRow() or FillPairInRow()
+ * instead of with NewRow() and PushToRowNext(). Nothing has to grow or be merged
+ * afterwards. The arrays are first touched by the threads in the same
+ * distribution as in mvprod(), so on a NUMA machine every thread finds its
+ * part of the matrix in local memory (or interleaved over all nodes, see
+ * helpers::GetNumaPolicy()). Any previous data is released.
+ * @param row_ptr the row pointers: row i has row_ptr[i+1]-row_ptr[i] elements, size n+1
+ * @param pairs prepare for pair storage: store pair indices and only the diagonal in data
+ * @param full both triangles will be stored instead of only the upper diagonal part
  */
-void SparseMatrix_CRS::AddList(std::vector< std::unique_ptr<SparseMatrix_CRS> > &list)
+void SparseMatrix_CRS::Allocate(std::vector<crs_row_t> row_ptr, bool pairs, bool full)
 {
-   unsigned int total_size = 0;
+   assert(row_ptr.size() == (n+1) && row_ptr.front() == 0);
 
-   for(auto& smat : list)
-      total_size += smat->data.size();
+   // free the old arrays before allocating the new ones
+   decltype(data)().swap(data);
+   decltype(col)().swap(col);
+   decltype(pair)().swap(pair);
+   pair_table.clear();
 
-   data.reserve(total_size);
-   col.reserve(total_size);
+   mapping.reset();
+   row = std::move(row_ptr);
+   this->full = full;
 
-   data.clear();
-   col.clear();
+   data.resize(pairs ? n : row.back());
+   col.resize(row.back());
+   if(pairs)
+      pair.resize(row.back());
 
-   row.reserve(n+1);
-   row.clear();
+   const auto policy = GetNumaPolicy();
 
-   for(auto &smat: list)
+   if(policy == NumaPolicy::Interleave)
    {
-      auto prev_start = data.size();
+      NumaInterleave(data.data(), data.size() * sizeof(double));
+      NumaInterleave(col.data(), col.size() * sizeof(crs_col_t));
+      NumaInterleave(pair.data(), pair.size() * sizeof(unsigned short));
+   }
 
-      data.insert(data.end(), smat->data.begin(), smat->data.end());
-      col.insert(col.end(), smat->col.begin(), smat->col.end());
+   const int num_t = (policy == NumaPolicy::Off) ? 1 : omp_get_max_threads();
+   const auto part = RowPartition(num_t);
 
-      for(unsigned int i=0;i<smat->row.size();++i)
-         row.push_back(prev_start + smat->row[i]);
+   // every piece of rows is touched by the thread that multiplies with it in mvprod()
+#pragma omp parallel for schedule(static)
+   for(int t=0;t<num_t;t++)
+   {
+      const auto begin = row[part[t]];
+      const auto end = row[part[t+1]];
+
+      std::fill(col.begin() + begin, col.begin() + end, 0);
 
-      smat.reset();
+      if(pairs)
+      {
+         std::fill(data.begin() + part[t], data.begin() + part[t+1], 0.0);
+         std::fill(pair.begin() + begin, pair.begin() + end, 0);
+      }
+      else
+         std::fill(data.begin() + begin, data.begin() + end, 0.0);
    }
+}
 
-   assert(data.size() == total_size);
-   assert(col.size() == total_size);
-   assert(row.size() == n);
+/**
+ * Set an element of a matrix after Allocate(). The rows do not have to be filled
+ * in order, but every row should start with the diagonal (also when the full matrix
+ * is stored) and the other columns should increase with element_index. A full matrix
+ * can also hold a block of rows of a larger matrix, with the column indices of the
+ * larger matrix: the diagonal is then not in column row_index.
+ * @param row_index the number of the row
+ * @param element_index the index of the element (index of the non-zero elements, not the column index)
+ * @param j the column of the element
+ * @param value the value of the element
+ */
+void SparseMatrix_CRS::FillElementInRow(crs_col_t row_index, crs_col_t element_index, crs_col_t j, double value)
+{
+   assert(element_index < NumOfElInRow(row_index));
+
+   col[row[row_index]+element_index] = j;
+
+   if(pair.empty())
+      data[row[row_index]+element_index] = value;
+   else
+   {
+      assert(element_index == 0 && "Use FillPairInRow() for the off-diagonal elements");
+      data[row_index] = value;
+   }
+}
+
+/**
+ * Set an off-diagonal element of a matrix after Allocate() with pairs,
+ * see FillElementInRow() and PushPairToRowNext()
+ * @param row_index the number of the row
+ * @param element_index the index of the element (index of the non-zero elements, not the column index)
+ * @param j the column of the element
+ * @param idx the index of the value in the pair table (see SetPairTable())
+ */
+void SparseMatrix_CRS::FillPairInRow(crs_col_t row_index, crs_col_t element_index, crs_col_t j, unsigned short idx)
+{
+   assert(!pair.empty() && element_index > 0 && element_index < NumOfElInRow(row_index));
+
+   col[row[row_index]+element_index] = j;
+   pair[row[row_index]+element_index] = idx;
+}
+
+/**
+ * @return on which NUMA nodes the elements of the matrix are (see helpers::NumaPlacement())
+ */
+std::string SparseMatrix_CRS::Placement() const
+{
+   return NumaPlacement(ColPtr(), NumOfEl() * sizeof(crs_col_t));
+}
 
-   row.push_back(data.size());
+/**
+ * Switch to pair storage: the values of the off-diagonal elements are taken
+ * from the table, using the indices that were stored with PushPairToRowNext().
+ * Only the table has to be replaced when these values change, also in a mapped
+ * matrix (see MapBinaryFile()): the table is always kept in memory.
+ * @param table the values that belong to the pair indices
+ */
+void SparseMatrix_CRS::SetPairTable(std::vector<double> table)
+{
+   assert(DataSize() == n && "Only the diagonal should be in data");
+
+   // rows without off-diagonal elements did not add pair indices
+   if(!mapping)
+      pair.resize(col.size(), 0);
+
+   pair_table = std::move(table);
+}
+
+/**
+ * @return true if the matrix uses pair storage (see SetPairTable())
+ */
+bool SparseMatrix_CRS::HasPairStorage() const
+{
+   return !pair_table.empty();
+}
+
+/**
+ * @return true if both triangles are stored, false if only the upper diagonal part
+ */
+bool SparseMatrix_CRS::IsFull() const
+{
+   return full;
+}
+
+/**
+ * Get the value of an element
+ * @param i the row of the element
+ * @param k the index of the element in col
+ * @return the value of element k in row i
+ */
+double SparseMatrix_CRS::value(crs_col_t i, crs_row_t k) const
+{
+   if(HasPairStorage())
+      return (k == RowPtr()[i]) ? DataPtr()[i] : pair_table[PairPtr()[k]];
+   else
+      return DataPtr()[k];
 }
 
 /* vim: set ts=3 sw=3 expandtab :*/
@@ -0,0 +1,178 @@
+#include <cstdio>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <assert.h>
+#include <sys/stat.h>
+#include "SparseMatrix_OOC.h"
+
+using namespace helpers;
+
+/**
+ * Construct an empty out-of-core matrix, add the rows with AddBlock()
+ * @param n the number of rows/columns
+ * @param prefix the start of the names of the files of the blocks (e.g. a directory and a name)
+ */
+SparseMatrix_OOC::SparseMatrix_OOC(crs_col_t n, std::string prefix)
+{
+   this->n = n;
+   this->prefix = prefix;
+
+   first_row.push_back(0);
+
+   files.reset(new std::vector<std::string>, [] (std::vector<std::string> *names) {
+         for(auto &name: *names)
+            std::remove(name.c_str());
+
+         delete names;
+         });
+
+   nnz = 0;
+   buffer.assign(2, SparseMatrix_CRS(0));
+
+   bytes_read = 0;
+   read_time = 0;
+   wait_time = 0;
+}
+
+/**
+ * @return the number of rows
+ */
+crs_col_t SparseMatrix_OOC::gn() const
+{
+   return n;
+}
+
+/**
+ * Write the next block of rows to disk. The blocks have to be added in order, until
+ * they cover all n rows, before the first product.
+ * @param block the rows after the previous block: a full matrix (see SparseMatrix_CRS::IsFull())
+ * with the column indices of the whole matrix and every row starting with its diagonal
+ */
+void SparseMatrix_OOC::AddBlock(const SparseMatrix_CRS &block)
+{
+   assert(block.IsFull() && first_row.back() + block.gn() <= n);
+
+   const auto name = prefix + "-" + std::to_string(files->size()) + ".bin";
+
+   if(block.WriteToBinaryFile(name.c_str()))
+      throw std::runtime_error("Could not write the block of rows to " + name);
+
+   files->push_back(name);
+
+   struct stat info;
+
+   if(stat(name.c_str(), &info))
+      throw std::runtime_error("Could not find the size of the block of rows in " + name);
+
+   file_size.push_back(info.st_size);
+
+   first_row.push_back(first_row.back() + block.gn());
+   nnz += block.NumOfEl();
+}
+
+/**
+ * Do the matrix vector product y = A * x, see mvprod_block()
+ * @param x a n component vector
+ * @param y a n component vector, on return will hold A * x
+ */
+void SparseMatrix_OOC::mvprod(const double *x, double *y) const
+{
+   mvprod_block(x, y, 1);
+}
+
+/**
+ * Do the matrix matrix product Y = A * X for nvec interleaved vectors (element i of
+ * vector v at i*nvec+v, see SparseMatrix_CRS::mvprod_block()). Every block is read
+ * once for all vectors, so the I/O per vector goes down with nvec. While the threads
+ * multiply with a block, the next one is read in the background.
+ * @warning not thread safe: the blocks in memory are shared by all calls on this object
+ * @param x n x nvec matrix, the vectors to multiply with (interleaved)
+ * @param y n x nvec matrix, on return will hold A * X (interleaved)
+ * @param nvec the number of vectors, at most SparseMatrix_CRS::max_block
+ */
+void SparseMatrix_OOC::mvprod_block(const double *x, double *y, unsigned int nvec) const
+{
+   assert(first_row.back() == n && "Add all rows before the product");
+
+   const auto n_blocks = NumOfBlocks();
+
+   // read block b in the buffer that is not used for block b-1, returns the time it took
+   auto read = [this] (unsigned int b) -> double {
+      auto start = std::chrono::high_resolution_clock::now();
+
+      if(buffer[b%2].ReadFromBinaryFile((*files)[b].c_str()))
+         throw std::runtime_error("Could not read the block of rows from " + (*files)[b]);
+
+      auto end = std::chrono::high_resolution_clock::now();
+
+      return std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count();
+   };
+
+   std::future<double> next;
+
+   if(n_blocks > 0)
+      next = std::async(std::launch::async, read, 0);
+
+   for(unsigned int b=0;b<n_blocks;b++)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+
+      read_time += next.get();
+
+      auto end = std::chrono::high_resolution_clock::now();
+
+      wait_time += std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count();
+      bytes_read += file_size[b];
+
+      if(b+1 < n_blocks)
+         next = std::async(std::launch::async, read, b+1);
+
+      buffer[b%2].mvprod_block(x, y + static_cast<std::size_t>(first_row[b])*nvec, nvec);
+   }
+}
+
+/**
+ * @return the number of stored non-zero elements in all blocks
+ */
+crs_row_t SparseMatrix_OOC::NumOfEl() const
+{
+   return nnz;
+}
+
+/**
+ * @return the number of blocks of rows (and files)
+ */
+unsigned int SparseMatrix_OOC::NumOfBlocks() const
+{
+   return files->size();
+}
+
+/**
+ * @return the size of all files together in bytes
+ */
+std::size_t SparseMatrix_OOC::FileSize() const
+{
+   std::size_t bytes = 0;
+
+   for(auto size: file_size)
+      bytes += size;
+
+   return bytes;
+}
+
+/**
+ * The I/O of all products with this matrix so far. Take the difference between two
+ * calls to get the I/O of the products in between.
+ * @param bytes on return the number of bytes read
+ * @param read_time on return the time (s) the second thread spent on reading
+ * @param wait_time on return the time (s) the products waited for a block to be read
+ */
+void SparseMatrix_OOC::GetIOStats(std::size_t &bytes, double &read_time, double &wait_time) const
+{
+   bytes = bytes_read;
+   read_time = this->read_time;
+   wait_time = this->wait_time;
+}
+
+/* vim: set ts=3 sw=3 expandtab :*/
@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <numeric>
+#include <climits>
+#include <assert.h>
+#include <omp.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "SparseMatrix_SELL.h"
+
+using namespace helpers;
+
+const unsigned int SparseMatrix_SELL::C;
+
+/**
+ * Convert a symmetric matrix of which the upper diagonal part is stored in
+ * CRS format (every row starting with its diagonal element, as in DOCIHamiltonian).
+ * Works for both the normal and the pair storage of SparseMatrix_CRS. The arrays
+ * are first touched by the threads that use them in mvprod() (see helpers::GetNumaPolicy()).
+ * @param crs the matrix to convert
+ * @param sigma the size of the sorting windows, rounded down to a multiple of C.
+ * Larger windows need less padding but move the rows further from their place.
+ */
+SparseMatrix_SELL::SparseMatrix_SELL(const SparseMatrix_CRS &crs, crs_col_t sigma)
+{
+   n = crs.gn();
+   this->sigma = std::max<crs_col_t>(C, (sigma / C) * C);
+
+   const crs_col_t n_chunks = (n + C - 1) / C;
+
+   // the number of off-diagonal elements of a row
+   auto length = [&crs] (crs_col_t i) -> crs_col_t { return crs.NumOfElInRow(i) - 1; };
+
+   rows.resize(static_cast<std::size_t>(n_chunks) * C);
+   std::iota(rows.begin(), rows.begin() + n, 0);
+
+   const crs_col_t n_windows = (n + this->sigma - 1) / this->sigma;
+
+   // longest rows first, a stable sort keeps equal rows in their order
+#pragma omp parallel for schedule(dynamic)
+   for(crs_col_t w=0;w<n_windows;w++)
+   {
+      const auto begin = std::min<std::size_t>(n, static_cast<std::size_t>(w) * this->sigma);
+      const auto end = std::min<std::size_t>(n, begin + this->sigma);
+
+      std::stable_sort(rows.begin() + begin, rows.begin() + end, [&length] (crs_col_t a, crs_col_t b) { return length(a) > length(b); });
+   }
+
+   // the padding rows of the last chunk repeat its first row, without elements
+   for(std::size_t s=n;s<rows.size();s++)
+      rows[s] = rows[(n_chunks-1)*C];
+
+   // the windows consist of whole chunks: the first row of a chunk is its longest
+   chunk.resize(n_chunks+1);
+   chunk[0] = 0;
+
+   for(crs_col_t c=0;c<n_chunks;c++)
+      chunk[c+1] = chunk[c] + static_cast<crs_row_t>(C) * length(rows[c*C]);
+
+   data.resize(chunk.back());
+   col.resize(chunk.back());
+   diagonal.resize(rows.size());
+
+   const auto policy = GetNumaPolicy();
+
+   if(policy == NumaPolicy::Interleave)
+   {
+      NumaInterleave(data.data(), data.size() * sizeof(double));
+      NumaInterleave(col.data(), col.size() * sizeof(crs_col_t));
+   }
+
+   const int num_t = (policy == NumaPolicy::Off) ? 1 : omp_get_max_threads();
+   const auto part = RowPartition(num_t);
+
+   // every piece of rows is touched by the thread that multiplies with it in mvprod()
+#pragma omp parallel for schedule(static)
+   for(int t=0;t<num_t;t++)
+      for(crs_col_t c=(part[t]+C-1)/C;c<(part[t+1]+C-1)/C;c++)
+      {
+         const auto width = (chunk[c+1] - chunk[c]) / C;
+
+         for(unsigned int s=0;s<C;s++)
+         {
+            const auto slot = static_cast<std::size_t>(c) * C + s;
+            const auto i = rows[slot];
+            const crs_col_t len = (slot < n) ? length(i) : 0;
+
+            assert(slot >= n || crs.GetElementColIndexInRow(i, 0) == i);
+            diagonal[slot] = (slot < n) ? crs.GetElementInRow(i, 0) : 0.0;
+
+            for(crs_row_t p=0;p<width;p++)
+            {
+               const auto k = chunk[c] + p*C + s;
+
+               data[k] = (p < len) ? crs.GetElementInRow(i, p+1) : 0.0;
+               col[k] = (p < len) ? crs.GetElementColIndexInRow(i, p+1) : i;
+            }
+         }
+      }
+}
+
+/**
+ * @return the number of rows
+ */
+crs_col_t SparseMatrix_SELL::gn() const
+{
+   return n;
+}
+
+/**
+ * @return the number of stored off-diagonal elements, including the padding
+ */
+crs_row_t SparseMatrix_SELL::NumOfEl() const
+{
+   return col.size();
+}
+
+/**
+ * Do the matrix vector product y = A * x
+ * @param x a n component vector
+ * @param y a n component vector
+ */
+void SparseMatrix_SELL::mvprod(const double *x, double *y) const
+{
+   mvprod(x, y, 0.0);
+}
+
+/**
+ * Do the matrix vector product y = A * x + beta * y
+ * As in SparseMatrix_CRS::mvprod(), every stored element is used for the
+ * upper (gather) and the lower (scatter) diagonal part, and every piece of
+ * rows accumulates the scatter in its own buffer. The pieces hold whole windows.
+ * @warning not thread safe: the buffers are shared by all calls on this object
+ * @param x a n component vector
+ * @param y a n component vector
+ * @param beta the multiply factor for y
+ */
+void SparseMatrix_SELL::mvprod(const double *x, double *y, double beta) const
+{
+   // the pieces of rows are handed out as in SparseMatrix_CRS::mvprod()
+   const int num_t = omp_get_max_threads();
+
+   // part[t] is the first row of piece t, offset[t] the start of its buffer
+   const auto part = RowPartition(num_t);
+   std::vector<std::size_t> offset(num_t+1, 0);
+
+   for(int t=1;t<num_t;t++)
+      offset[t+1] = offset[t] + (n - part[t]);
+
+   if(mvprod_buffer.size() < offset.back())
+      mvprod_buffer.resize(offset.back());
+
+   // the gathers take signed 32 bit indices
+   const bool simd = (sizeof(crs_col_t) > 4 || n <= static_cast<crs_col_t>(INT_MAX));
+
+   // piece t scatters in acc(t), piece 0 directly in y. Use global row indices in the buffers.
+   auto acc = [&] (int t) -> double * {
+      return (t == 0) ? y : mvprod_buffer.data() + offset[t] - part[t];
+   };
+
+#pragma omp parallel
+   {
+#pragma omp for schedule(static)
+      for(int t=1;t<num_t;t++)
+         std::fill(acc(t) + part[t], acc(t) + n, 0.0);
+
+#pragma omp for schedule(static)
+      for(crs_col_t i=0;i<n;i++)
+         y[i] = (beta == 0.0) ? 0.0 : beta * y[i];
+
+      // the rows of a piece start at a window or at n, which need not be a multiple of C
+#pragma omp for schedule(static)
+      for(int t=0;t<num_t;t++)
+         for(crs_col_t c=(part[t]+C-1)/C;c<(part[t+1]+C-1)/C;c++)
+            mvprod_chunk(c, x, acc(t), simd);
+
+      // add the buffers of the pieces to y
+#pragma omp for schedule(static)
+      for(crs_col_t i=0;i<n;i++)
+         for(int t=1;t<num_t && part[t]<=i;t++)
+            y[i] += mvprod_buffer[offset[t] + i - part[t]];
+   }
+}
+
+/**
+ * Internal method: add the product of one chunk to acc. The C rows of the chunk
+ * gather from x together in a SIMD register. The scatter stays scalar: two rows
+ * in the same chunk can have an element in the same column.
+ * @param c the chunk
+ * @param x the vector to multiply with
+ * @param acc the vector to add to
+ * @param simd use the AVX2/AVX-512 gathers (if compiled in)
+ */
+void SparseMatrix_SELL::mvprod_chunk(crs_col_t c, const double *x, double *acc, bool simd) const
+{
+   const auto *r = &rows[static_cast<std::size_t>(c)*C];
+   const auto *val = data.data() + chunk[c];
+   const auto *idx = col.data() + chunk[c];
+   const auto width = (chunk[c+1] - chunk[c]) / C;
+
+   double x_r[C], tmp[C];
+
+   for(unsigned int s=0;s<C;s++)
+   {
+      x_r[s] = x[r[s]];
+      tmp[s] = 0;
+   }
+
+   auto scatter = [&] (crs_row_t p) {
+      for(unsigned int s=0;s<C;s++)
+         acc[idx[p*C+s]] += val[p*C+s] * x_r[s];
+   };
+
+#if defined(__AVX512F__)
+   if(simd)
+   {
+      // the masked gathers with an explicit source avoid a false warning of gcc
+      const __m512d zero = _mm512_setzero_pd();
+      __m512d t = zero;
+
+      for(crs_row_t p=0;p<width;p++)
+      {
+#if defined(CRS_64BIT_COL)
+         const __m512i j = _mm512_loadu_si512(idx + p*C);
+         const __m512d x_j = _mm512_mask_i64gather_pd(zero, 0xFF, j, x, 8);
+#else
+         const __m256i j = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + p*C));
+         const __m512d x_j = _mm512_mask_i32gather_pd(zero, 0xFF, j, x, 8);
+#endif
+         t = _mm512_fmadd_pd(_mm512_loadu_pd(val + p*C), x_j, t);
+
+         scatter(p);
+      }
+
+      _mm512_storeu_pd(tmp, t);
+   } else
+#elif defined(__AVX2__)
+   if(simd)
+   {
+      // two vectors of 4 rows, see above for the masked gathers
+      const __m256d zero = _mm256_setzero_pd();
+      const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+      __m256d t0 = zero;
+      __m256d t1 = zero;
+
+      for(crs_row_t p=0;p<width;p++)
+      {
+#if defined(CRS_64BIT_COL)
+         const __m256i j0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + p*C));
+         const __m256i j1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + p*C + 4));
+         const __m256d x_j0 = _mm256_mask_i64gather_pd(zero, x, j0, all, 8);
+         const __m256d x_j1 = _mm256_mask_i64gather_pd(zero, x, j1, all, 8);
+#else
+         const __m128i j0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(idx + p*C));
+         const __m128i j1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(idx + p*C + 4));
+         const __m256d x_j0 = _mm256_mask_i32gather_pd(zero, x, j0, all, 8);
+         const __m256d x_j1 = _mm256_mask_i32gather_pd(zero, x, j1, all, 8);
+#endif
+#if defined(__FMA__)
+         t0 = _mm256_fmadd_pd(_mm256_loadu_pd(val + p*C), x_j0, t0);
+         t1 = _mm256_fmadd_pd(_mm256_loadu_pd(val + p*C + 4), x_j1, t1);
+#else
+         t0 = _mm256_add_pd(t0, _mm256_mul_pd(_mm256_loadu_pd(val + p*C), x_j0));
+         t1 = _mm256_add_pd(t1, _mm256_mul_pd(_mm256_loadu_pd(val + p*C + 4), x_j1));
+#endif
+
+         scatter(p);
+      }
+
+      _mm256_storeu_pd(tmp, t0);
+      _mm256_storeu_pd(tmp + 4, t1);
+   } else
+#endif
+   {
+      // without SIMD gathers: leave the vectorization to the compiler
+      for(crs_row_t p=0;p<width;p++)
+      {
+         for(unsigned int s=0;s<C;s++)
+            tmp[s] += val[p*C+s] * x[idx[p*C+s]];
+
+         scatter(p);
+      }
+   }
+
+   const auto first = static_cast<std::size_t>(c) * C;
+
+   for(unsigned int s=0;s<C && first+s<n;s++)
+      acc[r[s]] += tmp[s] + diagonal[first+s] * x_r[s];
+}
+
+/**
+ * Split the rows over a number of threads in whole sorting windows, so
+ * that every thread gets (about) the same number of stored elements
+ * @param num_t the number of threads
+ * @return the first row of every thread, followed by n (size num_t+1)
+ */
+std::vector<crs_col_t> SparseMatrix_SELL::RowPartition(int num_t) const
+{
+   std::vector<crs_col_t> part(num_t+1);
+
+   const crs_col_t chunks_per_window = sigma / C;
+
+   part.front() = 0;
+   part.back() = n;
+
+   for(int t=1;t<num_t;t++)
+   {
+      const crs_row_t target = (chunk.back()*t)/num_t;
+      const crs_col_t c = std::lower_bound(chunk.begin(), chunk.end()-1, target) - chunk.begin();
+      const auto w = (c + chunks_per_window - 1) / chunks_per_window;
+
+      part[t] = std::min<std::size_t>(n, static_cast<std::size_t>(w) * sigma);
+   }
+
+   return part;
+}
+
+/**
+ * @return on which NUMA nodes the elements of the matrix are (see helpers::NumaPlacement())
+ */
+std::string SparseMatrix_SELL::Placement() const
+{
+   return NumaPlacement(col.data(), col.size() * sizeof(crs_col_t));
+}
+
+/* vim: set ts=3 sw=3 expandtab :*/
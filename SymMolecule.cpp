@@ -1,5 +1,8 @@
 #include <iostream>
+#include <string>
+#include <stdexcept>
 #include <assert.h>
+#include <hdf5.h>
 
 #include "SymMolecule.h"
 // From CIFLOW 
@@ -10,7 +13,7 @@ doci::Sym_Molecule::Sym_Molecule(std::string filename) : ham(nullptr)
    ham.reset(new CheMPS2::Hamiltonian(CheMPS2::Hamiltonian::CreateFromH5(filename)));
 }
 
-doci::Sym_Molecule::Sym_Molecule(const Sym_Molecule &orig)
+doci::Sym_Molecule::Sym_Molecule(const Sym_Molecule &orig) : Molecule(orig)
 {
    ham.reset(new CheMPS2::Hamiltonian(*orig.ham));
 }
@@ -74,4 +77,67 @@ CheMPS2::Hamiltonian& doci::Sym_Molecule::getHamObject()
    return *ham;
 }
 
+/**
+ * Read only the number of orbitals and electrons from an integrals file,
+ * without the integrals themselves (e.g. to plan a calculation)
+ * @throw std::runtime_error when the file or one of the values can not be read
+ * @param filename the HDF5 file with the integrals (see Sym_Molecule(std::string))
+ * @param L on return the number of orbitals
+ * @param N on return the number of electrons
+ */
+void doci::Sym_Molecule::ReadHeader(std::string filename, unsigned int &L, unsigned int &N)
+{
+   int L_file = 0, N_file = 0;
+
+   hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+   if(file_id < 0)
+      throw std::runtime_error("Cannot open " + filename);
+
+   // the first thing that went wrong, empty if all is well
+   std::string error;
+
+   hid_t group_id = H5Gopen(file_id, "/Data", H5P_DEFAULT);
+   if(group_id < 0)
+      error = "Cannot open the group /Data in " + filename;
+
+   // read one integer from /Data
+   auto read_int = [&error,&filename,group_id] (const char *name, int &value) {
+      if(!error.empty())
+         return;
+
+      hid_t dataset_id = H5Dopen(group_id, name, H5P_DEFAULT);
+      if(dataset_id < 0)
+      {
+         error = std::string("Cannot open /Data/") + name + " in " + filename;
+         return;
+      }
+
+      herr_t status = H5Dread(dataset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &value);
+      if(status < 0)
+         error = std::string("Cannot read /Data/") + name + " from " + filename;
+
+      status = H5Dclose(dataset_id);
+      if(status < 0 && error.empty())
+         error = std::string("Cannot close /Data/") + name + " in " + filename;
+   };
+
+   read_int("L", L_file);
+   read_int("nelectrons", N_file);
+
+   if(group_id >= 0 && H5Gclose(group_id) < 0 && error.empty())
+      error = "Cannot close the group /Data in " + filename;
+
+   if(H5Fclose(file_id) < 0 && error.empty())
+      error = "Cannot close " + filename;
+
+   if(error.empty() && (L_file <= 0 || N_file < 0 || N_file > 2*L_file))
+      error = "Invalid number of orbitals (" + std::to_string(L_file) + ") or electrons (" + std::to_string(N_file) + ") in " + filename;
+
+   if(!error.empty())
+      throw std::runtime_error(error);
+
+   L = L_file;
+   N = N_file;
+}
+
 /* vim: set ts=3 sw=3 expandtab :*/
@@ -19,13 +19,22 @@ along with DOCI-Exact.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 #include <chrono>
 #include <getopt.h>
+#include <limits>
+#include <stdexcept>
+#include <omp.h>
+
+#ifdef MPI
+#include <mpi.h>
+#endif
 
 #include "Permutation.h"
 #include "Molecule.h"
 #include "DOCIHamtilonian.h"
 #include "DM2.h"
+#include "DistributedHamiltonian.h"
 
 // comment out if you don't need it
 #include "SymMolecule.h"
@@ -47,12 +56,215 @@ along with DOCI-Exact.  If not, see <http://www.gnu.org/licenses/>.
  * @copyright GNU Public License v3
  */
 
+/**
+ * Predict the cost of a DOCI calculation without doing it: only the number of
+ * orbitals and electrons are read from the integrals file. We print the exact
+ * dimension and number of non-zero elements, the memory of every storage mode
+ * and eigensolver, and the run time of the build and of one matrix-vector product,
+ * extrapolated from a sample of the rows with the current number of OpenMP threads.
+ * The number of sampled rows can be set with the DOCI_PLAN_ROWS environment variable.
+ * @param integralsfile the HDF5 file with the integrals
+ * @param states the number of energy levels to calculate
+ * @return the exit code for main()
+ */
+int plan_run(const std::string &integralsfile, int states)
+{
+    using namespace doci;
+    using std::cout;
+    using std::endl;
+
+    unsigned int L, N;
+
+    try
+    {
+        Sym_Molecule::ReadHeader(integralsfile, L, N);
+    } catch(std::runtime_error &err)
+    {
+        cout << err.what() << endl;
+        return 1;
+    }
+
+    cout << "Planning: " << integralsfile << endl;
+    cout << "L = " << L << "  N = " << N << endl;
+
+    if(N % 2 != 0 || N/2 > L)
+    {
+        cout << "We need an even number of electrons, with at most 2 per orbital!" << endl;
+        return 1;
+    }
+
+    if(L > Permutation::getMax())
+    {
+        cout << "Too many orbitals: the bitsets only hold " << Permutation::getMax() << " orbitals, compile with a wider type (e.g. -DUSEINT128)" << endl;
+        return 1;
+    }
+
+    const unsigned int n_pairs = N/2;
+
+    unsigned long long dim, nnz;
+
+    try
+    {
+        dim = Permutation::CalcCombinations(L, n_pairs);
+        nnz = DOCIHamiltonian::CountNonZero(L, n_pairs);
+    } catch(std::overflow_error &err)
+    {
+        cout << "The hamiltonian is too large: " << err.what() << endl;
+        return 1;
+    }
+
+    cout << "Dimension = " << dim << endl;
+    cout << "Non-zero elements (upper diagonal part) = " << nnz << endl;
+
+    if(dim > std::numeric_limits<crs_col_t>::max())
+        cout << "The sparse matrix needs more than 32 bit column indices, compile with -DCRS_64BIT_COL or use --matrix-free" << endl;
+
+    const double GB = 1024.0*1024.0*1024.0;
+
+    cout << "Threads = " << omp_get_max_threads() << endl;
+    cout << "States = " << states << endl;
+    cout << std::fixed << std::setprecision(3);
+    cout << "Memory CRS = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::CRS) / GB << " GB" << endl;
+    cout << "Memory CRS (full matrix) = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::CRS, DOCIHamiltonian::Pattern::Full) / GB << " GB" << endl;
+    cout << "Memory compressed = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::PairCRS) / GB << " GB" << endl;
+    cout << "Memory compressed (full matrix) = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::PairCRS, DOCIHamiltonian::Pattern::Full) / GB << " GB" << endl;
+    cout << "Memory sliced ELL = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::SELL) / GB << " GB" << endl;
+    cout << "Memory matrix-free = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::MatrixFree) / GB << " GB" << endl;
+    cout << "Memory out-of-core = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::OutOfCore) / GB << " GB" << endl;
+    cout << "Disk out-of-core = " << DOCIHamiltonian::MemoryUsage(L, n_pairs, DOCIHamiltonian::Storage::PairCRS, DOCIHamiltonian::Pattern::Full) / GB << " GB" << endl;
+    cout << "Memory ARPACK = " << DOCIHamiltonian::SolverMemory(dim, DOCIHamiltonian::Solver::Arpack, states) / GB << " GB" << endl;
+    cout << "Memory Davidson = " << DOCIHamiltonian::SolverMemory(dim, DOCIHamiltonian::Solver::Davidson, states) / GB << " GB" << endl;
+    cout << "Memory mixed precision Davidson = " << DOCIHamiltonian::SolverMemory(dim, DOCIHamiltonian::Solver::MixedDavidson, states) / GB << " GB" << endl;
+
+    unsigned long long n_rows = 100000;
+
+    const char *plan_rows = getenv("DOCI_PLAN_ROWS");
+
+    if(plan_rows && !helpers::ParseCount(plan_rows, n_rows))
+    {
+        cout << "Invalid DOCI_PLAN_ROWS=" << plan_rows << ": should be a positive number of rows" << endl;
+        return 1;
+    }
+
+    double build, spmv, sigma;
+    DOCIHamiltonian::Calibrate(L, n_pairs, n_rows, build, spmv, sigma);
+
+    cout << "Estimated build time = " << build << " s" << endl;
+    cout << "Estimated matrix-vector product (CRS) = " << spmv << " s" << endl;
+    cout << "Estimated matrix-vector product (matrix-free) = " << sigma << " s" << endl;
+
+    return 0;
+}
+
+/**
+ * Check that the full hamiltonian (see -F) and the work space of the eigensolver
+ * fit in 80% of the available memory (see helpers::AvailableMemory()), and store
+ * only the upper diagonal part when they do not. The full matrix has a matrix-vector
+ * product without scatter and private buffers per thread, but needs about twice the
+ * memory (and bandwidth).
+ * @param ham the hamiltonian with the storage and solver already set, on return
+ * with the pattern to use
+ * @param states the number of energy levels to calculate
+ */
+void check_full_memory(doci::DOCIHamiltonian &ham, int states)
+{
+    using namespace doci;
+    using std::cout;
+    using std::endl;
+
+    ham.SetPattern(DOCIHamiltonian::Pattern::Full);
+
+    // only the (compressed) sparse matrix can hold the full matrix in memory
+    if(ham.GetStorage() != DOCIHamiltonian::Storage::CRS && ham.GetStorage() != DOCIHamiltonian::Storage::PairCRS)
+        return;
+
+    const auto L = ham.getMolecule().get_n_sp();
+    const auto n_pairs = ham.getMolecule().get_n_electrons()/2;
+
+    const auto needed = DOCIHamiltonian::MemoryUsage(L, n_pairs, ham.GetStorage(), DOCIHamiltonian::Pattern::Full) + DOCIHamiltonian::SolverMemory(ham.getdim(), ham.GetSolver(), states, DOCIHamiltonian::Pattern::Full);
+    const auto available = helpers::AvailableMemory();
+
+    const double GB = 1024.0*1024.0*1024.0;
+
+    if(available > 0 && needed >= 0.8 * available)
+    {
+        cout << "The full matrix needs " << needed / GB << " GB of " << available / GB << " GB available, storing the upper diagonal part instead" << endl;
+        ham.SetPattern(DOCIHamiltonian::Pattern::Upper);
+    }
+}
+
+#ifdef MPI
+/**
+ * The lowest energy levels with the hamiltonian spread over all MPI ranks
+ * (see DistributedHamiltonian). Every rank keeps only its block of the
+ * eigenvectors, so there is no 2DM.
+ * @param mol the molecule to use
+ * @param solver the eigensolver, ARPACK is replaced by Davidson
+ * @param states the number of energy levels to calculate
+ * @return the exit code of the program
+ */
+int distributed_run(const doci::Molecule &mol, doci::DOCIHamiltonian::Solver solver, int states)
+{
+    using namespace doci;
+    using std::cout;
+    using std::endl;
+
+    DistributedHamiltonian ham(mol);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if(solver == DOCIHamiltonian::Solver::Arpack && rank == 0)
+        cout << "ARPACK does not work on a distributed hamiltonian, using the Davidson eigensolver" << endl;
+
+    ham.SetSolver(solver);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    ham.Build();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if(rank == 0)
+        cout << "Building took: " << std::fixed << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << endl;
+
+    start = std::chrono::high_resolution_clock::now();
+    auto energies = ham.CalcEnergy(states);
+    end = std::chrono::high_resolution_clock::now();
+
+    if(rank == 0)
+    {
+        cout << "Diagonalization took: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << endl;
+
+        if(states > 1)
+        {
+            cout << "Energy levels:" << endl;
+            for(size_t i=0;i<energies.size();i++)
+                cout << i << "\t" << energies[i] + mol.get_nucl_rep() << endl;
+        }
+
+        cout << "E = " << energies[0] + mol.get_nucl_rep() << endl;
+        cout << "No 2DM with a distributed eigenvector" << endl;
+    }
+
+    return 0;
+}
+#endif
+
 int main(int argc, char **argv)
 {
     using namespace doci;
     using std::cout;
     using std::endl;
 
+#ifdef MPI
+    MPI_Init(&argc, &argv);
+
+    // finalize MPI on every way out of main
+    struct MPIFinalize
+    {
+        ~MPIFinalize() { MPI_Finalize(); }
+    } mpi_finalize;
+#endif
+
     cout.precision(10);
 
     std::string integralsfile = "mo-integrals.h5";
@@ -61,6 +273,17 @@ int main(int argc, char **argv)
     bool simanneal = false;
     bool jacobirots = false;
     bool random = false;
+    bool compressed = false;
+    bool sliced = false;
+    bool matrixfree = false;
+    bool outofcore = false;
+    bool davidson = false;
+    bool mixed = false;
+    bool plan = false;
+    bool reorder = false;
+    bool full = false;
+    int states = 1;
+    std::string cache;
 
     struct option long_options[] =
     {
@@ -70,13 +293,24 @@ int main(int argc, char **argv)
         {"simulated-annealing",  no_argument, 0, 's'},
         {"jacobi-rotations",  no_argument, 0, 'j'},
         {"random",  no_argument, 0, 'r'},
+        {"compressed",  no_argument, 0, 'c'},
+        {"sliced-ell",  no_argument, 0, 'l'},
+        {"matrix-free",  no_argument, 0, 'm'},
+        {"out-of-core",  no_argument, 0, 'O'},
+        {"davidson",  no_argument, 0, 'd'},
+        {"mixed",  no_argument, 0, 'x'},
+        {"plan",  no_argument, 0, 'p'},
+        {"reorder",  no_argument, 0, 'R'},
+        {"full",  no_argument, 0, 'F'},
+        {"states",  required_argument, 0, 'n'},
+        {"cache",  required_argument, 0, 'C'},
         {"help",  no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
 
     int i,j;
 
-    while( (j = getopt_long (argc, argv, "hi:o:su:jr", long_options, &i)) != -1)
+    while( (j = getopt_long (argc, argv, "hi:o:su:jrclmOdxpRFn:C:", long_options, &i)) != -1)
         switch(j)
         {
             case 'h':
@@ -89,6 +323,17 @@ int main(int argc, char **argv)
                     "    -j, --jacobi-rotations          Use Jacobi Rotations to find lowest energy\n"
                     "    -u, --unitary                   Use this unitary to calc energy\n"
                     "    -r, --random                    Use a random unitary as start point\n"
+                    "    -c, --compressed                Store a pair index instead of a value for every element\n"
+                    "    -l, --sliced-ell                Store the hamiltonian in sliced ELLPACK format for a SIMD matrix-vector product (experimental)\n"
+                    "    -m, --matrix-free               Do not store the hamiltonian, recalculate it in every iteration\n"
+                    "    -O, --out-of-core               Keep the hamiltonian on disk (in DOCI_OOC_DIR) and read it back in every iteration\n"
+                    "    -d, --davidson                  Use the Davidson eigensolver instead of ARPACK\n"
+                    "    -x, --mixed                     Use the Davidson eigensolver with single precision vectors\n"
+                    "    -p, --plan                      Only predict the memory usage and run time, and exit\n"
+                    "    -R, --reorder                   Reorder the basis (reverse Cuthill-McKee) for the matrix-vector product\n"
+                    "    -F, --full                      Store the full matrix instead of the upper diagonal part (if it fits in memory)\n"
+                    "    -n, --states=number             Calculate the number lowest energy levels (default: 1)\n"
+                    "    -C, --cache=directory           Reuse the hamiltonian of an earlier run with the same integrals from this directory\n"
                     "    -h, --help                      Display this help\n"
                     "\n";
                 return 0;
@@ -111,6 +356,39 @@ int main(int argc, char **argv)
             case 'u':
                 unitary = optarg;
                 break;
+            case 'c':
+                compressed = true;
+                break;
+            case 'l':
+                sliced = true;
+                break;
+            case 'm':
+                matrixfree = true;
+                break;
+            case 'O':
+                outofcore = true;
+                break;
+            case 'd':
+                davidson = true;
+                break;
+            case 'x':
+                mixed = true;
+                break;
+            case 'p':
+                plan = true;
+                break;
+            case 'R':
+                reorder = true;
+                break;
+            case 'F':
+                full = true;
+                break;
+            case 'n':
+                states = std::max(1, std::stoi(optarg));
+                break;
+            case 'C':
+                cache = optarg;
+                break;
         }
 
     if(simanneal && jacobirots)
@@ -120,6 +398,32 @@ int main(int argc, char **argv)
         return 2;
     }
 
+    int mpi_rank = 0;
+
+#ifdef MPI
+    int mpi_size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+
+    // the optimizers rebuild the whole hamiltonian on every rank
+    if(mpi_size > 1 && (simanneal || jacobirots))
+    {
+        if(mpi_rank == 0)
+            cout << "Simulated annealing and jacobi rotations run on a single MPI rank only" << endl;
+
+        return 2;
+    }
+
+    // the distributed hamiltonian always keeps full rows with pair indices in memory (as -c -F)
+    if(mpi_size > 1 && (sliced || matrixfree || outofcore || reorder || !cache.empty()))
+    {
+        if(mpi_rank == 0)
+            cout << "The storage options -l, -m, -O, -R and -C run on a single MPI rank only" << endl;
+
+        return 2;
+    }
+#endif
+
 
     if(getenv("SAVE_H5_PATH"))
     {
@@ -130,13 +434,17 @@ int main(int argc, char **argv)
         // This will not overwrite an already set SAVE_H5_PATH
         setenv("SAVE_H5_PATH", "./", 0);
 
-    cout << "Reading: " << integralsfile << endl;
+    if(plan)
+        return plan_run(integralsfile, states);
+
+    if(mpi_rank == 0)
+        cout << "Reading: " << integralsfile << endl;
     Sym_Molecule mol(integralsfile);
     auto& ham_ints = mol.getHamObject();
 
     if(random)
     {
-        if(!unitary.empty())
+        if(!unitary.empty() && mpi_rank == 0)
             cout << "Overriding the input unitary " << unitary << " with a random unitary!" << endl;
 
         const simanneal::OptIndex opt(ham_ints);
@@ -144,8 +452,11 @@ int main(int argc, char **argv)
         simanneal::UnitaryMatrix X(opt);
         X.fill_random();
         X.make_skew_symmetric();
-        cout << "U=exp(X), X=" << endl;
-        X.print_unitary();
+
+#ifdef MPI
+        // all ranks have to start from the same point: take the one of rank 0
+        X.sendreceive(0);
+#endif
 
         simanneal::OrbitalTransform orbtrans(ham_ints);
         orbtrans.update_unitary(X, false);
@@ -153,17 +464,32 @@ int main(int argc, char **argv)
         std::string filename = getenv("SAVE_H5_PATH");
         filename += "/random-start-unitary.h5";
 
-        orbtrans.get_unitary().saveU(filename);
+        if(mpi_rank == 0)
+        {
+            cout << "U=exp(X), X=" << endl;
+            X.print_unitary();
+
+            orbtrans.get_unitary().saveU(filename);
+
+            cout << "Saving random start point to " << filename << endl;
+        }
 
-        cout << "Saving random start point to " << filename << endl;
-        unitary = filename;
+        if(simanneal || jacobirots)
+            unitary = filename;
+        else
+        {
+            // rotate the integrals here: the other ranks need not see the file
+            orbtrans.fillHamCI(ham_ints);
+            unitary.clear();
+        }
     }
 
     if(!simanneal && !jacobirots)
     {
         if(!unitary.empty())
         {
-            cout << "Reading unitary " << unitary << endl;
+            if(mpi_rank == 0)
+                cout << "Reading unitary " << unitary << endl;
 
             simanneal::OrbitalTransform orbtrans(ham_ints);
 
@@ -171,26 +497,65 @@ int main(int argc, char **argv)
             orbtrans.fillHamCI(ham_ints);
         }
 
+#ifdef MPI
+        // more than one rank: spread the hamiltonian over all of them
+        if(mpi_size > 1)
+            return distributed_run(mol, mixed ? DOCIHamiltonian::Solver::MixedDavidson : (davidson ? DOCIHamiltonian::Solver::Davidson : DOCIHamiltonian::Solver::Arpack), states);
+#endif
+
         DOCIHamiltonian ham(mol);
 
+        if(matrixfree)
+            ham.SetStorage(DOCIHamiltonian::Storage::MatrixFree);
+        else if(outofcore)
+            ham.SetStorage(DOCIHamiltonian::Storage::OutOfCore);
+        else if(compressed)
+            ham.SetStorage(DOCIHamiltonian::Storage::PairCRS);
+        else if(sliced)
+            ham.SetStorage(DOCIHamiltonian::Storage::SELL);
+
+        if(mixed)
+            ham.SetSolver(DOCIHamiltonian::Solver::MixedDavidson);
+        else if(davidson)
+            ham.SetSolver(DOCIHamiltonian::Solver::Davidson);
+
+        if(reorder)
+            ham.SetOrdering(DOCIHamiltonian::Ordering::RCM);
+
+        if(full)
+            check_full_memory(ham, states);
+
         auto start = std::chrono::high_resolution_clock::now();
-        ham.Build();
+
+        if(cache.empty() || !ham.ReadFromCache(cache))
+        {
+            ham.Build();
+
+            if(!cache.empty())
+                ham.SaveToCache(cache);
+        }
+
         auto end = std::chrono::high_resolution_clock::now();
 
         cout << "Building took: " << std::fixed << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << endl;
 
         start = std::chrono::high_resolution_clock::now();
-        auto eig2 = ham.Diagonalize();
-//        auto eig3 = ham.CalcEnergy(5);
+        auto eig2 = ham.Diagonalize(states);
         end = std::chrono::high_resolution_clock::now();
 
         cout << "Diagonalization took: " << std::chrono::duration_cast<std::chrono::duration<double,std::ratio<1>>>(end-start).count() << " s" << endl;
 
-//        cout << "Energy levels:" << endl;
-//        for(auto i=0;i<eig3.size();i++)
-//            cout << i << "\t" << eig3[i] + mol.get_nucl_rep() << endl;
+        if(states > 1)
+        {
+            cout << "Energy levels:" << endl;
+            for(size_t i=0;i<eig2.first.size();i++)
+                cout << i << "\t" << eig2.first[i] + mol.get_nucl_rep() << endl;
+        }
+
+        cout << "E = " << eig2.first[0] + mol.get_nucl_rep() << endl;
 
-        cout << "E = " << eig2.first + mol.get_nucl_rep() << endl;
+        // the 2DM of the ground state
+        eig2.second.resize(ham.getdim());
 
         DM2 rdm(mol);
         auto perm = ham.getPermutation();
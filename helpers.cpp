@@ -17,10 +17,23 @@
    */
 
 #include <iostream>
+#include <fstream>
+#include <limits>
 #include <algorithm>
 #include <sstream>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <map>
 #include <assert.h>
 #include <hdf5.h>
+#include <omp.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "helpers.h"
 #include "lapack.h"
@@ -367,4 +380,265 @@ void matrix::ReadFromFile(std::string filename) const
     HDF5_STATUS_CHECK(status);
 }
 
+/**
+ * The NUMA placement policy, from the environment variable DOCI_NUMA:
+ * "off", "first-touch" (the default) or "interleave"
+ * @return the policy to use
+ */
+NumaPolicy helpers::GetNumaPolicy()
+{
+    const char *env = getenv("DOCI_NUMA");
+
+    if(!env || !strcmp(env, "first-touch"))
+        return NumaPolicy::FirstTouch;
+    else if(!strcmp(env, "interleave"))
+        return NumaPolicy::Interleave;
+    else if(!strcmp(env, "off"))
+        return NumaPolicy::Off;
+
+    std::cerr << "Unknown DOCI_NUMA=" << env << ", using first-touch" << std::endl;
+
+    return NumaPolicy::FirstTouch;
+}
+
+/**
+ * Print the diagnostics of the performance work (timings of the matrix-vector
+ * product, placement of the arrays on the NUMA nodes), which cost extra time:
+ * set the environment variable DOCI_DIAGNOSTICS to anything but "0"
+ * @return true if the diagnostics should be printed
+ */
+bool helpers::Diagnostics()
+{
+    const char *env = getenv("DOCI_DIAGNOSTICS");
+
+    return env && strcmp(env, "0");
+}
+
+/**
+ * Read a positive whole number from a string, e.g. the value of an environment variable
+ * @param str the string, only digits (no sign, unit or trailing characters)
+ * @param value on return the number, unchanged if the string is not valid
+ * @return true if the string is a positive number that fits in an unsigned long long
+ */
+bool helpers::ParseCount(const char *str, unsigned long long &value)
+{
+    if(!str || *str < '0' || *str > '9')
+        return false;
+
+    char *end;
+    errno = 0;
+    const auto result = std::strtoull(str, &end, 10);
+
+    if(errno || *end != '\0' || result == 0)
+        return false;
+
+    value = result;
+
+    return true;
+}
+
+#ifdef __linux__
+//! the number of nodes in the node masks of the NUMA system calls
+static const unsigned long numa_max_nodes = 1024;
+#endif
+
+/**
+ * Spread the pages of a memory range round robin over all NUMA nodes we are allowed
+ * to use. Call this before the memory is touched: pages that already exist are not moved.
+ * Only the whole pages in the range are affected. Does nothing if not supported.
+ * @param ptr the start of the range
+ * @param bytes the length of the range
+ */
+void helpers::NumaInterleave(void *ptr, std::size_t bytes)
+{
+#ifdef __linux__
+    const std::size_t page = sysconf(_SC_PAGESIZE);
+
+    const auto start = ((reinterpret_cast<std::size_t>(ptr) + page - 1) / page) * page;
+    const auto end = ((reinterpret_cast<std::size_t>(ptr) + bytes) / page) * page;
+
+    if(start >= end)
+        return;
+
+    std::vector<unsigned long> nodes(numa_max_nodes / (8*sizeof(unsigned long)), 0);
+    int mode;
+
+    if(syscall(SYS_get_mempolicy, &mode, nodes.data(), numa_max_nodes, nullptr, MPOL_F_MEMS_ALLOWED) ||
+            syscall(SYS_mbind, start, end - start, MPOL_INTERLEAVE, nodes.data(), numa_max_nodes, 0))
+        std::cerr << "Could not interleave the memory over the NUMA nodes: " << strerror(errno) << std::endl;
+#endif
+}
+
+/**
+ * Find out on which NUMA nodes the pages of a memory range are, from a sample of the pages
+ * @param ptr the start of the range
+ * @param bytes the length of the range
+ * @return a description like "node 0: 50%, node 1: 50%"
+ */
+std::string helpers::NumaPlacement(const void *ptr, std::size_t bytes)
+{
+#ifdef __linux__
+    if(bytes == 0)
+        return "empty";
+
+    const std::size_t page = sysconf(_SC_PAGESIZE);
+
+    const auto start = (reinterpret_cast<std::size_t>(ptr) / page) * page;
+    const auto n_pages = (reinterpret_cast<std::size_t>(ptr) + bytes - start + page - 1) / page;
+
+    const std::size_t n_sample = std::min(n_pages, std::size_t(4096));
+
+    std::vector<void *> pages(n_sample);
+    std::vector<int> status(n_sample);
+
+    for(std::size_t i=0;i<n_sample;i++)
+        pages[i] = reinterpret_cast<void *>(start + ((i * n_pages) / n_sample) * page);
+
+    if(syscall(SYS_move_pages, 0, n_sample, pages.data(), nullptr, status.data(), 0))
+        return "unknown";
+
+    std::map<int, std::size_t> count;
+
+    for(auto node: status)
+        count[node]++;
+
+    std::stringstream result;
+
+    for(auto &c: count)
+    {
+        if(c.first >= 0)
+            result << "node " << c.first;
+        else
+            result << "not mapped";
+
+        result << ": " << (100 * c.second) / n_sample << "%";
+
+        if(c.first != count.rbegin()->first)
+            result << ", ";
+    }
+
+    return result.str();
+#else
+    return "unknown";
+#endif
+}
+
+/**
+ * Start counting the cache misses on every OpenMP thread
+ */
+CacheMissCounter::CacheMissCounter()
+{
+    fds.assign(omp_get_max_threads(), -1);
+
+#ifdef __linux__
+#pragma omp parallel num_threads(fds.size())
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // this thread, on any cpu
+        fds[omp_get_thread_num()] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+CacheMissCounter::~CacheMissCounter()
+{
+#ifdef __linux__
+    for(auto fd: fds)
+        if(fd >= 0)
+            close(fd);
+#endif
+}
+
+/**
+ * Stop counting
+ * @return the total number of cache misses of all threads, -1 if they could not be counted
+ */
+long long CacheMissCounter::Stop()
+{
+    long long total = 0;
+
+#ifdef __linux__
+    for(auto &fd: fds)
+    {
+        long long count = 0;
+
+        if(fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+            total = -1;
+        else if(total >= 0)
+            total += count;
+
+        if(fd >= 0)
+            close(fd);
+
+        fd = -1;
+    }
+#else
+    total = -1;
+#endif
+
+    return total;
+}
+
+/**
+ * The memory that can still be used without swapping: MemAvailable from
+ * /proc/meminfo (this includes the page cache that can be dropped), or
+ * else the free physical pages
+ * @return the available memory in bytes, 0 if unknown
+ */
+std::size_t helpers::AvailableMemory()
+{
+#ifdef __linux__
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    std::size_t kb;
+
+    while(meminfo >> key >> kb)
+    {
+        if(key == "MemAvailable:")
+            return kb * 1024;
+
+        // skip the unit
+        meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+
+    const long pages = sysconf(_SC_AVPHYS_PAGES);
+
+    if(pages > 0)
+        return static_cast<std::size_t>(pages) * sysconf(_SC_PAGESIZE);
+#endif
+
+    return 0;
+}
+
+/**
+ * A 64 bit FNV-1a hash of a range of bytes. Not a cryptographic hash, but good enough
+ * to tell different inputs apart (e.g. to name a cache file after its content).
+ * Pass the hash of the previous range as start to hash several ranges together.
+ * @param ptr the start of the range
+ * @param bytes the length of the range
+ * @param start the start value of the hash
+ * @return the hash
+ */
+unsigned long long helpers::HashBytes(const void *ptr, std::size_t bytes, unsigned long long start)
+{
+    const auto *p = static_cast<const unsigned char *>(ptr);
+    unsigned long long hash = start;
+
+    for(std::size_t i=0;i<bytes;i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
 /* vim: set ts=8 sw=4 tw=0 expandtab :*/
@@ -54,7 +54,7 @@ class DM2
 
       unsigned int get_n_sp() const;
 
-      void Build(Permutation &, std::vector<double> &);
+      void Build(Permutation &, const std::vector<double> &);
 
       void BuildHamiltonian(const Molecule &);
 
@@ -62,9 +62,9 @@ class DM2
 
       double Trace() const;
 
-      std::pair<double,bool> find_min_angle(int k, int l, double start_angle, std::function<double(int,int)> &T, std::function<double(int,int,int,int)> &V) const;
+      std::pair<double,bool> find_min_angle(int k, int l, double start_angle, const Molecule &mol) const;
 
-      double calc_rotate(int k, int l, double theta, std::function<double(int,int)> &T, std::function<double(int,int,int,int)> &V) const;
+      double calc_rotate(int k, int l, double theta, const Molecule &mol) const;
 
       double S2() const;
 
@@ -72,7 +72,8 @@ class DM2
 
    private:
 
-      void build_iter(Permutation& , std::vector<double> &, unsigned int , unsigned int , DM2 &);
+      template<unsigned int NP>
+      void build_iter(Permutation& , const std::vector<double> &, unsigned long long, unsigned long long, std::vector<double> &) const;
 
       void fill_lists(unsigned int);
 
@@ -3,13 +3,20 @@
 
 #include <vector>
 #include <memory>
+#include <functional>
 
 #include "Permutation.h"
 #include "Molecule.h"
 #include "SparseMatrix_CRS.h"
+#include "SparseMatrix_SELL.h"
+#include "SparseMatrix_OOC.h"
 
 namespace doci {
 
+template<unsigned int NP> class PairExcitations;
+
+class DistributedHamiltonian;
+
 /**
  * DOCIHamiltonian will store the actual hamiltonian in a sparse format
  * It needs a Permutation object for the basisset and a Molecule object
@@ -17,7 +24,55 @@ namespace doci {
  */
 class DOCIHamiltonian
 {
+      // uses the matrix elements of CalcDiagonal() and CalcPairTable() and the Davidson solver
+      friend class DistributedHamiltonian;
+
    public:
+      //! the ways to store the hamiltonian
+      enum class Storage
+      {
+         //! sparse matrix with a double per element
+         CRS,
+         //! sparse matrix with a pair index per element and a table with the pair values
+         PairCRS,
+         //! no matrix at all, only the diagonal: the rest is recalculated in every sigma()
+         MatrixFree,
+         //! experimental: sliced ELLPACK (SELL-C-sigma) made from the CRS matrix, for a SIMD
+         //! matrix-vector product. UpdateValues() rebuilds it from scratch.
+         SELL,
+         //! the full matrix with pair indices in blocks of rows on disk, read back in every product
+         OutOfCore
+      };
+
+      //! the order of the rows (and columns) of the stored hamiltonian
+      enum class Ordering
+      {
+         //! the order of Permutation: colexicographic
+         Colex,
+         //! reverse Cuthill-McKee on the graph of the pair excitations
+         RCM
+      };
+
+      //! which part of the symmetric hamiltonian is stored in the sparse matrix
+      enum class Pattern
+      {
+         //! only the upper diagonal part: the matrix-vector product also scatters
+         Upper,
+         //! both triangles: twice the memory, but the matrix-vector product only gathers
+         Full
+      };
+
+      //! the eigensolvers to choose from
+      enum class Solver
+      {
+         //! implicitly restarted Lanczos from ARPACK
+         Arpack,
+         //! Davidson-Liu with the diagonal as preconditioner
+         Davidson,
+         //! Davidson-Liu with the subspace in single precision, refined in double precision
+         MixedDavidson
+      };
+
       DOCIHamiltonian(const Permutation &,const Molecule &);
 
       DOCIHamiltonian(const Molecule &);
@@ -40,14 +95,46 @@ class DOCIHamiltonian
 
       Permutation const & getPermutation() const;
 
-      unsigned int getdim() const;
+      unsigned long long getdim() const;
 
       void Build();
 
+      void UpdateValues(const Molecule &);
+
+      void SetStorage(Storage);
+
+      Storage GetStorage() const;
+
+      void SetOrdering(Ordering);
+
+      Ordering GetOrdering() const;
+
+      void SetPattern(Pattern);
+
+      Pattern GetPattern() const;
+
+      void sigma(const double *, double *) const;
+
+      void sigma(const double *, double *, unsigned int) const;
+
+      void SetSolver(Solver);
+
+      Solver GetSolver() const;
+
+      void SetTolerance(double);
+
+      double GetTolerance() const;
+
+      void SetStartVector(std::vector<double>);
+
+      const std::vector<double>& GetStartVector() const;
+
       std::pair< std::vector<double>,helpers::matrix > DiagonalizeFull() const;
 
       std::pair< double,std::vector<double> > Diagonalize() const;
 
+      std::pair< std::vector<double>,std::vector<double> > Diagonalize(int) const;
+
       double CalcEnergy() const;
 
       std::vector<double> CalcEnergy(int) const;
@@ -59,17 +146,158 @@ class DOCIHamiltonian
       void SaveToFile(std::string) const;
 
       void ReadFromFile(std::string);
+
+      bool ReadFromCache(std::string);
+
+      void SaveToCache(std::string) const;
+
+      static unsigned long long CountNonZero(unsigned int L, unsigned int n_pairs);
+
+      static std::size_t MemoryUsage(unsigned int L, unsigned int n_pairs, Storage, Pattern = Pattern::Upper);
+
+      static std::size_t SolverMemory(unsigned long long dim, Solver, unsigned int nroots = 1, Pattern = Pattern::Upper);
+
+      static void Calibrate(unsigned int L, unsigned int n_pairs, unsigned long long n_rows, double &build, double &spmv, double &sigma);
    private:
 
-      void Diagonalize_arpack(double &energy, std::vector<double> &eigv, bool eigvec) const;
+      void Diagonalize_arpack(int nev, std::vector<double> &energies, std::vector<double> &eigv, bool eigvec) const;
+
+      void Diagonalize_davidson(int nroots, std::vector<double> &energies, std::vector<double> &eigv, bool eigvec) const;
+
+      /**
+       * What the Davidson solver (see Davidson_kernel()) needs of the hamiltonian. In one
+       * process the vectors are whole, a DistributedHamiltonian only keeps the own block
+       * of rows: the products are then its distributed product, and the local dot products
+       * and norms are summed over all ranks with reduce.
+       */
+      struct DavidsonOperator
+      {
+         //! the dimension of the hamiltonian
+         unsigned long long dim;
+         //! the length of the vectors in this process: dim, or the own block of rows
+         std::size_t n;
+         //! the diagonal of the hamiltonian, the same n rows
+         const double *diag;
+         //! the first row of the piece of every thread in the product, followed by n (see PlaceVectors())
+         std::vector<unsigned long long> part;
+         //! y = H*x for nvec vectors, one after the other
+         std::function<void (const double *, double *, unsigned int)> mvprod;
+         //! sum an array of local dot products over all processes, in place
+         std::function<void (double *, int)> reduce;
+         //! the count lowest elements of the whole diagonal: their index in diag, -1 if in another process
+         std::function<std::vector<long long> (std::size_t)> lowest;
+         //! print the progress and the problems of the solver (in one process only)
+         bool verbose;
+      };
+
+      static void Davidson(const DavidsonOperator &, bool mixed, double tolerance, int nroots, std::vector<double> start, std::vector<double> &energies, std::vector<double> &ritz);
+
+      template<typename T>
+      static void Davidson_kernel(const DavidsonOperator &, int nroots, double tol, int max_space, const std::vector<double> &start, std::vector<double> &energies, std::vector<double> &ritz);
+
+      static std::vector<long long> LowestElements(const std::vector<double> &, std::size_t);
+
+      std::vector<crs_row_t> PlanRows(bool) const;
+
+      template<unsigned int NP>
+      void Build_iter(Permutation &, helpers::SparseMatrix_CRS &,unsigned long long, unsigned long long, const Molecule &, unsigned long long = 0);
+
+      template<unsigned int NP>
+      void RowElements(const PairExcitations<NP> &, unsigned long long, bool, std::vector< std::pair<unsigned long long,unsigned short> > &) const;
 
-      void Build_iter(Permutation &, helpers::SparseMatrix_CRS &,unsigned long long, unsigned long long, Molecule &);
+      template<unsigned int NP>
+      void UpdateValues_iter(Permutation &, unsigned long long, unsigned long long);
+
+      void Build_diagonal();
+
+      void Build_blocks();
+
+      static double CalcDiagonal(mybitset, const Molecule &);
+
+      template<unsigned int NP>
+      static double CalcDiagonal(const PairExcitations<NP> &, const Molecule &);
+
+      template<unsigned int NP>
+      void sigma_kernel(const double *, double *, unsigned int) const;
+
+      template<unsigned int NP>
+      static void Calibrate_iter(unsigned int L, unsigned int n_pairs, unsigned long long i_start, unsigned long long i_end, const std::vector<double> &x, double &build, double &spmv, double &sigma);
+
+      static std::vector<double> CalcPairTable(const Molecule &);
+
+      void mvprod(const double *, double *) const;
+
+      void mvprod(const double *, double *, unsigned int) const;
+
+      void mvprod_blocks(const double *, double *, unsigned int) const;
+
+      unsigned int BlockSize(unsigned int) const;
+
+      void FreeBuffers() const;
+
+      template<typename T>
+      void PlaceVectors(T *, std::size_t) const;
+
+      template<typename T>
+      static void PlaceVectors(T *, std::size_t, std::size_t, const std::vector<unsigned long long> &);
+
+      std::vector<unsigned long long> ThreadPieces(int) const;
+
+      template<unsigned int NP>
+      void CalcOrdering(const Permutation &);
+
+      void ToRowOrder(const double *, double *) const;
+
+      void FromRowOrder(const double *, double *) const;
+
+      void ReportSpMV() const;
+
+      std::string CacheFile(std::string) const;
 
       std::unique_ptr<Permutation> permutations;
 
       std::unique_ptr<Molecule> molecule;
 
+      //! the number of basis states, can be larger than a sparse matrix allows in MatrixFree storage
+      unsigned long long dim;
+
       std::unique_ptr<helpers::SparseMatrix_CRS> mat;
+
+      //! the matrix in SELL storage, mat then only keeps the dimension
+      std::unique_ptr<helpers::SparseMatrix_SELL> sell;
+
+      //! the matrix in OutOfCore storage, mat then only keeps the dimension
+      std::unique_ptr<helpers::SparseMatrix_OOC> ooc;
+
+      //! how the hamiltonian is stored
+      Storage storage;
+
+      //! the diagonal of the hamiltonian
+      std::vector<double> diag;
+
+      //! the order of the rows of the stored hamiltonian
+      Ordering ordering;
+
+      //! which part of the hamiltonian is stored
+      Pattern pattern;
+
+      //! order[i] is the index in Permutation of row i (empty for Colex)
+      std::vector<crs_col_t> order;
+
+      //! position[j] is the row of basis state j in Permutation, the inverse of order
+      std::vector<crs_col_t> position;
+
+      //! the eigensolver to use
+      Solver solver;
+
+      //! the convergence tolerance of the eigensolver, 0 means as accurate as possible
+      double tolerance;
+
+      //! the start vector for the eigensolver, empty if there is none
+      std::vector<double> start_vector;
+
+      //! the interleaved vectors of the block product in mvprod(x,y,nvec), kept between calls
+      mutable std::vector<double> block_buffer;
 };
 
 }
@@ -0,0 +1,129 @@
+#ifndef DISTRIBUTED_HAMILTONIAN_H
+#define DISTRIBUTED_HAMILTONIAN_H
+
+#ifdef MPI
+
+#include <vector>
+#include <memory>
+#include <mpi.h>
+
+#include "Molecule.h"
+#include "SparseMatrix_CRS.h"
+#include "DOCIHamtilonian.h"
+
+namespace doci {
+
+/**
+ * The DOCI hamiltonian spread over the MPI ranks: every rank builds and keeps only a
+ * block of consecutive rows (in colex order, found with Permutation::unrank()) and the
+ * matching block of every vector. The rows are stored in full (both triangles) in
+ * compressed form, so the matrix-vector product only gathers. The columns are
+ * renumbered locally: first the own rows, then the halo, the entries of the vector
+ * that live on the other ranks. The halo is exchanged before every product.
+ * The eigensolver is the Davidson method of DOCIHamiltonian (see
+ * DOCIHamiltonian::Davidson()), with the dot products summed over the ranks.
+ *
+ * Only available when compiled with -DMPI (see the Makefile).
+ */
+class DistributedHamiltonian
+{
+   public:
+
+      DistributedHamiltonian(const Molecule &, MPI_Comm = MPI_COMM_WORLD);
+
+      virtual ~DistributedHamiltonian() = default;
+
+      unsigned long long getdim() const;
+
+      unsigned long long RowStart() const;
+
+      unsigned long long RowEnd() const;
+
+      void Build();
+
+      void SetTolerance(double);
+
+      void SetSolver(DOCIHamiltonian::Solver);
+
+      DOCIHamiltonian::Solver GetSolver() const;
+
+      std::pair< double,std::vector<double> > Diagonalize() const;
+
+      std::pair< std::vector<double>,std::vector<double> > Diagonalize(int) const;
+
+      double CalcEnergy() const;
+
+      std::vector<double> CalcEnergy(int) const;
+
+      std::size_t MemoryUsage() const;
+
+   private:
+
+      template<unsigned int NP>
+      void Build_iter(std::vector<unsigned long long> &, bool);
+
+      void SetupHalo(std::vector<unsigned long long>);
+
+      void mvprod(const double *, double *, unsigned int) const;
+
+      void Allreduce(double *, int) const;
+
+      std::vector<long long> LowestDiagonal(std::size_t) const;
+
+      void Diagonalize_davidson(int nroots, std::vector<double> &energies, std::vector<double> &eigv, bool eigvec) const;
+
+      //! the communicator of the ranks that share the hamiltonian
+      MPI_Comm comm;
+
+      //! the rank of this process in comm
+      int rank;
+
+      //! the number of ranks in comm
+      int size;
+
+      std::unique_ptr<Molecule> molecule;
+
+      //! the dimension of the whole hamiltonian
+      unsigned long long dim;
+
+      //! the first row of every rank, followed by dim (size+1)
+      std::vector<unsigned long long> part;
+
+      //! the own rows, columns in local numbering (own rows first, then the halo)
+      std::unique_ptr<helpers::SparseMatrix_CRS> mat;
+
+      //! the diagonal of the own rows
+      std::vector<double> diag;
+
+      //! the global index of every halo entry, sorted (so grouped per rank)
+      std::vector<unsigned long long> halo;
+
+      //! the number of halo entries this rank gets from every rank, and their start
+      std::vector<int> recv_count, recv_displ;
+
+      //! the number of entries this rank sends to every rank, and their start
+      std::vector<int> send_count, send_displ;
+
+      //! the local rows of the entries to send, grouped per rank
+      std::vector<crs_col_t> send_index;
+
+      //! the entries to send and the own block followed by the halo, kept between products (interleaved for a block of vectors)
+      mutable std::vector<double> send_buffer, x_ext;
+
+      //! the interleaved product of a block of vectors, kept between products
+      mutable std::vector<double> block_buffer;
+
+      //! the convergence tolerance of the eigensolver, 0 means as accurate as possible
+      double tolerance;
+
+      //! the eigensolver to use: Davidson or MixedDavidson
+      DOCIHamiltonian::Solver solver;
+};
+
+}
+
+#endif /* MPI */
+
+#endif /* DISTRIBUTED_HAMILTONIAN_H */
+
+/* vim: set ts=3 sw=3 expandtab :*/
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "helpers.h"
 
@@ -32,6 +33,16 @@ class Molecule
 
       virtual unsigned int get_n_electrons() const;
 
+      void BuildIntegralCache();
+
+      const double* getJ() const;
+
+      const double* getK() const;
+
+      const double* getP() const;
+
+      const double* getTdiag() const;
+
    protected:
 
       //! number of electrons
@@ -42,6 +53,13 @@ class Molecule
 
       //! the size of the single particles space (without spin)
       unsigned int n_sp;
+
+   private:
+
+      static std::size_t CacheStride(unsigned int);
+
+      //! the J, K and P matrices and the diagonal of T, one after the other (see BuildIntegralCache())
+      std::vector<double, helpers::aligned_allocator<double> > int_cache;
 };
 
 
@@ -0,0 +1,262 @@
+#ifndef PAIR_EXCITATIONS_H
+#define PAIR_EXCITATIONS_H
+
+#include <assert.h>
+
+#include "Permutation.h"
+
+//! the largest number of pairs with a specialized kernel, see DISPATCH_PAIRS
+#define MAX_SPECIALIZED_PAIRS 32
+
+/**
+ * Call kernel<NP>(...) with NP the number of pairs n if there is a specialized
+ * version for it (n <= MAX_SPECIALIZED_PAIRS), else the generic kernel<0>(...)
+ */
+#define DISPATCH_PAIRS(n, kernel, ...) \
+   switch(n) \
+   { \
+      case 1: kernel<1>(__VA_ARGS__); break; \
+      case 2: kernel<2>(__VA_ARGS__); break; \
+      case 3: kernel<3>(__VA_ARGS__); break; \
+      case 4: kernel<4>(__VA_ARGS__); break; \
+      case 5: kernel<5>(__VA_ARGS__); break; \
+      case 6: kernel<6>(__VA_ARGS__); break; \
+      case 7: kernel<7>(__VA_ARGS__); break; \
+      case 8: kernel<8>(__VA_ARGS__); break; \
+      case 9: kernel<9>(__VA_ARGS__); break; \
+      case 10: kernel<10>(__VA_ARGS__); break; \
+      case 11: kernel<11>(__VA_ARGS__); break; \
+      case 12: kernel<12>(__VA_ARGS__); break; \
+      case 13: kernel<13>(__VA_ARGS__); break; \
+      case 14: kernel<14>(__VA_ARGS__); break; \
+      case 15: kernel<15>(__VA_ARGS__); break; \
+      case 16: kernel<16>(__VA_ARGS__); break; \
+      case 17: kernel<17>(__VA_ARGS__); break; \
+      case 18: kernel<18>(__VA_ARGS__); break; \
+      case 19: kernel<19>(__VA_ARGS__); break; \
+      case 20: kernel<20>(__VA_ARGS__); break; \
+      case 21: kernel<21>(__VA_ARGS__); break; \
+      case 22: kernel<22>(__VA_ARGS__); break; \
+      case 23: kernel<23>(__VA_ARGS__); break; \
+      case 24: kernel<24>(__VA_ARGS__); break; \
+      case 25: kernel<25>(__VA_ARGS__); break; \
+      case 26: kernel<26>(__VA_ARGS__); break; \
+      case 27: kernel<27>(__VA_ARGS__); break; \
+      case 28: kernel<28>(__VA_ARGS__); break; \
+      case 29: kernel<29>(__VA_ARGS__); break; \
+      case 30: kernel<30>(__VA_ARGS__); break; \
+      case 31: kernel<31>(__VA_ARGS__); break; \
+      case 32: kernel<32>(__VA_ARGS__); break; \
+      default: kernel<0>(__VA_ARGS__); \
+   }
+
+namespace doci {
+
+/**
+ * Generates all pair excitations of a DOCI basis state (the bra) together with
+ * the index of the ket they lead to. The occupied orbitals of the bra are kept in a
+ * list with prefix sums of their binomial coefficients, so the rank of every ket
+ * costs O(1) instead of the walk over all set bits in Permutation::rank().
+ *
+ * NP is the number of pairs when it is known at compile time: all loops over the
+ * occupied orbitals then have a fixed trip count. Use NP = 0 for the generic version.
+ */
+template<unsigned int NP>
+class PairExcitations
+{
+   public:
+      PairExcitations(unsigned int n_pairs, unsigned int L);
+
+      void set(mybitset bra);
+
+      unsigned long long rank() const;
+
+      unsigned int num_occupied() const;
+
+      const unsigned int* occupied() const;
+
+      template<typename F>
+      void upper(F &&f) const;
+
+      template<typename F>
+      void all(F &&f) const;
+
+   private:
+
+      //! the maximum number of orbitals
+      static const unsigned int max_orbs = sizeof(mybitset)*8;
+
+      //! number of pairs
+      const unsigned int n;
+
+      //! number of orbitals
+      const unsigned int L;
+
+      //! the binomial coefficients, C(p,i) at i*(max_orbs+1)+p (see Permutation::getBinomials())
+      const unsigned long long *binomials;
+
+      //! the occupied orbitals of the bra, from low to high
+      unsigned int occ[max_orbs];
+
+      //! the empty orbitals of the bra, from low to high
+      unsigned int vir[max_orbs];
+
+      //! for every empty orbital: the number of occupied orbitals below it
+      unsigned int below[max_orbs];
+
+      //! number of empty orbitals
+      unsigned int n_vir;
+
+      //! prefix sums: A[k] is the sum of C(occ[j],j+1) for j < k, A[n] is the rank of the bra
+      unsigned long long A[max_orbs+1];
+
+      //! prefix sums of C(occ[j],j): the terms of the occupied orbitals that move one place down
+      unsigned long long B[max_orbs+1];
+
+      //! prefix sums of C(occ[j],j+2): the terms of the occupied orbitals that move one place up
+      unsigned long long C[max_orbs+1];
+};
+
+/**
+ * Constructor
+ * @param n_pairs the number of pairs (should be NP if NP > 0)
+ * @param L the number of orbitals
+ */
+template<unsigned int NP>
+PairExcitations<NP>::PairExcitations(unsigned int n_pairs, unsigned int L) : n(NP > 0 ? NP : n_pairs), L(L)
+{
+   assert(NP == 0 || NP == n_pairs);
+   assert(n < max_orbs && L <= max_orbs);
+
+   binomials = Permutation::getBinomials();
+}
+
+/**
+ * Set a new bra: find the occupied and empty orbitals and the prefix sums
+ * @param bra the new bra, should have n bits set
+ */
+template<unsigned int NP>
+void PairExcitations<NP>::set(mybitset bra)
+{
+   const auto dim = max_orbs + 1;
+
+   A[0] = B[0] = C[0] = 0;
+
+   for(unsigned int j=0;j<n;j++)
+   {
+      const auto p = ctz(bra);
+      bra &= bra - 1;
+
+      occ[j] = p;
+      A[j+1] = A[j] + binomials[(j+1)*dim + p];
+      B[j+1] = B[j] + binomials[j*dim + p];
+      C[j+1] = C[j] + binomials[(j+2)*dim + p];
+   }
+
+   n_vir = 0;
+
+   for(unsigned int j=0, p=0;p<L;p++)
+      if(j < n && occ[j] == p)
+         j++;
+      else
+      {
+         vir[n_vir] = p;
+         below[n_vir] = j;
+         n_vir++;
+      }
+}
+
+/**
+ * @return the rank of the bra (see Permutation::rank())
+ */
+template<unsigned int NP>
+unsigned long long PairExcitations<NP>::rank() const
+{
+   return A[n];
+}
+
+/**
+ * @return the number of occupied orbitals of the bra
+ */
+template<unsigned int NP>
+unsigned int PairExcitations<NP>::num_occupied() const
+{
+   return n;
+}
+
+/**
+ * @return the list of occupied orbitals of the bra, from low to high
+ */
+template<unsigned int NP>
+const unsigned int* PairExcitations<NP>::occupied() const
+{
+   return occ;
+}
+
+/**
+ * Call f(r, s, index) for every pair excitation from occupied orbital s to
+ * an empty orbital r > s: all kets after the bra (the upper diagonal part).
+ * Moving the pair from s (the a-th occupied orbital) to r (with b occupied orbitals
+ * below it) shifts the occupied orbitals in between one place down.
+ * @param f the function to call
+ */
+template<unsigned int NP>
+template<typename F>
+void PairExcitations<NP>::upper(F &&f) const
+{
+   const auto dim = max_orbs + 1;
+
+   // the first empty orbital above occ[a]
+   unsigned int v_start = 0;
+
+   for(unsigned int a=0;a<n;a++)
+   {
+      const auto s = occ[a];
+
+      while(v_start < n_vir && vir[v_start] < s)
+         v_start++;
+
+      for(unsigned int v=v_start;v<n_vir;v++)
+      {
+         const auto r = vir[v];
+         const auto b = below[v];
+
+         f(r, s, A[n] - (A[b] - A[a]) + (B[b] - B[a+1]) + binomials[b*dim + r]);
+      }
+   }
+}
+
+/**
+ * Call f(r, s, index) for every pair excitation from occupied orbital s to
+ * any empty orbital r. For r > s see upper(), for r < s the occupied orbitals
+ * in between shift one place up.
+ * @param f the function to call
+ */
+template<unsigned int NP>
+template<typename F>
+void PairExcitations<NP>::all(F &&f) const
+{
+   const auto dim = max_orbs + 1;
+
+   for(unsigned int a=0;a<n;a++)
+   {
+      const auto s = occ[a];
+
+      for(unsigned int v=0;v<n_vir;v++)
+      {
+         const auto r = vir[v];
+         const auto b = below[v];
+
+         if(r > s)
+            f(r, s, A[n] - (A[b] - A[a]) + (B[b] - B[a+1]) + binomials[b*dim + r]);
+         else
+            f(r, s, A[n] - (A[a+1] - A[b]) + (C[a] - C[b]) + binomials[(b+1)*dim + r]);
+      }
+   }
+}
+
+}
+
+#endif /* PAIR_EXCITATIONS_H */
+
+/* vim: set ts=3 sw=3 expandtab :*/
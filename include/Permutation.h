@@ -2,12 +2,12 @@
 #define PERMUTATION_H
 
 // use unsigned long by default
-#if not defined(USELONG) && not defined(USELONGLONG)
+#if not defined(USELONG) && not defined(USELONGLONG) && not defined(USEINT128)
 #define USELONG
 #endif
 
-#if defined(USELONG) && defined(USELONGLONG)
-#error "You really have to choose between unsigned long and unsigned long long!"
+#if (defined(USELONG) + defined(USELONGLONG) + defined(USEINT128)) > 1
+#error "You really have to choose between unsigned long, unsigned long long and unsigned __int128!"
 #endif
 
 #if defined(USELONG)
@@ -16,10 +16,11 @@ typedef unsigned long mybitset;
 #elif defined(USELONGLONG)
 //! we use a unsigned long long as underlying representation
 typedef unsigned long long mybitset;
+#elif defined(USEINT128)
+//! we use a unsigned __int128 as underlying representation (up to 128 orbitals)
+typedef unsigned __int128 mybitset;
 #endif
 
-
-
 /**
  * We use the namespace doci to put all other stuff in.
  * In this way, the code can be easily used from other code without
@@ -27,12 +28,46 @@ typedef unsigned long long mybitset;
  */
 namespace doci {
 
+/**
+ * Count the number of set bits
+ * @param bits the bitset
+ * @return the number of ones in bits
+ */
+inline unsigned int popcount(mybitset bits)
+{
+#if defined(USELONG)
+   return __builtin_popcountl(bits);
+#elif defined(USELONGLONG)
+   return __builtin_popcountll(bits);
+#elif defined(USEINT128)
+   return __builtin_popcountll(static_cast<unsigned long long>(bits)) + __builtin_popcountll(static_cast<unsigned long long>(bits >> 64));
+#endif
+}
+
+/**
+ * Count the trailing zeros: the position of the lowest set bit
+ * @param bits the bitset, should not be zero
+ * @return the position of the lowest set bit
+ */
+inline unsigned int ctz(mybitset bits)
+{
+#if defined(USELONG)
+   return __builtin_ctzl(bits);
+#elif defined(USELONGLONG)
+   return __builtin_ctzll(bits);
+#elif defined(USEINT128)
+   const auto low = static_cast<unsigned long long>(bits);
+
+   return low ? __builtin_ctzll(low) : 64 + __builtin_ctzll(static_cast<unsigned long long>(bits >> 64));
+#endif
+}
+
 /**
  * This class is used to generate all permutations of
  * bitsets with n bits set. These permutations are not
  * stored but generated on the fly.
- * Currently, should work well with up to 32 bits 
- * (64 if you switch to unsigned long long). Beyond that,
+ * Currently, should work well with up to 64 bits
+ * (128 if you compile with -DUSEINT128). Beyond that,
  * troubles are waiting.
  *
  * There is also no protect against overflows for the moment.
@@ -46,14 +81,22 @@ class Permutation
 
         virtual mybitset get() const;
 
+        mybitset get(unsigned long long) const;
+
         virtual void reset();
 
+        unsigned long long rank(mybitset) const;
+
+        mybitset unrank(unsigned long long);
+
         static unsigned long long CalcCombinations(unsigned int, unsigned int);
 
         static unsigned long long gcd(unsigned long long, unsigned long long);
 
         static unsigned int getMax();
 
+        static const unsigned long long* getBinomials();
+
     private:
 
         //! the current bitset
@@ -61,6 +104,9 @@ class Permutation
 
         //! number of ones needed
         unsigned int n;
+
+        //! table with the binomial coefficients, shared by all objects (see rank())
+        const unsigned long long *binomials;
 };
 
 }
@@ -3,9 +3,23 @@
 
 #include <iostream>
 #include <vector>
+#include <memory>
 
 #include "helpers.h"
 
+// The row pointers count all non-zero elements and are always 64 bit.
+// The column indices (and the dimension) are 32 bit by default, define
+// CRS_64BIT_COL to go beyond 2^32 rows.
+#if defined(CRS_64BIT_COL)
+//! type of the column indices and the dimension
+typedef unsigned long long crs_col_t;
+#else
+//! type of the column indices and the dimension
+typedef unsigned int crs_col_t;
+#endif
+//! type of the row pointers (indices in the non zero elements)
+typedef unsigned long long crs_row_t;
+
 // dark magic to get the friend operator<< to work...
 namespace helpers { class SparseMatrix_CRS; };
 std::ostream &operator<<(std::ostream &output,helpers::SparseMatrix_CRS &matrix_p);
@@ -17,6 +31,23 @@ namespace helpers {
  * @date 03-07-2012\n\n
  * This is a class written for sparse n x n matrices to use on the gpu. It uses the CRS format to store
  * a matrix. Only symmetric matrices!
+ *
+ * There is also a pair storage mode (see SetPairTable()) for matrices with only a few
+ * distinct off-diagonal values: every element then stores a 16 bit index in a small
+ * table with the values, and data holds only the diagonal (one value per row). In this
+ * mode every row has to start with its diagonal element.
+ *
+ * When the number of elements of every row is known in advance, Allocate() sets up
+ * the whole structure at once and the rows can be filled in any order (and by several
+ * threads) with FillElementInRow() and FillPairInRow().
+ *
+ * Normally only the upper diagonal part is stored. Allocate() can also set up
+ * the full matrix (both triangles): twice the memory, but mvprod() then only has
+ * to gather and needs no private buffers for the threads (see IsFull()).
+ *
+ * A matrix saved with WriteToBinaryFile() can be used straight from the file with
+ * MapBinaryFile(), read only: the arrays are then in the mapped file instead of in the
+ * vectors, so every read goes through RowPtr(), ColPtr(), DataPtr() and PairPtr().
  */
 
 class SparseMatrix_CRS
@@ -34,14 +65,14 @@ class SparseMatrix_CRS
 
    public:
 
-      SparseMatrix_CRS(unsigned int n);
+      SparseMatrix_CRS(crs_col_t n);
 
       virtual ~SparseMatrix_CRS() = default;
 
       //easy to access the numbers
-      double operator()(unsigned int i,unsigned int j) const;
+      double operator()(crs_col_t i,crs_col_t j) const;
 
-      unsigned int gn() const;
+      crs_col_t gn() const;
 
       void ConvertFromMatrix(const helpers::matrix &dense);
 
@@ -49,9 +80,11 @@ class SparseMatrix_CRS
 
       void PrintRaw() const;
 
-      void PushToRow(unsigned int j, double value);
+      void PushToRow(crs_col_t j, double value);
+
+      void PushToRowNext(crs_col_t j, double value);
 
-      void PushToRowNext(unsigned int j, double value);
+      void PushPairToRowNext(crs_col_t j, unsigned short idx);
 
       void NewRow();
 
@@ -59,31 +92,106 @@ class SparseMatrix_CRS
 
       void mvprod(const double *, double *, double) const;
 
-      void SetGuess(unsigned int);
+      void mvprod_block(const double *, double *, unsigned int) const;
+
+      void SetGuess(crs_row_t);
 
       int WriteToFile(const char*,const char*,bool=false) const;
 
       int ReadFromFile(const char*,const char*);
 
-      unsigned int NumOfElInRow(unsigned int idx) const;
+      int WriteToBinaryFile(const char*) const;
+
+      int ReadFromBinaryFile(const char*);
+
+      int MapBinaryFile(const char*);
+
+      bool IsMapped() const;
+
+      crs_row_t NumOfEl() const;
+
+      crs_col_t NumOfElInRow(crs_col_t idx) const;
+
+      double GetElementInRow(crs_col_t row_index, crs_col_t element_index) const;
+
+      crs_col_t GetElementColIndexInRow(crs_col_t row_index, crs_col_t element_index) const;
+
+      void SetElementInRow(crs_col_t row_index, crs_col_t element_index, double value);
+
+      void Allocate(std::vector<crs_row_t>, bool=false, bool=false);
+
+      void FillElementInRow(crs_col_t row_index, crs_col_t element_index, crs_col_t j, double value);
+
+      void FillPairInRow(crs_col_t row_index, crs_col_t element_index, crs_col_t j, unsigned short idx);
 
-      double GetElementInRow(unsigned int row_index, unsigned int element_index) const;
+      void SetPairTable(std::vector<double>);
 
-      unsigned int GetElementColIndexInRow(unsigned int row_index, unsigned int element_index) const;
+      bool HasPairStorage() const;
 
-      void AddList(std::vector< std::unique_ptr<SparseMatrix_CRS> > &);
+      bool IsFull() const;
+
+      std::vector<crs_col_t> RowPartition(int) const;
+
+      void FreeBuffers() const;
+
+      std::string Placement() const;
+
+      //! the largest number of vectors in one mvprod_block()
+      static const unsigned int max_block = 8;
 
    private:
 
+      double value(crs_col_t i, crs_row_t k) const;
+
+      const crs_row_t* RowPtr() const;
+
+      const crs_col_t* ColPtr() const;
+
+      const double* DataPtr() const;
+
+      const unsigned short* PairPtr() const;
+
+      std::size_t DataSize() const;
+
+      std::size_t PairSize() const;
+
+      template<unsigned int NV>
+      void mvprod_nv(const double *, double *, double) const;
+
+      template<unsigned int NV, typename F>
+      void mvprod_kernel(const double *, double *, double, F) const;
+
       //! Array that holds the non zero values
-      std::vector<double> data;
+      std::vector<double, default_init_allocator<double>> data;
       //! Array that holds the column indexes
-      std::vector<unsigned int> col;
+      std::vector<crs_col_t, default_init_allocator<crs_col_t>> col;
       //! Array that holds the row index of data
-      std::vector<unsigned int> row;
+      std::vector<crs_row_t> row;
 
       //!dimension of the matrix (number of rows/columns)
-      unsigned int n;
+      crs_col_t n;
+
+      //! true if both triangles are stored, false for only the upper diagonal part
+      bool full;
+
+      //! Array that holds the pair index of every element (pair storage only)
+      std::vector<unsigned short, default_init_allocator<unsigned short>> pair;
+      //! the values belonging to the pair indices (empty if not in pair storage)
+      std::vector<double> pair_table;
+
+      //! private accumulation buffers of the threads in mvprod()
+      mutable std::vector<double> mvprod_buffer;
+
+      //! the mapped file (see MapBinaryFile()), empty if the arrays are in memory
+      std::shared_ptr<const char> mapping;
+      //! row, col, data and pair in the mapped file (only valid with a mapping)
+      const crs_row_t *map_row;
+      const crs_col_t *map_col;
+      const double *map_data;
+      const unsigned short *map_pair;
+      //! the sizes of col, data and pair in the mapped file
+      crs_row_t map_nnz;
+      std::size_t map_data_size, map_pair_size;
 };
 
 }
@@ -0,0 +1,79 @@
+#ifndef SPARSEMATRIX_OOC_H
+#define SPARSEMATRIX_OOC_H
+
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "SparseMatrix_CRS.h"
+
+namespace helpers {
+
+/**
+ * Sparse n x n matrix kept out of core: the rows are split in blocks of consecutive
+ * rows and every block is a full SparseMatrix_CRS (both triangles, with the column
+ * indices of the whole matrix) in its own raw binary file (see
+ * SparseMatrix_CRS::WriteToBinaryFile()). The product reads the blocks back one after
+ * the other. A second thread reads the next block while the current one is multiplied,
+ * so only two blocks are in memory and the disk and the cores work at the same time.
+ * As every block holds complete rows, its product only gathers and writes its own part of y.
+ *
+ * The files are removed when the last copy of the matrix is destroyed: copies share them.
+ */
+class SparseMatrix_OOC
+{
+   public:
+
+      SparseMatrix_OOC(crs_col_t n, std::string prefix);
+
+      virtual ~SparseMatrix_OOC() = default;
+
+      crs_col_t gn() const;
+
+      void AddBlock(const SparseMatrix_CRS &);
+
+      void mvprod(const double *, double *) const;
+
+      void mvprod_block(const double *, double *, unsigned int) const;
+
+      crs_row_t NumOfEl() const;
+
+      unsigned int NumOfBlocks() const;
+
+      std::size_t FileSize() const;
+
+      void GetIOStats(std::size_t &bytes, double &read_time, double &wait_time) const;
+
+   private:
+
+      //! dimension of the matrix (number of rows/columns)
+      crs_col_t n;
+
+      //! the start of the names of the files, a number and .bin are added
+      std::string prefix;
+
+      //! the first row of every block, followed by the end of the last block
+      std::vector<crs_col_t> first_row;
+
+      //! the file of every block, shared by the copies, removes the files when destroyed
+      std::shared_ptr< std::vector<std::string> > files;
+
+      //! the size of the file of every block
+      std::vector<std::size_t> file_size;
+
+      //! the number of non-zero elements in all blocks
+      crs_row_t nnz;
+
+      //! the two blocks in memory: the one being multiplied and the next one being read
+      mutable std::vector<SparseMatrix_CRS> buffer;
+
+      //! the bytes read, the time spent reading (in the second thread) and waiting for it, since the start
+      mutable std::size_t bytes_read;
+      mutable double read_time, wait_time;
+};
+
+}
+
+#endif /* SPARSEMATRIX_OOC_H */
+
+/* vim: set ts=3 sw=3 expandtab :*/
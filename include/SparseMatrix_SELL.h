@@ -0,0 +1,76 @@
+#ifndef SPARSEMATRIX_SELL_H
+#define SPARSEMATRIX_SELL_H
+
+#include <vector>
+#include <string>
+
+#include "SparseMatrix_CRS.h"
+
+namespace helpers {
+
+/**
+ * Symmetric sparse n x n matrix in the sliced ELLPACK format (SELL-C-sigma),
+ * made from the upper diagonal part in a SparseMatrix_CRS. The rows are sorted on
+ * their number of off-diagonal elements within windows of sigma rows and then
+ * grouped in chunks of C rows. A chunk is padded up to its longest row and stored
+ * column by column: element p of the C rows of a chunk are next to each other. The
+ * product then loads C values at once and gathers the C matching elements of x in
+ * one instruction (AVX2 or AVX-512, see mvprod()). The diagonal is stored apart.
+ *
+ * The matrix can not be changed after the conversion, make a new one instead.
+ * This format is experimental: on the DOCI matrices it was not measurably faster
+ * than SparseMatrix_CRS, as the scatter to the lower diagonal part stays scalar.
+ */
+class SparseMatrix_SELL
+{
+   public:
+
+      SparseMatrix_SELL(const SparseMatrix_CRS &, crs_col_t sigma = 128);
+
+      virtual ~SparseMatrix_SELL() = default;
+
+      crs_col_t gn() const;
+
+      void mvprod(const double *, double *) const;
+
+      void mvprod(const double *, double *, double) const;
+
+      crs_row_t NumOfEl() const;
+
+      std::vector<crs_col_t> RowPartition(int) const;
+
+      std::string Placement() const;
+
+      //! the number of rows in a chunk: one AVX-512 vector of doubles
+      static const unsigned int C = 8;
+
+   private:
+
+      void mvprod_chunk(crs_col_t c, const double *x, double *acc, bool simd) const;
+
+      //! dimension of the matrix (number of rows/columns)
+      crs_col_t n;
+
+      //! the number of rows in a sorting window, a multiple of C
+      crs_col_t sigma;
+
+      //! the off-diagonal values, chunk after chunk, column major within a chunk
+      std::vector<double, default_init_allocator<double>> data;
+      //! the column indices of data, padding points to the own row
+      std::vector<crs_col_t, default_init_allocator<crs_col_t>> col;
+      //! the start of every chunk in data (size number of chunks + 1)
+      std::vector<crs_row_t> chunk;
+      //! the row that is stored in every slot of a chunk
+      std::vector<crs_col_t> rows;
+      //! the diagonal element of every slot (0 for the padding rows of the last chunk)
+      std::vector<double> diagonal;
+
+      //! private accumulation buffers of the threads in mvprod()
+      mutable std::vector<double> mvprod_buffer;
+};
+
+}
+
+#endif /* SPARSEMATRIX_SELL_H */
+
+/* vim: set ts=3 sw=3 expandtab :*/
@@ -45,6 +45,8 @@ class Sym_Molecule: public Molecule
 
         CheMPS2::Hamiltonian& getHamObject();
 
+        static void ReadHeader(std::string filename, unsigned int &L, unsigned int &N);
+
     private:
 
         std::unique_ptr<CheMPS2::Hamiltonian> ham;
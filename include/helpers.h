@@ -22,7 +22,12 @@
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <string>
 #include <cstring>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <assert.h>
 
 /**
@@ -97,6 +102,126 @@ class matrix
         int m;
 };
 
+/**
+ * Allocator for std::vector that aligns the memory on a given
+ * boundary (default a cache line of 64 bytes)
+ */
+template<typename T, std::size_t Align = 64>
+class aligned_allocator
+{
+    public:
+        typedef T value_type;
+
+        template<typename U>
+        struct rebind { typedef aligned_allocator<U, Align> other; };
+
+        aligned_allocator() = default;
+
+        template<typename U>
+        aligned_allocator(const aligned_allocator<U, Align> &) { }
+
+        T* allocate(std::size_t count)
+        {
+            void *ptr = nullptr;
+
+            if(posix_memalign(&ptr, Align, count*sizeof(T)))
+                throw std::bad_alloc();
+
+            return static_cast<T*>(ptr);
+        }
+
+        void deallocate(T *ptr, std::size_t)
+        {
+            free(ptr);
+        }
+};
+
+template<typename T, typename U, std::size_t Align>
+bool operator==(const aligned_allocator<T, Align> &, const aligned_allocator<U, Align> &) { return true; }
+
+template<typename T, typename U, std::size_t Align>
+bool operator!=(const aligned_allocator<T, Align> &, const aligned_allocator<U, Align> &) { return false; }
+
+/**
+ * How the pages of the large arrays (the sparse matrix, the Krylov vectors)
+ * are placed on the NUMA nodes, see GetNumaPolicy()
+ */
+enum class NumaPolicy
+{
+    //! no special treatment: the pages go where they are touched first (often by one thread)
+    Off,
+    //! every thread touches first the rows it handles in the matrix-vector product
+    FirstTouch,
+    //! spread the pages round robin over all nodes
+    Interleave
+};
+
+NumaPolicy GetNumaPolicy();
+
+bool Diagnostics();
+
+bool ParseCount(const char *, unsigned long long &);
+
+void NumaInterleave(void *, std::size_t);
+
+std::string NumaPlacement(const void *, std::size_t);
+
+std::size_t AvailableMemory();
+
+unsigned long long HashBytes(const void *, std::size_t, unsigned long long = 14695981039346656037ull);
+
+/**
+ * Counts the hardware cache misses of all OpenMP threads from the construction
+ * until Stop(), with the Linux performance counters (one per thread). These are
+ * often not available (e.g. in containers): Stop() then returns -1.
+ */
+class CacheMissCounter
+{
+    public:
+        CacheMissCounter();
+
+        ~CacheMissCounter();
+
+        CacheMissCounter(const CacheMissCounter &) = delete;
+
+        CacheMissCounter& operator=(const CacheMissCounter &) = delete;
+
+        long long Stop();
+
+    private:
+        //! the file descriptor of the counter of every thread, -1 if it failed
+        std::vector<int> fds;
+};
+
+/**
+ * Allocator for std::vector that leaves new elements uninitialized in resize()
+ * (default instead of value initialization). The pages of a large array are
+ * then only touched by the thread that writes them first.
+ */
+template<typename T, typename A = std::allocator<T>>
+class default_init_allocator : public A
+{
+        typedef std::allocator_traits<A> a_t;
+
+    public:
+        template<typename U>
+        struct rebind { typedef default_init_allocator<U, typename a_t::template rebind_alloc<U>> other; };
+
+        using A::A;
+
+        template<typename U>
+        void construct(U *ptr) noexcept(std::is_nothrow_default_constructible<U>::value)
+        {
+            ::new(static_cast<void *>(ptr)) U;
+        }
+
+        template<typename U, typename... Args>
+        void construct(U *ptr, Args&&... args)
+        {
+            a_t::construct(static_cast<A &>(*this), ptr, std::forward<Args>(args)...);
+        }
+};
+
 }
 
 #endif /* MATRIX_H */